@@ -22,11 +22,21 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <malloc.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // The data structure
 //
 // An image is stored in a structure containing 3 fields:
@@ -39,6 +49,16 @@
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
 // 
+// Alternatively, an image may be created with a tiled layout
+// (LAYOUT_TILED), where the image is divided in TILESIZE x TILESIZE tiles,
+// each stored as a raster scan of TILESIZE*TILESIZE bytes, and the tiles
+// themselves are stored in raster order.  Tiles on the right and bottom
+// edges are padded to full size.  Pixels that are close in a column are
+// then close in memory too.
+// Internal functions access pixels either through G(), or through spans:
+// runs of pixels of a row that are contiguous in memory (whole rows, in the
+// raster layout).
+//
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
@@ -51,9 +71,29 @@ struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  ImageLayout layout;
+  int tilesX;   // number of tiles in a row of tiles (LAYOUT_TILED only)
+  uint8* pixel; // pixel data (a raster scan, or tiles)
+  uint64 generation;  // number of modifications of the pixels
+  // Cached statistics (see "Cached statistics" below)
+  pthread_mutex_t lock;
+  int cached;         // STATS_* flags of the valid statistics
+  uint8 min, max;     // STATS_MINMAX
+  uint64 hist[256];   // STATS_HIST
+  // The file last loaded or saved (see "Dirty rows" below)
+  uint64* dirty;      // bit y set if row y changed since, or NULL if none
+  dev_t dev;          // identity of the file, as it was then
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  off_t offset;       // of the pixels in the file
 };
 
+// Tile geometry for LAYOUT_TILED
+#define TILEBITS 6
+#define TILESIZE (1 << TILEBITS)
+#define TILEMASK (TILESIZE - 1)
+
 
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
@@ -74,11 +114,28 @@ struct image {
 //
 // Additional information:  man 3 errno;  man 3 error;
 
+// These variables are per-thread, so that the library is reentrant.
+
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
+
+// Error cause (of threads with no context bound)
+static _Thread_local char* errCause;
+
+// Library context: the state of the calls made while it is bound
+struct imageContext {
+  char* errCause;
+  unsigned long count[NUMCOUNTERS];
+};
+
+// Context bound to this thread, if any
+static _Thread_local ImageContext context;
 
-// Error cause
-static char* errCause;
+// Where this thread counts: InstrCount in the thread that called
+// ImageInit, the counters of the bound context, or NULL for atomic
+// additions to InstrCount.
+static _Thread_local unsigned long* counters;
+static _Thread_local unsigned long* homeCounters;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -89,7 +146,7 @@ static char* errCause;
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
 char* ImageErrMsg() { ///
-  return errCause;
+  return context != NULL ? context->errCause : errCause;
 }
 
 
@@ -137,26 +194,508 @@ char* ImageErrMsg() { ///
 // Propagates the condition.
 // Preserves global errno!
 static int check(int condition, const char* failmsg) {
-  errCause = (char*)(condition ? "" : failmsg);
+  char* cause = (char*)(condition ? "" : failmsg);
+  if (context != NULL) context->errCause = cause; else errCause = cause;
   return condition;
 }
 
 
+#if INSTR_LEVEL > 0
+// Publishes the memory accounting in the counters (see below)
+static void memUpdate(int reset);
+#endif
+
+// Number of threads for operations on whole images (see parallelRows),
+// including the caller, and its maximum
+static int poolThreads = 1;
+#define MAXTHREADS 64
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply calibrate instrumentation and set names of counters,
+/// and choose the number of threads (see ImageInitThreads).
+/// (Calibration is skipped when instrumentation is off.)
 void ImageInit(void) { ///
+  ImageInitThreads(0);
+}
+
+/// Init Image library, with up to nthreads threads for the operations on
+/// whole images.  (Call once, instead of ImageInit!)
+/// If nthreads <= 0, it is taken from environment variable
+/// IMAGE8BIT_THREADS, or else it is the number of online processors.
+void ImageInitThreads(int nthreads) { ///
+  if (nthreads <= 0) {
+    const char* env = getenv("IMAGE8BIT_THREADS");
+    if (env != NULL) nthreads = atoi(env);
+  }
+  if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  poolThreads = nthreads < 1 ? 1 : nthreads < MAXTHREADS ? nthreads : MAXTHREADS;
+#if INSTR_LEVEL > 0
   InstrCalibrate();
+#endif
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   InstrName[1] = "LocCount"; // InstrCount[0] vai contar LocateSubimages
-  
+#if INSTR_LEVEL > 0
+  InstrName[2] = "memlive";    // bytes allocated now
+  InstrName[3] = "mempeak";    // maximum of memlive
+  InstrName[4] = "memtotal";   // bytes allocated
+  InstrName[5] = "allocs";     // number of allocations
+  InstrUpdate = memUpdate;
+#endif
+  homeCounters = InstrCount;  // this thread counts without atomics
+  if (context == NULL) counters = homeCounters;
+}
+
+/// Number of threads used by operations on whole images (1: serial).
+int ImageThreads(void) { ///
+  return poolThreads;
+}
+
+
+/// Library contexts
+
+/// Create a new context, with no error cause and all counters at zero.
+ImageContext ImageContextCreate(void) { ///
+  ImageContext ctx = calloc(1, sizeof(struct imageContext));
+  check(ctx != NULL, "Allocating context");
+  return ctx;
+}
+
+/// Destroy the context pointed to by (*ctxp), which must not be bound.
+void ImageContextDestroy(ImageContext* ctxp) { ///
+  assert (ctxp != NULL);
+  assert (*ctxp != context);
+  free(*ctxp);
+  *ctxp = NULL;
+}
+
+/// Bind ctx to the calling thread, or unbind the current one if ctx==NULL.
+ImageContext ImageContextBind(ImageContext ctx) { ///
+  ImageContext prev = context;
+  context = ctx;
+  counters = ctx != NULL ? ctx->count : homeCounters;
+  return prev;
+}
+
+/// Error cause of the last failure while ctx was bound (NULL if none).
+char* ImageContextErrMsg(ImageContext ctx) { ///
+  assert (ctx != NULL);
+  return ctx->errCause;
+}
+
+/// Instrumentation counters of ctx.
+unsigned long* ImageContextCounters(ImageContext ctx) { ///
+  assert (ctx != NULL);
+  return ctx->count;
 }
 
 // Macros to simplify accessing instrumentation counters:
 #define PIXMEM InstrCount[0]
 #define LocateCompar InstrCount[1]
+#define MEMLIVE InstrCount[2]
+#define MEMPEAK InstrCount[3]
+#define MEMTOTAL InstrCount[4]
+#define MEMALLOCS InstrCount[5]
 
+// Counting is done at the instrumentation level chosen at build time
+// (see INSTR_LEVEL in image8bit.h):
+//   COUNT(counter, n) adds n to counter at levels 1 and 2; bulk operations
+//   use it once per row or once per call, with their exact counts.
+//   COUNT_PIXEL(counter, n) adds n to counter at level 2 only; it is used
+//   by the single pixel accessors ImageGetPixel and ImageSetPixel.
+// Both add to this thread's counters (see ImageInit and ImageContextBind).
+#if INSTR_LEVEL > 0
+#define COUNT(counter, n) addCount(&(counter), (n))
+#else
+#define COUNT(counter, n) ((void)(n))
+#endif
+#if INSTR_LEVEL > 1
+#define COUNT_PIXEL(counter, n) addCount(&(counter), (n))
+#else
+#define COUNT_PIXEL(counter, n) ((void)(n))
+#endif
+
+
+// Add n to counter (an element of InstrCount), or to the same counter of
+// the bound context.
+static inline void addCount(unsigned long* counter, unsigned long n) {
+  if (counters != NULL) {
+    counters[counter - InstrCount] += n;
+  } else {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+  }
+}
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// (Operations that use G() directly count their accesses in bulk.)
+
+
+// Memory accounting
+//
+// Images and scratch buffers are allocated through the functions below,
+// which account for the bytes actually reserved (malloc_usable_size):
+// the bytes live now and their peak, in all threads, and the bytes and
+// number of allocations, in this thread's counters (as for COUNT).
+// Arrays returned to the caller (by ImageLabel) are not accounted for,
+// as they are freed by the caller.
+
+// Live bytes, and their maximum since InstrReset (updated atomically)
+static unsigned long memLive;
+static unsigned long memPeak;
+
+static void memAdd(void* p) {
+#if INSTR_LEVEL > 0
+  if (p == NULL) return;
+  unsigned long size = malloc_usable_size(p);
+  unsigned long live = __atomic_add_fetch(&memLive, size, __ATOMIC_RELAXED);
+  unsigned long peak = __atomic_load_n(&memPeak, __ATOMIC_RELAXED);
+  while (live > peak && !__atomic_compare_exchange_n(&memPeak, &peak, live, 1,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  COUNT(MEMTOTAL, size);
+  COUNT(MEMALLOCS, 1);
+#endif
+}
+
+static void memSub(void* p) {
+#if INSTR_LEVEL > 0
+  if (p != NULL) __atomic_sub_fetch(&memLive, malloc_usable_size(p), __ATOMIC_RELAXED);
+#endif
+}
+
+static void* memAlloc(size_t size) {
+  void* p = malloc(size);
+  memAdd(p);
+  return p;
+}
+
+static void* memCalloc(size_t count, size_t size) {
+  void* p = calloc(count, size);
+  memAdd(p);
+  return p;
+}
+
+static void* memRealloc(void* old, size_t size) {
+  memSub(old);
+  void* p = realloc(old, size);
+  memAdd(p != NULL ? p : old);  // old is still allocated on failure
+  return p;
+}
+
+static void memFree(void* p) {
+  memSub(p);
+  free(p);
+}
+
+// Publish the live and peak bytes in the counters (see InstrUpdate).
+#if INSTR_LEVEL > 0
+static void memUpdate(int reset) {
+  unsigned long live = __atomic_load_n(&memLive, __ATOMIC_RELAXED);
+  if (reset) __atomic_store_n(&memPeak, live, __ATOMIC_RELAXED);
+  MEMLIVE = live;
+  MEMPEAK = __atomic_load_n(&memPeak, __ATOMIC_RELAXED);
+}
+#endif
+
+/// Memory used by the library.
+/// Sets *stats to the bytes of images and scratch buffers allocated now
+/// and at most since the last InstrReset, in all threads, and to the bytes
+/// allocated and number of allocations since then, in the counters of the
+/// calling thread.  (All are 0 if instrumentation is off.)
+void ImageMemory(ImageMemStats* stats) { ///
+  assert (stats != NULL);
+  const unsigned long* c = counters != NULL ? counters : InstrCount;
+  stats->live = __atomic_load_n(&memLive, __ATOMIC_RELAXED);
+  stats->peak = __atomic_load_n(&memPeak, __ATOMIC_RELAXED);
+  stats->total = c[&MEMTOTAL - InstrCount];
+  stats->allocs = c[&MEMALLOCS - InstrCount];
+}
+
+
+// Pixel layout
+
+// Size of the pixel array of img, including tile padding.
+static size_t pixelBytes(Image img) {
+  if (img->layout == LAYOUT_RASTER) return (size_t)img->width*img->height;
+  size_t tilesY = ((size_t)img->height + TILEMASK) >> TILEBITS;
+  return ((size_t)img->tilesX*tilesY) << 2*TILEBITS;
+}
+
+// Address of pixel (x,y), and in *len the number of pixels from (x,y) on
+// that are contiguous in memory, up to the end of row y.
+static inline uint8* span(Image img, int x, int y, int* len) {
+  if (img->layout == LAYOUT_RASTER) {
+    *len = img->width - x;
+    return img->pixel + (size_t)y*img->width + x;
+  }
+  int end = (x | TILEMASK) + 1;  // start of the next tile
+  *len = (end < img->width ? end : img->width) - x;
+  size_t tile = (size_t)(y >> TILEBITS)*img->tilesX + (x >> TILEBITS);
+  return img->pixel + (tile << 2*TILEBITS) + ((y & TILEMASK) << TILEBITS) + (x & TILEMASK);
+}
+
+// Copy n pixels of row y, starting at column x, to buf.
+static void getRow(Image img, int x, int y, int n, uint8* buf) {
+  while (n > 0) {
+    int len;
+    const uint8* p = span(img, x, y, &len);
+    if (len > n) len = n;
+    memcpy(buf, p, len);
+    buf += len;
+    x += len;
+    n -= len;
+  }
+}
+
+// Copy n pixels from buf to row y, starting at column x.
+static void putRow(Image img, int x, int y, int n, const uint8* buf) {
+  while (n > 0) {
+    int len;
+    uint8* p = span(img, x, y, &len);
+    if (len > n) len = n;
+    memcpy(p, buf, len);
+    buf += len;
+    x += len;
+    n -= len;
+  }
+}
+
+// Access n pixels of row y, starting at column x, as an array.
+// Returns their address if they are contiguous in memory (always, in the
+// raster layout); otherwise copies them to buf (with room for n pixels)
+// and returns buf.  Modified pixels must be stored back with rowEnd.
+static uint8* rowBegin(Image img, int x, int y, int n, uint8* buf) {
+  int len;
+  uint8* p = span(img, x, y, &len);
+  if (len >= n) return p;
+  getRow(img, x, y, n, buf);
+  return buf;
+}
+
+// Like rowBegin, for pixels that will be overwritten without being read.
+static uint8* rowOut(Image img, int x, int y, int n, uint8* buf) {
+  int len;
+  uint8* p = span(img, x, y, &len);
+  return len >= n ? p : buf;
+}
+
+// Store back the row obtained from rowBegin or rowOut, if it is a copy.
+static void rowEnd(Image img, int x, int y, int n, const uint8* row, const uint8* buf) {
+  if (row == buf) putRow(img, x, y, n, buf);
+}
+
+
+// Parallel loops
+//
+// Operations on whole images process their rows in bands, in parallel, in
+// a pool of threads with work-stealing deques.  A loop starts as a single
+// task covering all rows.  The thread that runs a task larger than the
+// grain splits it in two, pushes the second half on the bottom of its own
+// deque and goes on with the first half.  Threads take tasks from the
+// bottom of their own deque first (the most recent and smallest, whose
+// rows are probably still in cache), and when it is empty they steal from
+// the top of the others' (the oldest and largest).  Threads that are not
+// in the pool (the callers) share deque 0, and run tasks too while waiting
+// for their loops to end, so loops may be nested or run concurrently.
+//
+// The deques are protected by one mutex each, which is simpler than a
+// lock-free deque and cheap enough for tasks of tens of thousands of pixels.
+//
+// The row functions run in other threads: they must not use COUNT, nor
+// set errCause.  The callers count the pixels accessed themselves.
+
+// Minimum number of pixels in a band of rows processed in parallel.
+// Images with fewer pixels than two bands are processed serially.
+#define BANDPIXELS (1 << 15)
+
+// Function applied to the rows [y0, y1) of a loop
+typedef void (*RowFunc)(void* arg, int y0, int y1);
+
+typedef struct {
+  RowFunc fn;
+  void* arg;
+  int grain;      // maximum rows in a task (a multiple of TILESIZE)
+  int remaining;  // rows not yet done (updated atomically)
+  int done;       // set when remaining reaches 0 (protected by pool.lock)
+} Loop;
+
+typedef struct {
+  Loop* loop;
+  int y0, y1;
+} Task;
+
+// Tasks are stored in task[top..bottom-1]; the owner pushes and pops at the
+// bottom, other threads steal at the top.
+typedef struct {
+  pthread_mutex_t lock;
+  Task* task;
+  int top, bottom, capacity;
+} Deque;
+
+static struct {
+  pthread_once_t once;
+  int started;              // number of pool threads running
+  Deque deque[MAXTHREADS];  // deque[0] is shared by the callers
+  int queued;               // tasks in all deques (updated atomically)
+  int idle;                 // pool threads waiting for work
+  pthread_mutex_t lock;
+  pthread_cond_t work;      // signalled when tasks are pushed
+  pthread_cond_t loopDone;  // broadcast when a loop ends
+} pool = {
+  .once = PTHREAD_ONCE_INIT,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .loopDone = PTHREAD_COND_INITIALIZER,
+};
+
+// Index of the deque of this thread (0 outside the pool)
+static _Thread_local int self;
+
+// Push t on the bottom of deque d.  Returns 0 if there is no memory for it.
+static int pushTask(Deque* d, Task t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->capacity) {
+    if (d->top > 0) {  // reuse the room freed by thieves
+      memmove(d->task, d->task + d->top, (d->bottom - d->top)*sizeof(Task));
+      d->bottom -= d->top;
+      d->top = 0;
+    } else {
+      int capacity = d->capacity > 0 ? 2*d->capacity : 64;
+      Task* task = realloc(d->task, capacity*sizeof(Task));
+      if (task == NULL) {
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+      }
+      d->task = task;
+      d->capacity = capacity;
+    }
+  }
+  d->task[d->bottom++] = t;
+  pthread_mutex_unlock(&d->lock);
+  __atomic_add_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&pool.lock);
+  if (pool.idle > 0) pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  return 1;
+}
+
+// Take a task from the bottom (own deque) or top (others) of deque d.
+static int popTask(Deque* d, int bottom, Task* t) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->top < d->bottom) {
+    *t = bottom ? d->task[--d->bottom] : d->task[d->top++];
+    if (d->top == d->bottom) d->top = d->bottom = 0;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  if (found) __atomic_sub_fetch(&pool.queued, 1, __ATOMIC_SEQ_CST);
+  return found;
+}
+
+// Take a task to run: from this thread's deque, or else stolen from the
+// others, round-robin.  Returns 0 if there are none.
+static int takeTask(Task* t) {
+  if (__atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST) == 0) return 0;
+  if (popTask(&pool.deque[self], 1, t)) return 1;
+  int n = pool.started + 1;
+  for (int i = 1; i < n; i++) {
+    if (popTask(&pool.deque[(self + i) % n], 0, t)) return 1;
+  }
+  return 0;
+}
+
+// Run task t, splitting it down to the grain.
+static void runTask(Task t) {
+  Loop* loop = t.loop;
+  while (t.y1 - t.y0 > loop->grain) {
+    int bands = (t.y1 - t.y0 + loop->grain - 1) / loop->grain;
+    int mid = t.y0 + bands/2*loop->grain;
+    if (!pushTask(&pool.deque[self], (Task){ loop, mid, t.y1 })) break;
+    t.y1 = mid;
+  }
+  loop->fn(loop->arg, t.y0, t.y1);
+  if (__atomic_sub_fetch(&loop->remaining, t.y1 - t.y0, __ATOMIC_ACQ_REL) == 0) {
+    pthread_mutex_lock(&pool.lock);
+    loop->done = 1;
+    pthread_cond_broadcast(&pool.loopDone);
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+static void* poolThread(void* arg) {
+  self = (int)(intptr_t)arg;
+  for (;;) {
+    Task t;
+    if (takeTask(&t)) {
+      runTask(t);
+      continue;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.idle++;
+    while (__atomic_load_n(&pool.queued, __ATOMIC_SEQ_CST) == 0) {
+      pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    pool.idle--;
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return NULL;
+}
+
+// Start the pool threads (once).
+static void poolStart(void) {
+  for (int i = 0; i < poolThreads; i++) pthread_mutex_init(&pool.deque[i].lock, NULL);
+  int saved = errno;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (int i = 1; i < poolThreads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, poolThread, (void*)(intptr_t)i) != 0) break;
+    pool.started = i;
+  }
+  pthread_attr_destroy(&attr);
+  errno = saved;
+}
+
+// Apply fn(arg, y0, y1) to bands of the rows [0, height) of an image of the
+// given width, in parallel, and return when all are done.  Bands have a
+// multiple of TILESIZE rows, so that no tile is shared by two bands, and at
+// least BANDPIXELS pixels.  Small images are processed in this thread.
+static void parallelRows(int width, int height, RowFunc fn, void* arg) {
+  int grain = BANDPIXELS / (width > 0 ? width : 1);
+  grain = (grain + TILEMASK) & ~TILEMASK;
+  if (grain == 0) grain = TILESIZE;
+  if (poolThreads > 1 && height > grain) pthread_once(&pool.once, poolStart);
+  if (poolThreads <= 1 || height <= grain || pool.started == 0) {
+    fn(arg, 0, height);
+    return;
+  }
+  Loop loop = { fn, arg, grain, height, 0 };
+  runTask((Task){ &loop, 0, height });
+  // Help with any tasks until this loop is done.  (The loop must not be
+  // left before its last task has set done, as it is on this stack.)
+  Task t;
+  while (__atomic_load_n(&loop.remaining, __ATOMIC_ACQUIRE) > 0 && takeTask(&t)) runTask(t);
+  pthread_mutex_lock(&pool.lock);
+  while (!loop.done) pthread_cond_wait(&pool.loopDone, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Arguments of the row functions of the operations on whole images.
+// The reductions (min, max, hist, count) are updated under lock, once
+// per band.
+typedef struct {
+  Image img;             // the image processed
+  Image out;             // the new image (geometric transformations)
+  int x, y;              // offset (crop) or radius (blur)
+  uint8 thr;             // threshold
+  double factor;         // brightening factor
+  const uint8* lut;      // look-up table
+  pthread_mutex_t lock;
+  uint8 min, max;        // levels found
+  int full;              // min and max are 0 and maxval (updated atomically)
+  uint64* hist;          // histogram
+  unsigned long count;   // pixels read
+} Rows;
 
 
 /// Image management functions
@@ -169,26 +708,40 @@ void ImageInit(void) { ///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  return ImageCreateLayout(width, height, maxval, LAYOUT_RASTER);
+}
 
-Image ImageCreate(int width, int height, uint8 maxval) {   //---------------- Função escrita dia 6/11/2023
+/// Create a new black image with the given pixel layout.
+/// As ImageCreate, which creates images with LAYOUT_RASTER.
+Image ImageCreateLayout(int width, int height, uint8 maxval, ImageLayout layout) {   //---------------- Função escrita dia 6/11/2023
   assert (width >= 0);
   assert (height >= 0);
   assert (0 < maxval && maxval <= PixMax);
-  Image img = (Image)malloc(sizeof(struct image));  //Aloca memória para a imagem
-  if (img == NULL){                          // Se a alocação de memória para a imagem falhar    
-    printf("ERRO: A imagem não existe");       // é impressa uma mensagem de erro
-    ImageErrMsg();                             //
-    return img;                              // e devolvido o valor NULL
+  Image img = (Image)memAlloc(sizeof(struct image));  //Aloca memória para a imagem
+  if (!check(img != NULL, "Allocating image")){  // Se a alocação de memória para a imagem falhar    
+    return img;                              // é devolvido o valor NULL
   }                                            
 
   img->width = width;                        //  
   img->height = height;                      // Atribui width, height e maxval à estrutura da imagem
   img->maxval = maxval;                      //
+  img->layout = layout;
+  img->tilesX = (width + TILEMASK) >> TILEBITS;
 
-  img->pixel=(uint8*)malloc(sizeof(uint8)*height*width);    //Aloca memória para os pixeis da imagem
-  for (int i = 0; i < width*height; i++){                     //
-    img->pixel[i] = 0;                                      //Inicializa todos os pixeis da imagem para a cor preto (0)
+  size_t size = pixelBytes(img);
+  img->pixel=(uint8*)memAlloc(size + 1);                        //Aloca memória para os pixeis da imagem
+  if (!check(img->pixel != NULL, "Allocating pixels")) {
+    errsave = errno;
+    memFree(img);
+    errno = errsave;
+    return NULL;
   }
+  memset(img->pixel, 0, size);                                //Inicializa todos os pixeis da imagem para a cor preto (0)
+  img->generation = 0;
+  img->cached = 0;
+  img->dirty = NULL;
+  pthread_mutex_init(&img->lock, NULL);
                                                               
   return img;                                               
 }
@@ -201,8 +754,10 @@ Image ImageCreate(int width, int height, uint8 maxval) {   //---------------- Fu
 void ImageDestroy(Image* img) {                     //---------------- Função escrita dia 12/11/2023
   assert (img != NULL);
   if (*img != NULL){  
-    free((*img)->pixel);        //Liberta a memória alocada para os pixeis
-    free(*img);                 //Liberta a memória alocada para a imagem
+    pthread_mutex_destroy(&(*img)->lock);
+    memFree((*img)->dirty);
+    memFree((*img)->pixel);        //Liberta a memória alocada para os pixeis
+    memFree(*img);                 //Liberta a memória alocada para a imagem
     *img = NULL;                //Define o ponteiro para NULL
   }
 }
@@ -224,34 +779,257 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Parse a PGM header from f, leaving f at the first pixel.
+// Returns nonzero on success.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+/// Dirty rows
+
+// An image loaded from or saved to a regular file remembers that file
+// (its identity, size, modification time and pixel offset), and keeps a
+// bitmap of the rows modified since.  ImageSave to the same file, if it
+// was not changed meanwhile, then only rewrites the dirty rows.
+// Images with no file have no bitmap, and do not track their rows.
+
+// Record a modification of rows [y0, y1) of img (but not of its stats).
+static void touched(Image img, int y0, int y1) {
+  img->generation++;
+  if (img->dirty == NULL) return;
+  int y = y0;
+  for (; y < y1 && (y & 63) != 0; y++) img->dirty[y >> 6] |= (uint64)1 << (y & 63);
+  for (; y + 64 <= y1; y += 64) img->dirty[y >> 6] = ~(uint64)0;
+  for (; y < y1; y++) img->dirty[y >> 6] |= (uint64)1 << (y & 63);
+}
+
+// Remember file fd, with the pixels of img at offset, as in sync with img.
+// (Not remembering it is harmless, so this never fails.)
+static void synced(Image img, int fd, off_t offset) {
+  struct stat st;
+  size_t words = ((size_t)img->height + 63) >> 6;
+  if (offset < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    memFree(img->dirty);
+    img->dirty = NULL;
+    return;
+  }
+  if (img->dirty == NULL) img->dirty = memAlloc(words*sizeof(uint64) + 1);
+  if (img->dirty == NULL) return;
+  memset(img->dirty, 0, words*sizeof(uint64));
+  img->dev = st.st_dev;
+  img->ino = st.st_ino;
+  img->size = st.st_size;
+  img->mtime = st.st_mtim;
+  img->offset = offset;
+}
+
+// Rows per write in saveDirty
+#define DIRTYROWS 64
+
+// Rewrite the dirty rows of img in file fd, if it is the file img remembers,
+// unchanged since, and its header matches img.
+// Returns 1 if the file is now up to date, or 0 if it must be rewritten.
+static int saveDirty(Image img, int fd) {
+  struct stat st;
+  if (img->dirty == NULL || fstat(fd, &st) < 0 ||
+      st.st_dev != img->dev || st.st_ino != img->ino || st.st_size != img->size ||
+      st.st_mtim.tv_sec != img->mtime.tv_sec || st.st_mtim.tv_nsec != img->mtime.tv_nsec) {
+    return 0;
+  }
+  // Check the header anyway
+  char header[256];
+  int w, h, maxval;
+  if (img->offset > (off_t)sizeof header || pread(fd, header, img->offset, 0) != img->offset) return 0;
+  FILE* f = fmemopen(header, img->offset, "r");
+  if (f == NULL) return 0;
+  int same = readHeader(f, &w, &h, &maxval) && ftell(f) == img->offset &&
+             w == img->width && h == img->height && maxval == img->maxval;
+  fclose(f);
+  if (!same) return 0;
+
+  w = img->width;
+  uint8* buf = NULL;
+  if (img->layout != LAYOUT_RASTER && (buf = memAlloc((size_t)DIRTYROWS*w + 1)) == NULL) return 0;
+  unsigned long count = 0;
+  int ok = 1;
+  for (int y = 0; y < img->height && ok; ) {
+    if (!(img->dirty[y >> 6] >> (y & 63) & 1)) {
+      y++;
+      continue;
+    }
+    // Rows [y, y1) are dirty
+    int y1 = y + 1;
+    while (y1 < img->height && y1 - y < DIRTYROWS && (img->dirty[y1 >> 6] >> (y1 & 63) & 1)) y1++;
+    size_t n = (size_t)(y1 - y)*w;
+    const uint8* p = img->pixel + (size_t)y*w;
+    if (buf != NULL) {
+      for (int j = y; j < y1; j++) getRow(img, 0, j, w, buf + (size_t)(j - y)*w);
+      p = buf;
+    }
+    ok = pwrite(fd, p, n, img->offset + (off_t)y*w) == (ssize_t)n;
+    count += n;
+    y = y1;
+  }
+  memFree(buf);
+  COUNT(PIXMEM, count);
+  if (ok) synced(img, fd, img->offset);
+  return ok;
+}
+
+// Rewrite the dirty rows of img in file filename, as saveDirty, with the
+// lock of img held.  Preserves errno.
+static int saveModified(Image img, const char* filename) {
+  if (img->dirty == NULL) return 0;
+  errsave = errno;
+  int fd = open(filename, O_RDWR | O_CLOEXEC);
+  int done = fd >= 0 && saveDirty(img, fd);
+  if (fd >= 0) close(fd);
+  errno = errsave;
+  return done;
+}
+
+/// Rewrite only the modified rows of img in file filename (see ImageSave).
+int ImageSaveModified(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  pthread_mutex_lock(&img->lock);
+  int done = saveModified(img, filename);
+  pthread_mutex_unlock(&img->lock);
+  return done;
+}
+
+/// Record that file fd holds the pixels of img at byte offset.
+void ImageSetFile(Image img, int fd, long offset) { ///
+  assert (img != NULL);
+  errsave = errno;
+  pthread_mutex_lock(&img->lock);
+  synced(img, fd, offset);
+  pthread_mutex_unlock(&img->lock);
+  errno = errsave;
+}
+
+/// Open a file for writing the contents of file filename.
+int ImageReplaceBegin(const char* filename, char* target, char* tmp, size_t size) { ///
+  assert (filename != NULL);
+  assert (target != NULL && tmp != NULL);
+  static unsigned serial = 0;
+  struct stat st;
+  tmp[0] = '\0';
+  // Replace the file a symbolic link points to, not the link
+  char* real = realpath(filename, NULL);
+  int n = snprintf(target, size, "%s", real != NULL ? real : filename);
+  free(real);
+  if (n < 0 || (size_t)n >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int exists = stat(target, &st) == 0;
+  if (exists ? !S_ISREG(st.st_mode) : lstat(target, &st) == 0) {
+    // Devices, pipes, etc. (and links to no file) are written in place
+    return open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  }
+  n = snprintf(tmp, size, "%s.tmp-%ld-%u", target, (long)getpid(),
+               __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+  if (n < 0 || (size_t)n >= size) {
+    tmp[0] = '\0';
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    tmp[0] = '\0';
+    return -1;
+  }
+  if (exists) fchmod(fd, st.st_mode & 07777);  // keep the permissions
+  return fd;
+}
+
+/// Complete or abandon the writing begun by ImageReplaceBegin.
+int ImageReplaceEnd(const char* target, const char* tmp, int ok) { ///
+  assert (target != NULL && tmp != NULL);
+  if (tmp[0] == '\0') return ok;  // written in place
+  if (ok && rename(tmp, target) == 0) return 1;
+  errsave = errno;
+  unlink(tmp);
+  errno = errsave;
+  return 0;
+}
+
+// Read the pixels of img from f, in raster order.
+// Returns nonzero on success.
+static int readPixels(Image img, FILE* f) {
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0, len; x < img->width; x += len) {
+      uint8* p = span(img, x, y, &len);
+      if (fread(p, sizeof(uint8), len, f) != (size_t)len) return 0;
+    }
+  }
+  return 1;
+}
+
+// Write the pixels of img to f, in raster order.
+// Returns nonzero on success.
+static int writePixels(Image img, FILE* f) {
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0, len; x < img->width; x += len) {
+      const uint8* p = span(img, x, y, &len);
+      if (fwrite(p, sizeof(uint8), len, f) != (size_t)len) return 0;
+    }
+  }
+  return 1;
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
+  return ImageLoadLayout(filename, LAYOUT_RASTER);
+}
+
+/// Load a raw PGM file into an image with the given pixel layout.
+Image ImageLoadLayout(const char* filename, ImageLayout layout) { ///
+  FILE* f = NULL;
+  Image img = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  (img = ImageRead(f, layout)) != NULL;
+  if (success) synced(img, fileno(f), ftell(f) - (off_t)img->width*img->height);
+
+  // Cleanup
+  if (f != NULL) {
+    errsave = errno;
+    fclose(f);
+    if (!success) errno = errsave;
+  }
+  return img;
+}
+
+/// Read a raw PGM image from stream f, into an image with the given layout.
+Image ImageRead(FILE* f, ImageLayout layout) { ///
+  assert (f != NULL);
   int w, h;
   int maxval;
-  char c;
-  FILE* f = NULL;
   Image img = NULL;
 
   int success = 
-  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  readHeader(f, &w, &h, &maxval) &&
   // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  (img = ImageCreateLayout(w, h, (uint8)maxval, layout)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( readPixels(img, f) , "Reading pixels" );
+  COUNT(PIXMEM, (unsigned long)(w*h));  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -259,29 +1037,69 @@ Image ImageLoad(const char* filename) { ///
     ImageDestroy(&img);
     errno = errsave;
   }
-  if (f != NULL) fclose(f);
   return img;
 }
 
 /// Save image to PGM file.
+/// If filename is the file img was last loaded from or saved to, unchanged
+/// since, only the rows modified since are rewritten (and if that fails,
+/// the whole file is).  Otherwise, a regular file is written to a temporary
+/// file, which then replaces filename.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// a regular file is left unchanged (or with only some rows updated).
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
+  char target[4096], tmp[4096];
+  FILE* f = NULL;
+  int fd = -1;
+  int errnum = errno;  // restored on success
+  pthread_mutex_lock(&img->lock);  // others may be saving img too
+
+  if (saveModified(img, filename)) {
+    pthread_mutex_unlock(&img->lock);
+    return 1;
+  }
+  int success =
+  check( (fd = ImageReplaceBegin(filename, target, tmp, sizeof tmp)) >= 0, "Open failed" ) &&
+  check( (f = fdopen(fd, "wb")) != NULL, "Open failed" ) &&
+  ImageWrite(img, f) &&
+  check( fflush(f) == 0, "Writing pixels failed" );
+  if (success) synced(img, fileno(f), ftell(f) - (off_t)img->width*img->height);
+  if (f != NULL) {
+    success = check( fclose(f) == 0, "Writing pixels failed" ) && success;
+  } else if (fd >= 0) {
+    close(fd);
+  }
+  if (success) {
+    success = check( ImageReplaceEnd(target, tmp, 1), "Rename failed" );
+  } else if (fd >= 0) {
+    ImageReplaceEnd(target, tmp, 0);  // remove the temporary file
+  }
+  if (!success) {
+    errsave = errno;
+    memFree(img->dirty);  // what was synced was not saved
+    img->dirty = NULL;
+    errno = errsave;
+  } else {
+    errno = errnum;
+  }
+  pthread_mutex_unlock(&img->lock);
+  return success;
+}
+
+/// Write image in raw PGM format to stream f.
+int ImageWrite(Image img, FILE* f) { ///
+  assert (img != NULL);
+  assert (f != NULL);
   int w = img->width;
   int h = img->height;
   uint8 maxval = img->maxval;
-  FILE* f = NULL;
 
   int success =
-  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
   check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
-
-  // Cleanup
-  if (f != NULL) fclose(f);
+  check( writePixels(img, f), "Writing pixels failed" ); 
+  COUNT(PIXMEM, (unsigned long)(w*h));  // count pixel memory accesses
   return success;
 }
 
@@ -308,6 +1126,140 @@ int ImageMaxval(Image img) { ///
   return img->maxval;
 }
 
+/// Get image pixel layout
+ImageLayout ImageGetLayout(Image img) { ///
+  assert (img != NULL);
+  return img->layout;
+}
+
+/// Get the number of modifications of the pixels of img so far.
+uint64 ImageGeneration(Image img) { ///
+  assert (img != NULL);
+  return img->generation;
+}
+
+/// Cached statistics
+
+// ImageStats and ImageHistogram keep their results in the image, and return
+// them directly while the pixels are not modified.  Operations that modify
+// the pixels update the cached statistics when that is cheap (point
+// operations remap the histogram, ImageSetPixel adjusts it), or invalidate
+// them.  Several threads may read an image at once, so the cache is filled
+// and read under the image lock; modifications have exclusive access to
+// the image and need no lock.
+
+#define STATS_MINMAX 1  // min and max are valid
+#define STATS_HIST 2    // hist is valid (and so are min and max)
+
+// Record a modification of rows [y0, y1) of img that invalidates its stats.
+static inline void modified(Image img, int y0, int y1) {
+  touched(img, y0, y1);
+  img->cached = 0;
+}
+
+// Minimum and maximum levels in a histogram (0 if it is empty).
+static void histRange(const uint64 hist[256], uint8* min, uint8* max) {
+  int lo = 0, hi = 255;
+  while (lo < 256 && hist[lo] == 0) lo++;
+  if (lo == 256) lo = hi = 0;
+  while (hi > lo && hist[hi] == 0) hi--;
+  *min = lo;
+  *max = hi;
+}
+
+// Update the stats of img for a point operation that replaces each level v
+// by lut[v].
+static void remapStats(Image img, const uint8 lut[256]) {
+  touched(img, 0, img->height);
+  if (img->cached & STATS_HIST) {
+    uint64 hist[256] = { 0 };
+    for (int v = 0; v < 256; v++) hist[lut[v]] += img->hist[v];
+    memcpy(img->hist, hist, sizeof hist);
+    histRange(img->hist, &img->min, &img->max);
+  } else if (img->cached & STATS_MINMAX) {
+    // Exact if lut is monotonic in [min, max]
+    int up = 1, down = 1;
+    for (int v = img->min; v < img->max; v++) {
+      up &= lut[v] <= lut[v+1];
+      down &= lut[v] >= lut[v+1];
+    }
+    uint8 min = lut[img->min], max = lut[img->max];
+    if (up) {
+      img->min = min;
+      img->max = max;
+    } else if (down) {
+      img->min = max;
+      img->max = min;
+    } else {
+      img->cached = 0;
+    }
+  }
+}
+
+// Update the stats of img for a pixel changing from level old to level.
+static void setStats(Image img, uint8 old, uint8 level) {
+  if (img->cached & STATS_HIST) {
+    img->hist[old]--;
+    img->hist[level]++;
+    if (level < img->min) img->min = level;
+    if (level > img->max) img->max = level;
+    if (img->hist[old] == 0 && (old == img->min || old == img->max)) {
+      histRange(img->hist, &img->min, &img->max);
+    }
+  } else if (img->cached & STATS_MINMAX) {
+    if (level < img->min) img->min = level;
+    if (level > img->max) img->max = level;
+    // The old extreme may have been unique
+    if ((old == img->min && level > old) || (old == img->max && level < old)) {
+      img->cached = 0;
+    }
+  }
+}
+
+// Give dst (a new image with the same levels as src) the stats of src.
+static void copyStats(Image dst, Image src) {
+  pthread_mutex_lock(&src->lock);
+  dst->cached = src->cached;
+  dst->min = src->min;
+  dst->max = src->max;
+  if (src->cached & STATS_HIST) memcpy(dst->hist, src->hist, sizeof dst->hist);
+  pthread_mutex_unlock(&src->lock);
+}
+
+// Minimum and maximum of rows [y0, y1), stopping early when all bands
+// together have found 0 and maxval.
+static void statsRows(void* arg, int y0, int y1) {
+  Rows* r = arg;
+  Image img = r->img;
+  int len;
+  uint8 min = *span(img, 0, y0, &len);
+  uint8 max = min;
+  unsigned long count = 0;
+  for (int y = y0; y < y1 && !__atomic_load_n(&r->full, __ATOMIC_RELAXED); y++){   // percorre todos os pixeis da banda
+    for (int x = 0; x < img->width; x += len){
+      const uint8* p = span(img, x, y, &len);
+      count += len;
+      for (int i = 0; i < len; i++){
+        if (p[i] < min){                                   //verifica se o valor do pixel é inferior a min
+          min = p[i];                                      //se a condição se verificar atribui a min o valor do pixel 
+        }
+        else if (p[i] > max){                              //se a condição não se verificar compara se o valor do pixel é superior a max
+          max = p[i];                                      //se a condição se verificar atribui a max o valor do pixel
+        }
+      }
+      if (min == 0 && max == img->maxval){                 //se o min for 0 e max = maxval 
+        __atomic_store_n(&r->full, 1, __ATOMIC_RELAXED);
+        break;
+      }
+    }
+  }
+  pthread_mutex_lock(&r->lock);
+  if (min < r->min) r->min = min;
+  if (max > r->max) r->max = max;
+  r->count += count;
+  pthread_mutex_unlock(&r->lock);
+}
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -315,20 +1267,131 @@ int ImageMaxval(Image img) { ///
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) {                      //---------------- Função escrita dia 13/11/2023
   assert (img != NULL);
-  *min = img->pixel[0];                                    //define min com o valor do primeiro pixel
-  *max = img->pixel[0];                                    //define max com o valor do primeiro pixel
-  for (long i = 0; i < img->width*img->height; i++){       // percorre todos os pixeis da imagem
-    if (img->pixel[i] < *min){                             //verifica se o valor do pixel é inferior a min
-      *min = img->pixel[i];                                //se a condição se verificar atribui a min o valor do pixel 
-    }
-    else if (img->pixel[i] > *max){                        //se a condição não se verificar compara se o valor do pixel é superior a max
-      *max = img->pixel[i];                                //se a condição se verificar atribui a max o valor do pixel
+  pthread_mutex_lock(&img->lock);
+  int cached = img->cached != 0;
+  *min = img->min;
+  *max = img->max;
+  pthread_mutex_unlock(&img->lock);
+  if (cached) return;
+  Rows r = { .img = img, .lock = PTHREAD_MUTEX_INITIALIZER };
+  r.min = img->pixel[0];                                   //define min com o valor do primeiro pixel
+  r.max = img->pixel[0];                                   //define max com o valor do primeiro pixel
+  parallelRows(img->width, img->height, statsRows, &r);
+  *min = r.min;
+  *max = r.max;
+  COUNT(PIXMEM, r.count);
+  pthread_mutex_lock(&img->lock);
+  img->min = r.min;
+  img->max = r.max;
+  img->cached |= STATS_MINMAX;
+  pthread_mutex_unlock(&img->lock);
+}
+
+// Add the histogram of rows [y0, y1) to r->hist.
+static void histogramRows(void* arg, int y0, int y1) {
+  Rows* r = arg;
+  Image img = r->img;
+  // Consecutive pixels are counted in 4 separate histograms, so that
+  // runs of equal levels do not serialize on the same counter.
+  uint64 sub[4][256];
+  memset(sub, 0, sizeof sub);
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0, len; x < img->width; x += len) {
+      const uint8* p = span(img, x, y, &len);
+      int i = 0;
+      for (; i + 4 <= len; i += 4) {
+        sub[0][p[i]]++;
+        sub[1][p[i+1]]++;
+        sub[2][p[i+2]]++;
+        sub[3][p[i+3]]++;
+      }
+      for (; i < len; i++) sub[0][p[i]]++;
     }
-    
-    if (*min == 0 && *max == img->maxval){                 //se o min for 0 e max = maxval 
-      return;
+  }
+  pthread_mutex_lock(&r->lock);
+  for (int v = 0; v < 256; v++) r->hist[v] += sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+  pthread_mutex_unlock(&r->lock);
+}
+
+/// Gray level histogram
+/// On return, hist[v] is the number of pixels with level v, for v in [0,255].
+void ImageHistogram(Image img, uint64 hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  pthread_mutex_lock(&img->lock);
+  int cached = img->cached & STATS_HIST;
+  if (cached) memcpy(hist, img->hist, sizeof img->hist);
+  pthread_mutex_unlock(&img->lock);
+  if (cached) return;
+  memset(hist, 0, 256*sizeof(uint64));
+  Rows r = { .img = img, .lock = PTHREAD_MUTEX_INITIALIZER, .hist = hist };
+  parallelRows(img->width, img->height, histogramRows, &r);
+  COUNT(PIXMEM, (unsigned long)img->width*img->height);
+  pthread_mutex_lock(&img->lock);
+  memcpy(img->hist, hist, sizeof img->hist);
+  histRange(hist, &img->min, &img->max);
+  img->cached = STATS_HIST | STATS_MINMAX;
+  pthread_mutex_unlock(&img->lock);
+}
+
+/// Number of pixels in histogram hist.
+uint64 ImageHistCount(const uint64 hist[256]) { ///
+  uint64 count = 0;
+  for (int v = 0; v < 256; v++) count += hist[v];
+  return count;
+}
+
+/// Mean and variance of the gray levels in histogram hist.
+void ImageHistMoments(const uint64 hist[256], double* mean, double* variance) { ///
+  double n = 0.0, s = 0.0, s2 = 0.0;
+  for (int v = 0; v < 256; v++) {
+    n += (double)hist[v];
+    s += (double)hist[v]*v;
+    s2 += (double)hist[v]*v*v;
+  }
+  *mean = n > 0.0 ? s/n : 0.0;
+  *variance = n > 0.0 ? s2/n - (*mean)*(*mean) : 0.0;
+  if (*variance < 0.0) *variance = 0.0;  // rounding errors
+}
+
+/// Percentile p of the gray levels in histogram hist, for p in [0.0, 1.0].
+uint8 ImageHistPercentile(const uint64 hist[256], double p) { ///
+  assert (0.0 <= p && p <= 1.0);
+  uint64 count = ImageHistCount(hist);
+  if (count == 0) return 0;
+  uint64 rank = (uint64)ceil(p*(double)count);
+  if (rank < 1) rank = 1;
+  if (rank > count) rank = count;
+  uint64 cum = 0;
+  int v = 0;
+  while ((cum += hist[v]) < rank) v++;
+  return (uint8)v;
+}
+
+/// Otsu threshold of histogram hist.
+uint8 ImageHistOtsu(const uint64 hist[256]) { ///
+  double n = 0.0, s = 0.0;
+  for (int v = 0; v < 256; v++) {
+    n += (double)hist[v];
+    s += (double)hist[v]*v;
+  }
+  // Class 0 is [0, t], class 1 is [t+1, 255].
+  double n0 = 0.0, s0 = 0.0;
+  double best = -1.0;
+  int thr = 1;
+  for (int t = 0; t < 255; t++) {
+    n0 += (double)hist[t];
+    s0 += (double)hist[t]*t;
+    double n1 = n - n0;
+    if (n0 == 0.0 || n1 == 0.0) continue;
+    double d = s0/n0 - (s-s0)/n1;
+    double between = n0*n1*d*d;
+    if (between > best) {
+      best = between;
+      thr = t+1;
     }
   }
+  return (uint8)thr;
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -353,19 +1416,32 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
 // The returned index must satisfy (0 <= index < img->width*img->height)
+// in the raster layout.
 static inline int G(Image img, int x, int y) {
   int index;
   
+  if (img->layout == LAYOUT_TILED) {
+    // Start of the tile, then position (x,y) within the tile
+    int tile = (y >> TILEBITS)*img->tilesX + (x >> TILEBITS);
+    index = (tile << 2*TILEBITS) + ((y & TILEMASK) << TILEBITS) + (x & TILEMASK);
+    assert (ImageValidPos(img, x, y));
+    return index;
+  }
   index = x+(y*img->width);               // (44,2) será o pixel[244] se width=100, 44+2*100. Ou seja index = y*largura + x
   assert (0 <= index && index < img->width*img->height);    //garante que o index é valido para a imagem dada.
   return index;
 }
 
+// Saturate v to [0, maxval].
+static inline uint8 saturate(int64_t v, int maxval) {
+  return (uint8)(v < 0 ? 0 : v > maxval ? maxval : v);
+}
+
 /// Get the pixel (level) at position (x,y).
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
+  COUNT_PIXEL(PIXMEM, 1);  // count one pixel access (read)
   return img->pixel[G(img, x, y)];
 } 
 
@@ -373,10 +1449,98 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
-  img->pixel[G(img, x, y)] = level;
-} 
-
+  COUNT_PIXEL(PIXMEM, 1);  // count one pixel access (store)
+  uint8* p = &img->pixel[G(img, x, y)];
+  touched(img, y, y+1);
+  if (img->cached != 0) {
+    COUNT_PIXEL(PIXMEM, 1);  // and the read of the old level
+    setStats(img, *p, level);
+  }
+  *p = level;
+}
+
+
+/// Row & span access operations
+
+/// Get the address of pixel (x,y).
+uint8* ImageRowPtr(Image img, int x, int y, int* len) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  // Any row may be written through the pointer (with the stride)
+  modified(img, 0, img->height);
+  int n;
+  uint8* p = span(img, x, y, &n);
+  if (len != NULL) *len = n;
+  return p;
+}
+
+/// Record that rows [y0, y1) of img were written through a pointer.
+void ImageRowsModified(Image img, int y0, int y1) { ///
+  assert (img != NULL);
+  assert (0 <= y0 && y0 <= y1 && y1 <= img->height);
+  modified(img, y0, y1);
+}
+
+/// Same as ImageRowPtr, for read-only access.
+const uint8* ImageConstRowPtr(Image img, int x, int y, int* len) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  int n;
+  const uint8* p = span(img, x, y, &n);
+  if (len != NULL) *len = n;
+  return p;
+}
+
+/// Get the distance in memory between pixels (x,y) and (x,y+1).
+int ImageStride(Image img) { ///
+  assert (img != NULL);
+  return img->layout == LAYOUT_RASTER ? img->width : TILESIZE;
+}
+
+/// Copy the n pixels of row y starting at column x to buf.
+void ImageGetRow(Image img, int x, int y, int n, uint8* buf) { ///
+  assert (img != NULL);
+  assert (buf != NULL);
+  assert (ImageValidRect(img, x, y, n, 1));
+  getRow(img, x, y, n, buf);
+  COUNT(PIXMEM, (unsigned long)n);
+}
+
+/// Copy n pixels from buf to row y, starting at column x.
+void ImageSetRow(Image img, int x, int y, int n, const uint8* buf) { ///
+  assert (img != NULL);
+  assert (buf != NULL);
+  assert (ImageValidRect(img, x, y, n, 1));
+  modified(img, y, y+1);
+  putRow(img, x, y, n, buf);
+  COUNT(PIXMEM, (unsigned long)n);
+}
+
+/// Copy the rectangle (x,y,w,h) of img to buf.
+void ImageGetRect(Image img, int x, int y, int w, int h, uint8* buf, int stride) { ///
+  assert (img != NULL);
+  assert (buf != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  assert (stride >= w);
+  for (int j = 0; j < h; j++) {
+    getRow(img, x, y+j, w, buf + (size_t)j*stride);
+  }
+  COUNT(PIXMEM, (unsigned long)w*h);
+}
+
+/// Copy buf to the rectangle (x,y,w,h) of img.
+void ImageSetRect(Image img, int x, int y, int w, int h, const uint8* buf, int stride) { ///
+  assert (img != NULL);
+  assert (buf != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  assert (stride >= w);
+  modified(img, y, y+h);
+  for (int j = 0; j < h; j++) {
+    putRow(img, x, y+j, w, buf + (size_t)j*stride);
+  }
+  COUNT(PIXMEM, (unsigned long)w*h);
+}
+
 
 /// Pixel transformations
 
@@ -386,14 +1550,78 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// They never fail.
 
 
+// Point operations, on rows [y0, y1) of r->img.
+
+static void negativeRows(void* arg, int y0, int y1) {
+  Image img = ((Rows*)arg)->img;
+  for (int y = y0; y < y1; y++){                        //Percorre todos os pixeis da banda
+    for (int x = 0, len; x < img->width; x += len){
+      uint8* p = span(img, x, y, &len);
+      for (int i = 0; i < len; i++){
+        p[i] = img->maxval - p[i];                     //Subtrai ao maxval o valor do pixel obtendo assim o valor novo para o efeito negativo 
+      }
+    }
+  }
+}
+
+static void thresholdRows(void* arg, int y0, int y1) {
+  Image img = ((Rows*)arg)->img;
+  uint8 thr = ((Rows*)arg)->thr;
+  for (int y = y0; y < y1; y++){                               //Percorre todos os pixeis da banda
+    for (int x = 0, len; x < img->width; x += len){
+      uint8* p = span(img, x, y, &len);
+      for (int i = 0; i < len; i++){
+        if (p[i]<thr){                                         //Verifica se o valor do pixel é menor que o valor thr
+          p[i]=0;                                              //Se for transforma o pixel num pixel preto             
+        } else {
+          p[i]=img->maxval;                                    //Caso contrário iguala o valor do pixel a maxval
+        }
+      }
+    }
+  }
+}
+
+static void brightenRows(void* arg, int y0, int y1) {
+  Image img = ((Rows*)arg)->img;
+  double factor = ((Rows*)arg)->factor;
+  for (int y = y0; y < y1; y++){                                   //Percorre todos os pixeis da banda
+    for (int x = 0, len; x < img->width; x += len){
+      uint8* p = span(img, x, y, &len);
+      for (int i = 0; i < len; i++){
+        int NovoValorPixel = p[i]*factor+0.5;                      //Multplicação do valor de cada pixel pelo factor
+        if (NovoValorPixel > img->maxval){                        //Verifica que o novo valor do pixel não excede o valor máximo maxval
+          p[i] = img->maxval;                                      //Se exceder então o valor no novo pixel será maxval
+        }
+        else{
+          p[i] = NovoValorPixel;
+        }
+      }
+    }
+  }
+}
+
+static void lutRows(void* arg, int y0, int y1) {
+  Image img = ((Rows*)arg)->img;
+  const uint8* lut = ((Rows*)arg)->lut;
+  for (int y = y0; y < y1; y++) {
+    for (int x = 0, len; x < img->width; x += len) {
+      uint8* p = span(img, x, y, &len);
+      for (int i = 0; i < len; i++) p[i] = lut[p[i]];
+    }
+  }
+}
+
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) {                                             //---------------- Função escrita dia 13/11/2023
   assert (img != NULL);
-  for (long i = 0; i < img->width*img->height; i++){    //Percorre todos os pixeis da imagem
-    img->pixel[i] = img->maxval - img->pixel[i];     //Subtrai ao maxval o valor do pixel obtendo assim o valor novo para o efeito negativo 
-  }
+  Rows r = { .img = img };
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = (uint8)(img->maxval - v);
+  remapStats(img, lut);
+  parallelRows(img->width, img->height, negativeRows, &r);
+  COUNT(PIXMEM, 2ul*(unsigned long)img->width*img->height);  // one read and one write per pixel
 }
 
 /// Apply threshold to image.
@@ -401,13 +1629,12 @@ void ImageNegative(Image img) {                                             //--
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) {                                  //---------------- Função escrita dia 15/11/2023
   assert (img != NULL);
-  for (long i = 0; i < img->width*img->height; i++){           //Percorre todos os pixeis da imagem
-    if (img->pixel[i]<thr){                                    //Verifica se o valor do pixel é menor que o valor thr
-      img->pixel[i]=0;                                         //Se for transforma o pixel num pixel preto             
-    } else {
-      img->pixel[i]=img->maxval;                               //Caso contrário iguala o valor do pixel a maxval
-    }
-  }
+  Rows r = { .img = img, .thr = thr };
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = v < thr ? 0 : img->maxval;
+  remapStats(img, lut);
+  parallelRows(img->width, img->height, thresholdRows, &r);
+  COUNT(PIXMEM, 2ul*(unsigned long)img->width*img->height);  // one read and one write per pixel
 }
 
 /// Brighten image by a factor.
@@ -417,17 +1644,66 @@ void ImageThreshold(Image img, uint8 thr) {                                  //-
 void ImageBrighten(Image img, double factor) {                              //---------------- Função escrita dia 18/11/2023
   assert (img != NULL);
   assert (factor >= 0.0);                               //garante que o factor usado não é negativo (o que invertiria as cores da imagem)
-  for (long i = 0; i < img->width*img->height; i++){                //Percorre todos os pixeis da imagem
-    int NovoValorPixel = img->pixel[i]*factor+0.5;                 //Multplicação do valor de cada pixel pelo factor
-    if (NovoValorPixel > img->maxval){                        //Verifica que o novo valor do pixel não excede o valor máximo maxval
-      img->pixel[i] = img->maxval;                             //Se exceder então o valor no novo pixel será maxval
-    }
-    else{
-      img->pixel[i] = NovoValorPixel;
-    }
+  Rows r = { .img = img, .factor = factor };
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    int level = v*factor + 0.5;
+    lut[v] = level > img->maxval ? img->maxval : level;
+  }
+  remapStats(img, lut);
+  parallelRows(img->width, img->height, brightenRows, &r);
+  COUNT(PIXMEM, 2ul*(unsigned long)img->width*img->height);  // one read and one write per pixel
+}
+
+
+// Replace each pixel level v by lut[v].
+static void applyLUT(Image img, const uint8 lut[256]) {
+  Rows r = { .img = img, .lut = lut };
+  remapStats(img, lut);
+  parallelRows(img->width, img->height, lutRows, &r);
+  COUNT(PIXMEM, 2ul*(unsigned long)img->width*img->height);
+}
+
+/// Histogram equalization.
+/// Remap gray levels so that their cumulative distribution becomes
+/// approximately linear in [0, maxval].
+void ImageEqualize(Image img) { ///
+  assert (img != NULL);
+  uint64 hist[256];
+  ImageHistogram(img, hist);
+  uint64 count = ImageHistCount(hist);
+  // The lowest level present maps to 0, the highest to maxval.
+  uint64 cdfMin = 0;
+  for (int v = 0; v < 256 && cdfMin == 0; v++) cdfMin = hist[v];
+  if (count == cdfMin) return;  // empty or uniform image
+  uint8 lut[256];
+  uint64 cdf = 0;
+  for (int v = 0; v < 256; v++) {
+    cdf += hist[v];
+    lut[v] = cdf < cdfMin ? 0 :
+      (uint8)(((double)(cdf - cdfMin) * img->maxval) / (double)(count - cdfMin) + 0.5);
   }
+  applyLUT(img, lut);
 }
 
+/// Contrast stretch.
+/// Linearly map the gray levels between percentiles low and high (see
+/// ImageHistPercentile) to [0, maxval], saturating levels outside them.
+void ImageStretch(Image img, double low, double high) { ///
+  assert (img != NULL);
+  assert (0.0 <= low && low <= high && high <= 1.0);
+  uint64 hist[256];
+  ImageHistogram(img, hist);
+  int lo = ImageHistPercentile(hist, low);
+  int hi = ImageHistPercentile(hist, high);
+  if (hi <= lo) return;
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    lut[v] = v <= lo ? 0 : v >= hi ? img->maxval :
+      (uint8)((double)(v - lo) * img->maxval / (hi - lo) + 0.5);
+  }
+  applyLUT(img, lut);
+}
 
 /// Geometric transformations
 
@@ -442,6 +1718,49 @@ void ImageBrighten(Image img, double factor) {                              //--
 // Implementation hint: 
 // Call ImageCreate whenever you need a new image!
 
+// Geometric transformations, of rows [y0, y1) of r->img (rotate, mirror)
+// or r->out (crop).
+
+static void rotateRows(void* arg, int y0, int y1) {
+  Image img = ((Rows*)arg)->img;
+  Image imgRot = ((Rows*)arg)->out;
+  // Go through the image in TILESIZE x TILESIZE blocks, so that the rows
+  // read and the columns written stay in cache (and in a single tile, in
+  // the tiled layout).  (Bands start at multiples of TILESIZE.)
+  for (int bj = y0; bj < y1; bj += TILESIZE){
+    int bjEnd = bj + TILESIZE < y1 ? bj + TILESIZE : y1;
+    for (int bi = 0; bi < img->width; bi += TILESIZE){
+      int biEnd = bi + TILESIZE < img->width ? bi + TILESIZE : img->width;
+      for (int j = bj; j < bjEnd; j++){                                 //Percorre as colunas
+        for (int i = bi; i < biEnd; i++){                               //Percorre as linhas
+          imgRot->pixel[G(imgRot, j, (imgRot->height-1)-i)] = img->pixel[G(img, i, j)];   //atribui ao pixel (y,altura-x) da imagem rodada o pixel (x,y) da imagem 1 de modo a gerar a imagem rodada no sentido anti-horário
+        }
+      }
+    }
+  }
+}
+
+static void mirrorRows(void* arg, int y0, int y1) {
+  Image img = ((Rows*)arg)->img;
+  Image imgMirror = ((Rows*)arg)->out;
+  for (int j = y0; j < y1; j++){                                             //Percorre as colunas
+    for (int i = 0; i < img->width; i++){                                    //Percorre as linhas
+      imgMirror->pixel[G(imgMirror, i, j)] = img->pixel[G(img, (img->width-1)-i, j)];      //Atribui ao pixel (x,y) da imagem espelhada o valor do pixel (largura-x, y) da imagem 1 de forma a espelhar a imagem horizontalmente da esquerda para a direita
+    }
+  }
+}
+
+static void cropRows(void* arg, int y0, int y1) {
+  Rows* r = arg;
+  Image img = r->img;
+  Image imgCrop = r->out;
+  for (int j = y0; j < y1; j++){                                  //Percorre as colunas
+    for (int i = 0; i < imgCrop->width; i++){                     //Percorre as linhas
+      imgCrop->pixel[G(imgCrop, i, j)] = img->pixel[G(img, r->x+i, r->y+j)];    //atribui à nova imagem os valores correspodentes aos pixies da imagem 1 que estão dentro do retangulo w*h
+    } 
+  }
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees counterclockwise.
@@ -452,12 +1771,12 @@ void ImageBrighten(Image img, double factor) {                              //--
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) {                                                  //---------------- Função escrita dia 18/11/2023
   assert (img != NULL);
-  Image imgRot = ImageCreate(img->height, img->width, img->maxval);      //Cria a imagem rodada (width = img->height e heigh = img->width)
-  for (int j = 0; j < img->height; j++){                                //Percorre as colunas
-    for (int i = 0; i < img->width; i++){                               //Percorre as linhas
-      ImageSetPixel(imgRot,j, ((imgRot->height-1)-i),ImageGetPixel(img,i,j));   //atribui ao pixel (y,altura-x) da imagem rodada o pixel (x,y) da imagem 1 de modo a gerar a imagem rodada no sentido anti-horário
-    }
-  }
+  Image imgRot = ImageCreateLayout(img->height, img->width, img->maxval, img->layout);      //Cria a imagem rodada (width = img->height e heigh = img->width)
+  if (imgRot == NULL) return NULL;
+  Rows r = { .img = img, .out = imgRot };
+  parallelRows(img->width, img->height, rotateRows, &r);
+  COUNT(PIXMEM, 2ul*(unsigned long)img->width*img->height);  // one read and one write per pixel
+  copyStats(imgRot, img);
   return imgRot;      //Retorna a imagem rodada
   
 }
@@ -471,12 +1790,12 @@ Image ImageRotate(Image img) {
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) {                                              //---------------- Função escrita dia 18/11/2023
   assert (img != NULL);
-  Image imgMirror = ImageCreate(img->width, img->height, img->maxval);       //Cria a imagem espelhada
-  for (int j = 0; j < img->height; j++){                                     //Percorre as colunas
-    for (int i = 0; i < img->width; i++){                                    //Percorre as linhas
-      ImageSetPixel(imgMirror,i, j,ImageGetPixel(img,(img->width-1)-i,j));      //Atribui ao pixel (x,y) da imagem espelhada o valor do pixel (largura-x, y) da imagem 1 de forma a espelhar a imagem horizontalmente da esquerda para a direita
-    }
-  }
+  Image imgMirror = ImageCreateLayout(img->width, img->height, img->maxval, img->layout);       //Cria a imagem espelhada
+  if (imgMirror == NULL) return NULL;
+  Rows r = { .img = img, .out = imgMirror };
+  parallelRows(img->width, img->height, mirrorRows, &r);
+  COUNT(PIXMEM, 2ul*(unsigned long)img->width*img->height);  // one read and one write per pixel
+  copyStats(imgMirror, img);
   return imgMirror; //Retorna a imagem espelhada
 }
 
@@ -495,15 +1814,120 @@ Image ImageMirror(Image img) {                                              //--
 Image ImageCrop(Image img, int x, int y, int w, int h) {                              //---------------- Função escrita dia 18/11/2023
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));                       //Verifica se o recangulo de largura w e altura h está dentro da iamgem 1
-  Image imgCrop = ImageCreate(w,h,img->maxval);                   //Cria uma nova imagem, a imagem cortada
-  for (int j = y; j < y+h; j++){                                  //Percorre as colunas
-    for (int i = x; i < x+w; i++){                                //Percorre as linhas
-      ImageSetPixel(imgCrop,i-x,j-y,ImageGetPixel(img, i, j));    //atribui à nova imagem os valores correspodentes aos pixies da imagem 1 que estão dentro do retangulo w*h
-    } 
-  }
+  Image imgCrop = ImageCreateLayout(w,h,img->maxval,img->layout);   //Cria uma nova imagem, a imagem cortada
+  if (imgCrop == NULL) return NULL;
+  Rows r = { .img = img, .out = imgCrop, .x = x, .y = y };
+  parallelRows(w, h, cropRows, &r);
+  COUNT(PIXMEM, 2ul*(unsigned long)w*h);  // one read and one write per pixel
   return imgCrop;   //Retorna a imagem cortada
 }
 
+// Copy the w x h rectangle at (sx, sy) of src to (dx, dy) of dst,
+// one run of pixels contiguous in both images at a time.
+static void copyRect(Image dst, int dx, int dy, Image src, int sx, int sy, int w, int h) {
+  for (int j = 0; j < h; j++) {
+    for (int i = 0, len; i < w; i += len) {
+      int slen;
+      uint8* d = span(dst, dx+i, dy+j, &len);
+      const uint8* s = span(src, sx+i, sy+j, &slen);
+      if (len > slen) len = slen;
+      if (len > w-i) len = w-i;
+      memcpy(d, s, len);
+    }
+  }
+}
+
+/// Copy an image into a new image with the given pixel layout.
+Image ImageCopyLayout(Image img, ImageLayout layout) { ///
+  assert (img != NULL);
+  Image copy = ImageCreateLayout(img->width, img->height, img->maxval, layout);
+  if (copy == NULL) return NULL;
+  copyRect(copy, 0, 0, img, 0, 0, img->width, img->height);
+  COUNT(PIXMEM, 2ul*(unsigned long)img->width*img->height);
+  copyStats(copy, img);
+  return copy;
+}
+
+
+// Average 2x2 blocks of rows r0 and r1 (w pixels) into out ((w+1)/2 pixels).
+// Computes (a+b+c+d+2)/4 exactly, using 16-bit sums of the even and odd
+// bytes (nested pavgb would be faster but biased upwards).
+static void downsampleRow(const uint8* r0, const uint8* r1, int w, uint8* out) {
+  int x = 0;
+#ifdef __SSE2__
+  const __m128i even = _mm_set1_epi16(0x00FF);
+  const __m128i two = _mm_set1_epi16(2);
+  for (; x + 16 <= w; x += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(r0 + x));
+    __m128i b = _mm_loadu_si128((const __m128i*)(r1 + x));
+    __m128i sum = _mm_add_epi16(
+      _mm_add_epi16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8)),
+      _mm_add_epi16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8)));
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    _mm_storel_epi64((__m128i*)(out + x/2), _mm_packus_epi16(sum, sum));
+  }
+#endif
+  for (; x < w; x += 2) {
+    int x1 = x+1 < w ? x+1 : x;
+    out[x/2] = (uint8)((r0[x] + r0[x1] + r1[x] + r1[x1] + 2) >> 2);
+  }
+}
+
+/// Downsample an image by 2 in both directions.
+Image ImageDownsample2x(Image img) { ///
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  int hw = (w+1)/2;
+  Image half = NULL;
+  uint8* buf = NULL;  // copies of two source rows and an output row
+  int success =
+    check( (buf = memAlloc(2*(size_t)w + hw + 1)) != NULL, "Allocating row buffer" ) &&
+    (half = ImageCreateLayout(hw, (h+1)/2, img->maxval, img->layout)) != NULL;
+  if (!success) {
+    errsave = errno;
+    memFree(buf);
+    errno = errsave;
+    return NULL;
+  }
+  for (int y = 0; y < h; y += 2) {
+    const uint8* r0 = rowBegin(img, 0, y, w, buf);
+    const uint8* r1 = y+1 < h ? rowBegin(img, 0, y+1, w, buf + w) : r0;
+    uint8* out = rowOut(half, 0, y/2, hw, buf + 2*w);
+    downsampleRow(r0, r1, w, out);
+    rowEnd(half, 0, y/2, hw, out, buf + 2*w);
+  }
+  memFree(buf);
+  COUNT(PIXMEM, (unsigned long)w*h + (unsigned long)half->width*half->height);
+  return half;
+}
+
+/// Build an image pyramid.
+int ImagePyramid(Image img, int minSize, Image levels[], int maxLevels) { ///
+  assert (img != NULL);
+  assert (minSize >= 1 && maxLevels >= 1);
+  levels[0] = img;
+  int n = 1;
+  while (n < maxLevels) {
+    int w = (levels[n-1]->width + 1)/2;
+    int h = (levels[n-1]->height + 1)/2;
+    if (w < minSize || h < minSize || (w == levels[n-1]->width && h == levels[n-1]->height)) break;
+    levels[n] = ImageDownsample2x(levels[n-1]);
+    if (levels[n] == NULL) {
+      errsave = errno;
+      ImagePyramidDestroy(levels, n);
+      errno = errsave;
+      return 0;
+    }
+    n++;
+  }
+  return n;
+}
+
+/// Destroy levels[1..n-1] of a pyramid built by ImagePyramid.
+void ImagePyramidDestroy(Image levels[], int n) { ///
+  for (int i = 1; i < n; i++) ImageDestroy(&levels[i]);
+}
 
 /// Operations on two images
 
@@ -511,15 +1935,102 @@ Image ImageCrop(Image img, int x, int y, int w, int h) {
 /// Paste img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
-void ImagePaste(Image img1, int x, int y, Image img2) {                  //---------------- Função escrita dia 18/11/2023
+void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
-  assert (ImageValidRect(img1, x, y, img2->width, img2->height));     //Verifica se a imagem 2 está dentro da imagem 1
-  for (int j = y; j < y+img2->height; j++){                 //Percorre as colunas
-    for (int i = x; i < x+img2->width; i++){                //Percorre as linhas
-      ImageSetPixel(img1, i, j,ImageGetPixel(img2,i-x, j-y));     //Substitui os pixeis da imagem 1 pelos da iamgem 2 no retangulo com o tamanho da imagem 2 e origem e (x,y)
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  modified(img1, y, y + img2->height);
+  int w = img2->width;
+  copyRect(img1, x, y, img2, 0, 0, w, img2->height);
+  COUNT(PIXMEM, 2ul*(unsigned long)w*img2->height);  // one read and one write per pixel
+}
+
+// Blending in fixed point.
+//
+// The blended level is floor((1-alpha)*p1 + alpha*p2 + 0.5), saturated.
+// With alpha ~ a/2^s, this is computed as
+//   v = (p2-p1)*a + p1*2^s + 2^(s-1),  level = v >> s,
+// which fits in 16x16->32-bit multiply-adds.  Rounding alpha to a/2^s
+// changes v by at most 255/2 units, so the result is exact unless v is
+// within that distance of a multiple of 2^s (a rounding tie).  Those few
+// pixels are recomputed in double precision, so the results are identical
+// to the original floating-point formula.
+
+// Margin around rounding ties, in units of v.
+#define BLENDMARGIN 129
+
+typedef struct {
+  double alpha;
+  int fixed;    // nonzero if the fixed-point path can be used
+  int s;        // alpha ~ a/2^s
+  int32_t a;
+} BlendParams;
+
+static BlendParams blendSetup(double alpha) {
+  BlendParams q = { .alpha = alpha, .fixed = 0, .s = 0, .a = 0 };
+  // Use the most precise scale where a fits in 16 bits, but keep the
+  // margin small compared to 2^s.
+  for (int s = 14; s >= 10 && !q.fixed; s--) {
+    double a = alpha * (1<<s);
+    if (-32767.0 <= a && a <= 32767.0) {
+      q.fixed = 1;
+      q.s = s;
+      q.a = (int32_t)lround(a);
+    }
+  }
+  return q;
+}
+
+// Blend a single pair of levels.
+static inline uint8 blendPixel(int p1, int p2, const BlendParams* q, int maxval) {
+  if (q->fixed) {
+    int32_t v = (p2-p1)*q->a + (p1 << q->s) + (1 << (q->s-1));
+    int32_t frac = v & ((1 << q->s) - 1);
+    if (BLENDMARGIN <= frac && frac < (1 << q->s) - BLENDMARGIN)
+      return saturate(v >> q->s, maxval);
+  }
+  double v = (1.0-q->alpha)*p1 + p2*q->alpha + 0.5;
+  return v < 0.0 ? 0 : v >= maxval ? (uint8)maxval : (uint8)(int)v;
+}
+
+// Blend n pixels of src into dst.
+static void blendRow(uint8* dst, const uint8* src, int n, const BlendParams* q, int maxval) {
+  int i = 0;
+#ifdef __SSE2__
+  if (q->fixed) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights = _mm_set1_epi32((int32_t)((uint32_t)(1 << q->s) << 16 | (uint16_t)q->a));
+    const __m128i round = _mm_set1_epi32(1 << (q->s-1));
+    const __m128i mask = _mm_set1_epi32((1 << q->s) - 1);
+    const __m128i lowTie = _mm_set1_epi32(BLENDMARGIN);
+    const __m128i highTie = _mm_set1_epi32((1 << q->s) - BLENDMARGIN - 1);
+    const __m128i cnt = _mm_cvtsi32_si128(q->s);
+    const __m128i maxv = _mm_set1_epi8((char)maxval);
+    for (; i + 8 <= n; i += 8) {
+      __m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(dst + i)), zero);
+      __m128i p2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i)), zero);
+      __m128i d = _mm_sub_epi16(p2, p1);
+      // Pairs (p2-p1, p1) times (a, 2^s)
+      __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(d, p1), weights), round);
+      __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(d, p1), weights), round);
+      __m128i flo = _mm_and_si128(lo, mask);
+      __m128i fhi = _mm_and_si128(hi, mask);
+      __m128i ties = _mm_or_si128(
+        _mm_or_si128(_mm_cmplt_epi32(flo, lowTie), _mm_cmpgt_epi32(flo, highTie)),
+        _mm_or_si128(_mm_cmplt_epi32(fhi, lowTie), _mm_cmpgt_epi32(fhi, highTie)));
+      if (_mm_movemask_epi8(ties) != 0) {
+        for (int k = i; k < i+8; k++) dst[k] = blendPixel(dst[k], src[k], q, maxval);
+        continue;
+      }
+      lo = _mm_sra_epi32(lo, cnt);
+      hi = _mm_sra_epi32(hi, cnt);
+      __m128i v = _mm_packs_epi32(lo, hi);
+      v = _mm_min_epu8(_mm_packus_epi16(v, v), maxv);
+      _mm_storel_epi64((__m128i*)(dst + i), v);
     }
-  }  
+  }
+#endif
+  for (; i < n; i++) dst[i] = blendPixel(dst[i], src[i], q, maxval);
 }
 
 /// Blend an image into a larger image.
@@ -531,15 +2042,126 @@ void ImagePaste(Image img1, int x, int y, Image img2) {                  //-----
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
-  assert (ImageValidRect(img1, x, y, img2->width, img2->height));     //Verifica se a iamgem 2 está dentro da imagem 1
-  for (int j = y; j < y+img2->height; j++){           //Percorre as colunas
-    for (int i = x; i < x+img2->width; i++){          //Percorre as linhas
-      double img1Pixel = ImageGetPixel(img1, i, j); //Armazena o pixel da imagem 1
-      double img2Pixel = ImageGetPixel(img2, i-x, j-y); //Armazena o pixel da imagem 2
-      double blendPixel = (int)((1.0-alpha)*img1Pixel + img2Pixel*alpha + 0.5); //Faz o blend dos pixeis de ambas as imagens
-      ImageSetPixel(img1, i, j, blendPixel);     //Substitui os pixeis da imagem 1 pelos "blendPixel" no retangulo com o tamanho da imagem 2 e origem e (x,y)
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  modified(img1, y, y + img2->height);
+  BlendParams q = blendSetup(alpha);
+  int w = img2->width;
+  for (int j = 0; j < img2->height; j++) {
+    for (int i = 0, len; i < w; i += len) {
+      int slen;
+      uint8* d = span(img1, x+i, y+j, &len);
+      const uint8* s = span(img2, i, j, &slen);
+      if (len > slen) len = slen;
+      if (len > w-i) len = w-i;
+      blendRow(d, s, len, &q, img1->maxval);
+    }
+  }
+  COUNT(PIXMEM, 3ul*(unsigned long)w*img2->height);  // two reads and one write per pixel
+}
+
+// Exact rounded division by a small constant.
+// For 0 < m <= 255 and 0 <= v < 2^16, divRound(v, magic(m)) == (v + m/2) / m.
+// (x*ceil(2^32/m)) >> 32 is exact whenever x*m < 2^32.
+static inline uint64_t divMagic(int m) {
+  return ((uint64_t)1 << 32) / (uint64_t)m + 1;
+}
+
+static inline int divRound(int v, int m, uint64_t magic) {
+  return (int)(((uint64_t)(v + m/2) * magic) >> 32);
+}
+
+// Composite one row segment of n pixels of a layer.
+// mask is NULL for constant opacity (given in q), or the mask row.
+static void compositeRow(uint8* dst, const uint8* src, const uint8* mask, int n,
+                         const ImageLayer* layer, const BlendParams* q,
+                         int maxval, uint64_t maxMagic, int maskMax, uint64_t maskMagic) {
+  if (layer->mode == BLEND_NORMAL && mask == NULL) {
+    blendRow(dst, src, n, q, maxval);
+    return;
+  }
+  for (int i = 0; i < n; i++) {
+    int d = dst[i];
+    int s = src[i];
+    int c;
+    switch (layer->mode) {
+    case BLEND_MULTIPLY: c = divRound(d*s, maxval, maxMagic); break;
+    case BLEND_SCREEN:   c = maxval - divRound((maxval-d)*(maxval-s), maxval, maxMagic); break;
+    case BLEND_MAX:      c = d > s ? d : s; break;
+    default:             c = s; break;
+    }
+    if (mask == NULL) {
+      dst[i] = blendPixel(d, c, q, maxval);
+    } else {
+      // (d*(M-m) + c*m) / M, with d, c <= 255 and M <= 255
+      int m = mask[i];
+      dst[i] = saturate(divRound(d*(maskMax-m) + c*m, maskMax, maskMagic), maxval);
+    }
+  }
+}
+
+// Tile size for ImageComposite, chosen to keep a destination tile in L1.
+#define TILEW 256
+#define TILEH 32
+
+/// Composite several layers into an image, in order (layers[0] first).
+void ImageComposite(Image dst, const ImageLayer* layers, int count) { ///
+  assert (dst != NULL);
+  assert (count >= 0);
+  if (count == 0) return;
+  assert (layers != NULL);
+  // Bounding box of all layers
+  int x0 = dst->width, y0 = dst->height, x1 = 0, y1 = 0;
+  for (int l = 0; l < count; l++) {
+    const ImageLayer* L = &layers[l];
+    assert (L->img != NULL);
+    assert (ImageValidRect(dst, L->x, L->y, L->img->width, L->img->height));
+    assert (L->mask == NULL ||
+            (L->mask->width == L->img->width && L->mask->height == L->img->height));
+    if (L->x < x0) x0 = L->x;
+    if (L->y < y0) y0 = L->y;
+    if (L->x + L->img->width > x1) x1 = L->x + L->img->width;
+    if (L->y + L->img->height > y1) y1 = L->y + L->img->height;
+  }
+  modified(dst, y0, y1);
+  uint64_t maxMagic = divMagic(dst->maxval);
+  unsigned long accesses = 0;
+
+  for (int ty = y0; ty < y1; ty += TILEH) {
+    int tyEnd = ty + TILEH < y1 ? ty + TILEH : y1;
+    for (int tx = x0; tx < x1; tx += TILEW) {
+      int txEnd = tx + TILEW < x1 ? tx + TILEW : x1;
+      for (int l = 0; l < count; l++) {
+        const ImageLayer* L = &layers[l];
+        // Intersect the layer with the tile
+        int lx0 = L->x > tx ? L->x : tx;
+        int ly0 = L->y > ty ? L->y : ty;
+        int lx1 = L->x + L->img->width < txEnd ? L->x + L->img->width : txEnd;
+        int ly1 = L->y + L->img->height < tyEnd ? L->y + L->img->height : tyEnd;
+        if (lx0 >= lx1 || ly0 >= ly1) continue;
+        BlendParams q = blendSetup(L->alpha);
+        int maskMax = L->mask != NULL ? L->mask->maxval : 1;
+        uint64_t maskMagic = divMagic(maskMax);
+        for (int yy = ly0; yy < ly1; yy++) {
+          // Runs contiguous in the destination, layer and mask
+          for (int xx = lx0, len; xx < lx1; xx += len) {
+            int slen, mlen;
+            uint8* d = span(dst, xx, yy, &len);
+            const uint8* s = span(L->img, xx - L->x, yy - L->y, &slen);
+            const uint8* m = NULL;
+            if (len > slen) len = slen;
+            if (L->mask != NULL) {
+              m = span(L->mask, xx - L->x, yy - L->y, &mlen);
+              if (len > mlen) len = mlen;
+            }
+            if (len > lx1 - xx) len = lx1 - xx;
+            compositeRow(d, s, m, len, L, &q, dst->maxval, maxMagic, maskMax, maskMagic);
+          }
+        }
+        accesses += (unsigned long)(lx1-lx0)*(ly1-ly0)*(L->mask != NULL ? 4 : 3);
+      }
     }
-  }  
+  }
+  COUNT(PIXMEM, accesses);
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -549,16 +2171,21 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidPos(img1, x, y));                       //Verifica se o pizel na posição (x,y) está dentro da iamgem 1       
+  unsigned long compares = 0;   // counted once per call
   for (int j = y; j < y+img2->height; j++){            //Percorre as colunas
     for (int i = x; i < x+img2->width; i++){           //Percorre as linhas
-      double img1Pixel = ImageGetPixel(img1, i, j); //Armazena o pixel da imagem 1
-      double img2Pixel = ImageGetPixel(img2, i-x, j-y); //Armazena o pixel da imagem 2
-      LocateCompar++;     // variável contadora para incrementar sempre que compare 
+      double img1Pixel = img1->pixel[G(img1, i, j)]; //Armazena o pixel da imagem 1
+      double img2Pixel = img2->pixel[G(img2, i-x, j-y)]; //Armazena o pixel da imagem 2
+      compares++;     // variável contadora para incrementar sempre que compare 
       if (img1Pixel!=img2Pixel){  //Verifica se os pixeis são diferentes
+        COUNT(LocateCompar, compares);
+        COUNT(PIXMEM, 2*compares);
         return 0;                 //Se os pixeis forem diferentes retorna 0
       }
     }
   }
+  COUNT(LocateCompar, compares);
+  COUNT(PIXMEM, 2*compares);
   return 1;                       //Se todos os pixeis forem iguais retorna 1 (após percorrer todos os pixeis da imagem 2 e os pixeis pretendidos da iamgem 1)
 }
 
@@ -570,40 +2197,38 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {
   assert (img1 != NULL);
   assert (img2 != NULL);
 
+  unsigned long positions = 0;   // counted once per call
   for (int j = 0; j <= img1->height - img2->height; j++){               //Percorre as colunas
     for (int i = 0; i <= img1->width - img2->width; i++){               //Percorre as linhas
-      LocateCompar++;                          // Variável contadora para numero de comparações
+      positions++;                             // Variável contadora para numero de comparações
       if (ImageMatchSubImage(img1, i, j, img2)){      //Se os pixeis coincidirem:                              
         *px = i;                                      //Atribui as coordenadas x a *px
         *py = j;                                      //Atribui as coordenadas y a *py                               
+        COUNT(LocateCompar, positions);
         return 1;                                     //Retorna 1;
       }
     }
   } 
+  COUNT(LocateCompar, positions);
   return 0;                                           //Caso não haja uma subimagem 2 na imagem 1 retorna 0;
 }
 
 
-/// Filtering
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+/// Filtering
 
-void ImageBlur(Image img, int dx, int dy) {                                            //---------------- Função escrita dia 19/11/2023
-  assert(img != NULL);
+// Mean filter of rows [y0, y1) of r->img, reading from its copy r->out.
+static void blurRows(void* arg, int y0, int y1) {
+  Rows* r = arg;
+  Image img = r->img;
+  Image img2 = r->out;
+  int dx = r->x, dy = r->y;
   double sum;                 //Variável que vai somar o valor dos pixeis da imagem 2
   int cont;                   //Contador
-  Image img2 = ImageCreate(img->width, img->height, img->maxval);     //Cria uma nova imagem igual à primeira onde se irá buscar o valor dos pixeis uma vez que os da imagem 1 serão alterados
-  
-  
-  for (long i = 0; i < img->width*img->height; i++){
-    img2->pixel[i]=img->pixel[i];                                     //copia os valores dos pixeis da imagem 1 para os da imagem 2
-  }
-  
-  for (int j = 0; j < img->height; j++){              //Percorre as colunas
+  unsigned long reads = 0;    // counted once per band
+  for (int j = y0; j < y1; j++){                      //Percorre as colunas
     for (int i = 0; i < img->width; i++){             //Percorre as linhas
+
       sum = 0;                                        //Reinicia o sum
       cont = 0;                                       //Reinicia o contador
       for (int k = j-dy; k <= j+dy; k++){
@@ -616,21 +2241,45 @@ void ImageBlur(Image img, int dx, int dy) {
             continue;                                 //Se sim continua
           }
           
-          sum += ImageGetPixel(img2, t, k);           //Soma o valor do pixel da imagem 2 na coordenadas (t,k)
+          sum += img2->pixel[G(img2, t, k)];          //Soma o valor do pixel da imagem 2 na coordenadas (t,k)
           cont++;                                     //incrementa 1 valor ao contador
         }
       }
       int meanFilter =(int)((sum/cont) + 0.5);        // Cria o meanFilter e atribui-lhe o devido valor
-      ImageSetPixel(img, i, j, meanFilter);           //Substitui o pixel original da imagem 1 pelo pixel com o novo valor depois de aplicado o meanFilter
+      img->pixel[G(img, i, j)] = meanFilter;          //Substitui o pixel original da imagem 1 pelo pixel com o novo valor depois de aplicado o meanFilter
+      reads += cont;
     }
   }
+  pthread_mutex_lock(&r->lock);
+  r->count += reads;
+  pthread_mutex_unlock(&r->lock);
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+
+void ImageBlur(Image img, int dx, int dy) {                                            //---------------- Função escrita dia 19/11/2023
+  assert(img != NULL);
+  modified(img, 0, img->height);
+  Image img2 = ImageCreateLayout(img->width, img->height, img->maxval, img->layout);     //Cria uma nova imagem igual à primeira onde se irá buscar o valor dos pixeis uma vez que os da imagem 1 serão alterados
+  
+  
+  memcpy(img2->pixel, img->pixel, pixelBytes(img));                  //copia os valores dos pixeis da imagem 1 para os da imagem 2
+  
+  Rows r = { .img = img, .out = img2, .x = dx, .y = dy, .lock = PTHREAD_MUTEX_INITIALIZER };
+  parallelRows(img->width, img->height, blurRows, &r);
+  COUNT(PIXMEM, r.count + (unsigned long)img->width*img->height);  // reads, and one write per pixel
     ImageDestroy(&img2);                              //Destrói a imagem 2
 }
 
 void ImageBlurMelhorado(Image img, int dx, int dy) {         ///Versão melhorada da função Blur ---- Escrita dia 24
    assert(img != NULL);
+   assert(img->layout == LAYOUT_RASTER);  // indexes pixel directly
+   modified(img, 0, img->height);
 
-   uint8* original = malloc(img->width * img->height * sizeof(uint8));        // Aloca memória para uma cópia da imagem original
+   uint8* original = memAlloc(img->width * img->height * sizeof(uint8));        // Aloca memória para uma cópia da imagem original
    memcpy(original, img->pixel, img->width * img->height * sizeof(uint8));    // copia os dados dos pixeis para a variável original --- memcpy(void *to, const void *from, size_t numBytes);
    for (int j = 0; j < img->height; j++) {          //Percorre as colunas
        for (int i = 0; i < img->width; i++) {       //Percorre as linhas
@@ -648,7 +2297,1941 @@ void ImageBlurMelhorado(Image img, int dx, int dy) {         ///Versão melhorad
        }
    }
 
-   free(original); //Liberta a memória alocada para a imagem original
+   memFree(original); //Liberta a memória alocada para a imagem original
+}
+
+
+
+
+/// Convolution
+
+// Filters are computed in fixed point: pixels and kernel weights are 16-bit
+// integers, products are accumulated in 32-bit integers, and results are
+// scaled by a power of two with rounding.  Where SSE2 is available, 8 pixels
+// are processed at once, multiplying pairs of taps with _mm_madd_epi16.
+// The scalar code computes exactly the same values.
+
+// Map coordinate i into [0, n) according to the border policy.
+// For BORDER_SKIP, returns -1 for coordinates outside [0, n).
+static int borderIndex(int i, int n, ImageBorder border) {
+  if (0 <= i && i < n) return i;
+  if (border == BORDER_CLAMP) return i < 0 ? 0 : n-1;
+  if (border == BORDER_MIRROR) {
+    if (n == 1) return 0;
+    int period = 2*(n-1);
+    i %= period;
+    if (i < 0) i += period;
+    return i < n ? i : period - i;
+  }
+  return -1;
+}
+
+// Divide v by 2^s, rounding to nearest (ties up), without overflow.
+// If s < 0, multiply by 2^-s instead.
+static inline int64_t roundShift(int64_t v, int s) {
+  if (s <= 0) return v * ((int64_t)1 << -s);
+  return ((v >> (s-1)) + 1) >> 1;
+}
+
+// Accumulate the 1D convolution of row src (w pixels) with kernel k
+// (n weights, centered) into acc:  acc[x] += sum_t k[t]*src[x+t-n/2].
+// Coordinates outside the row are mapped according to border
+// (and ignored for BORDER_SKIP).
+static void rowAccumulate(const uint8* src, int w, const int16_t* k, int n,
+                          int32_t* acc, ImageBorder border) {
+  int r = n/2;
+  int x = 0;
+  int end = w - r;  // pixels in [r, end) do not touch the border
+  // Left border
+  for (; x < r && x < w; x++) {
+    int32_t sum = 0;
+    for (int t = 0; t < n; t++) {
+      int i = borderIndex(x+t-r, w, border);
+      if (i >= 0) sum += k[t]*src[i];
+    }
+    acc[x] += sum;
+  }
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 8 <= end; x += 8) {
+    const uint8* s = src + x - r;
+    __m128i lo = zero, hi = zero;
+    for (int t = 0; t < n; t += 2) {
+      __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s+t)), zero);
+      __m128i b = zero;
+      int32_t kk = (uint16_t)k[t];
+      if (t+1 < n) {
+        b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s+t+1)), zero);
+        kk |= (int32_t)((uint32_t)(uint16_t)k[t+1] << 16);
+      }
+      __m128i kp = _mm_set1_epi32(kk);
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), kp));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), kp));
+    }
+    __m128i* d = (__m128i*)(acc + x);
+    _mm_storeu_si128(d, _mm_add_epi32(_mm_loadu_si128(d), lo));
+    _mm_storeu_si128(d+1, _mm_add_epi32(_mm_loadu_si128(d+1), hi));
+  }
+#endif
+  // Interior remainder
+  for (; x < end; x++) {
+    int32_t sum = 0;
+    for (int t = 0; t < n; t++) sum += k[t]*src[x+t-r];
+    acc[x] += sum;
+  }
+  // Right border
+  for (; x < w; x++) {
+    int32_t sum = 0;
+    for (int t = 0; t < n; t++) {
+      int i = borderIndex(x+t-r, w, border);
+      if (i >= 0) sum += k[t]*src[i];
+    }
+    acc[x] += sum;
+  }
+}
+
+// Sum of the weights of kernel k (n weights, centered) that fall inside
+// [0, w) when centered on x.
+static int32_t usedWeight(const int16_t* k, int n, int x, int w) {
+  int r = n/2;
+  int32_t sum = 0;
+  for (int t = 0; t < n; t++)
+    if (0 <= x+t-r && x+t-r < w) sum += k[t];
+  return sum;
+}
+
+// Convert kernel k (n weights) to 16-bit.
+// Returns a new array, or NULL on failure, with errCause set.
+// Also sets *sum and *sumAbs to the sum of weights and absolute weights.
+static int16_t* kernel16(const int* k, int n, int32_t* sum, int32_t* sumAbs) {
+  int16_t* k16 = memAlloc(n * sizeof(int16_t));
+  if (!check(k16 != NULL, "Allocating kernel")) return NULL;
+  *sum = *sumAbs = 0;
+  for (int t = 0; t < n; t++) {
+    assert (-32767 <= k[t] && k[t] <= 32767);
+    k16[t] = (int16_t)k[t];
+    *sum += k[t];
+    *sumAbs += abs(k[t]);
+  }
+  assert (*sumAbs <= 65535);
+  return k16;
+}
+
+// Vertical pass of separable convolution: out[x] is the weighted sum of
+// rows[j][x] with weights k[j], scaled by 2^-s and saturated.
+// For border rows in BORDER_SKIP mode, rows[j] may be NULL (ignored), and
+// the sum is rescaled by full/used.
+static void columnPass(int16_t* const* rows, const int16_t* k, int n, int w,
+                       int s, int32_t full, int32_t used, int maxval, uint8* out) {
+  int x = 0;
+#ifdef __SSE2__
+  int complete = 1;
+  for (int j = 0; j < n; j++) complete &= rows[j] != NULL;
+  if (complete && full == used && s >= 1) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i maxv = _mm_set1_epi8((char)maxval);
+    const __m128i cnt = _mm_cvtsi32_si128(s-1);
+    const __m128i one = _mm_set1_epi32(1);
+    for (; x + 8 <= w; x += 8) {
+      __m128i lo = zero, hi = zero;
+      for (int j = 0; j < n; j += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(rows[j] + x));
+        __m128i b = zero;
+        int32_t kk = (uint16_t)k[j];
+        if (j+1 < n) {
+          b = _mm_loadu_si128((const __m128i*)(rows[j+1] + x));
+          kk |= (int32_t)((uint32_t)(uint16_t)k[j+1] << 16);
+        }
+        __m128i kp = _mm_set1_epi32(kk);
+        lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), kp));
+        hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), kp));
+      }
+      // Same rounding as roundShift
+      lo = _mm_srai_epi32(_mm_add_epi32(_mm_sra_epi32(lo, cnt), one), 1);
+      hi = _mm_srai_epi32(_mm_add_epi32(_mm_sra_epi32(hi, cnt), one), 1);
+      __m128i v = _mm_packs_epi32(lo, hi);
+      v = _mm_min_epu8(_mm_packus_epi16(v, v), maxv);
+      _mm_storel_epi64((__m128i*)(out + x), v);
+    }
+  }
+#endif
+  for (; x < w; x++) {
+    int64_t sum = 0;
+    for (int j = 0; j < n; j++)
+      if (rows[j] != NULL) sum += (int32_t)k[j]*rows[j][x];
+    if (used != full && used != 0) sum = sum*full/used;
+    out[x] = saturate(roundShift(sum, s), maxval);
+  }
+}
+
+/// Separable convolution: kx (nx weights) along rows, then ky (ny weights)
+/// along columns.  Equivalent to a 2D kernel k[j][i] = ky[j]*kx[i].
+int ImageConvolveSeparable(Image img, const int* kx, int nx, const int* ky, int ny,
+                           int shift, ImageBorder border) { ///
+  assert (img != NULL);
+  assert (kx != NULL && nx > 0 && nx%2 == 1);
+  assert (ky != NULL && ny > 0 && ny%2 == 1);
+  modified(img, 0, img->height);
+  int w = img->width;
+  int h = img->height;
+  int rx = nx/2, ry = ny/2;
+  int32_t fullX, absX, fullY, absY;
+  int16_t* kx16 = NULL;
+  int16_t* ky16 = NULL;
+  int16_t* ring = NULL;     // ny horizontally filtered rows, row i in slot i%ny
+  int32_t* acc = NULL;      // horizontal accumulator
+  int16_t** rows = NULL;    // rows for the current output row
+  uint8* buf = NULL;        // copy of an image row (tiled layout)
+
+  int success =
+    (kx16 = kernel16(kx, nx, &fullX, &absX)) != NULL &&
+    (ky16 = kernel16(ky, ny, &fullY, &absY)) != NULL &&
+    check( (ring = memAlloc((size_t)ny*w*sizeof(int16_t) + 1)) != NULL, "Allocating row buffer" ) &&
+    check( (acc = memAlloc((size_t)w*sizeof(int32_t) + 1)) != NULL, "Allocating row buffer" ) &&
+    check( (rows = memAlloc(ny*sizeof(int16_t*))) != NULL, "Allocating row buffer" ) &&
+    check( (buf = memAlloc((size_t)w + 1)) != NULL, "Allocating row buffer" );
+
+  if (success) {
+    // Keep the intermediate values in 16 bits: drop hshift bits after the
+    // horizontal pass, and the rest of shift after the vertical pass.
+    int64_t maxAbs = (int64_t)img->maxval * absX;
+    int hshift = 0;
+    while ((maxAbs >> hshift) + 1 > 32767) hshift++;
+    int vshift = shift - hshift;
+
+    int next = 0;  // next source row to filter horizontally
+    for (int y = 0; y < h; y++) {
+      // Filter the source rows needed for output row y, before they are
+      // overwritten.  The ring always holds rows [y-ry, y+ry].
+      for (; next < h && next <= y+ry; next++) {
+        const uint8* src = rowBegin(img, 0, next, w, buf);
+        int16_t* dst = ring + (size_t)(next%ny)*w;
+        memset(acc, 0, w*sizeof(int32_t));
+        rowAccumulate(src, w, kx16, nx, acc, border);
+        COUNT(PIXMEM, (unsigned long)w);
+        for (int x = 0; x < w; x++) {
+          int64_t v = acc[x];
+          if (border == BORDER_SKIP && (x < rx || x >= w-rx)) {
+            int32_t used = usedWeight(kx16, nx, x, w);
+            if (used != 0) v = v*fullX/used;
+          }
+          v = roundShift(v, hshift);
+          dst[x] = (int16_t)(v < -32768 ? -32768 : v > 32767 ? 32767 : v);
+        }
+      }
+      for (int j = 0; j < ny; j++) {
+        int i = borderIndex(y+j-ry, h, border);
+        rows[j] = i < 0 ? NULL : ring + (size_t)(i%ny)*w;
+      }
+      int32_t usedY = border == BORDER_SKIP ? usedWeight(ky16, ny, y, h) : fullY;
+      uint8* out = rowOut(img, 0, y, w, buf);
+      columnPass(rows, ky16, ny, w, vshift, fullY, usedY, img->maxval, out);
+      rowEnd(img, 0, y, w, out, buf);
+      COUNT(PIXMEM, (unsigned long)w);
+    }
+  }
+
+  memFree(buf);
+  memFree(rows);
+  memFree(acc);
+  memFree(ring);
+  memFree(ky16);
+  memFree(kx16);
+  return success;
 }
 
+/// General 2D convolution with a kw x kh kernel k, in raster order.
+int ImageConvolve(Image img, const int* k, int kw, int kh, int shift,
+                  ImageBorder border) { ///
+  assert (img != NULL);
+  assert (k != NULL && kw > 0 && kw%2 == 1 && kh > 0 && kh%2 == 1);
+  modified(img, 0, img->height);
+  int w = img->width;
+  int h = img->height;
+  int rx = kw/2, ry = kh/2;
+  int32_t full, sumAbs;
+  int16_t* k16 = NULL;
+  uint8* ring = NULL;       // copies of kh source rows, row i in slot i%kh
+  int32_t* acc = NULL;
+  uint8* buf = NULL;        // output row (tiled layout)
+
+  int success =
+    (k16 = kernel16(k, kw*kh, &full, &sumAbs)) != NULL &&
+    check( (ring = memAlloc((size_t)kh*w + 1)) != NULL, "Allocating row buffer" ) &&
+    check( (acc = memAlloc((size_t)w*sizeof(int32_t) + 1)) != NULL, "Allocating row buffer" ) &&
+    check( (buf = memAlloc((size_t)w + 1)) != NULL, "Allocating row buffer" );
+
+  if (success) {
+    int next = 0;  // next source row to copy
+    for (int y = 0; y < h; y++) {
+      for (; next < h && next <= y+ry; next++) {
+        getRow(img, 0, next, w, ring + (size_t)(next%kh)*w);
+        COUNT(PIXMEM, (unsigned long)w);
+      }
+      memset(acc, 0, w*sizeof(int32_t));
+      for (int j = 0; j < kh; j++) {
+        int i = borderIndex(y+j-ry, h, border);
+        if (i >= 0)
+          rowAccumulate(ring + (size_t)(i%kh)*w, w, k16 + j*kw, kw, acc, border);
+      }
+      uint8* out = rowOut(img, 0, y, w, buf);
+      int borderRow = y < ry || y >= h-ry;
+      for (int x = 0; x < w; x++) {
+        int64_t v = acc[x];
+        if (border == BORDER_SKIP && (borderRow || x < rx || x >= w-rx)) {
+          int32_t used = 0;
+          for (int j = 0; j < kh; j++)
+            if (0 <= y+j-ry && y+j-ry < h) used += usedWeight(k16 + j*kw, kw, x, w);
+          if (used != 0) v = v*full/used;
+        }
+        out[x] = saturate(roundShift(v, shift), img->maxval);
+      }
+      rowEnd(img, 0, y, w, out, buf);
+      COUNT(PIXMEM, (unsigned long)w);
+    }
+  }
 
+  memFree(buf);
+  memFree(acc);
+  memFree(ring);
+  memFree(k16);
+  return success;
+}
+
+/// Gaussian blur with standard deviation sigma (in pixels).
+/// Uses a separable kernel with radius ceil(3*sigma).
+int ImageGaussianBlur(Image img, double sigma, ImageBorder border) { ///
+  assert (img != NULL);
+  assert (0.0 < sigma && sigma <= GAUSS_MAX_SIGMA);
+  // Weights are scaled to add up to exactly 2^15 in each direction, the
+  // most the 16-bit convolution takes; or to 2^14 for a small sigma, where
+  // the center weight alone is close to the sum.
+  const int bits = sigma < 0.5 ? 14 : 15;
+  int r = (int)ceil(3.0*sigma);
+  int n = 2*r + 1;
+  int* k = memAlloc(n*sizeof(int));
+  if (!check(k != NULL, "Allocating kernel")) return 0;
+  double total = 0.0;
+  for (int t = 0; t < n; t++) total += exp(-(t-r)*(t-r) / (2.0*sigma*sigma));
+  int sum = 0;
+  for (int t = 0; t < n; t++) {
+    k[t] = (int)(exp(-(t-r)*(t-r) / (2.0*sigma*sigma)) / total * (1<<bits) + 0.5);
+    sum += k[t];
+  }
+  // Spread the rounding error over the largest weights, one unit each,
+  // keeping the kernel symmetric (it is at most about n/2 units).
+  int d = (1<<bits) - sum;
+  int unit = d > 0 ? 1 : -1;
+  if (d % 2 != 0) {
+    k[r] += unit;
+    d -= unit;
+  }
+  for (int t = 1; d != 0; t++) {
+    k[r-t] += unit;
+    k[r+t] += unit;
+    d -= 2*unit;
+  }
+  int success = ImageConvolveSeparable(img, k, n, k, n, 2*bits, border);
+  memFree(k);
+  return success;
+}
+
+
+/// Median filter
+
+// Add (sign=+1) or subtract (sign=-1) the 256-bin histogram src to dst,
+// and the corresponding 16-bin coarse histograms.
+// Written with constant trip counts so that the compiler vectorizes them.
+static inline void histUpdate(uint16_t* dst, uint16_t* dstc,
+                              const uint16_t* src, const uint16_t* srcc, int sign) {
+  if (sign > 0) {
+    for (int i = 0; i < 256; i++) dst[i] += src[i];
+    for (int i = 0; i < 16; i++) dstc[i] += srcc[i];
+  } else {
+    for (int i = 0; i < 256; i++) dst[i] -= src[i];
+    for (int i = 0; i < 16; i++) dstc[i] -= srcc[i];
+  }
+}
+
+// Add (sign=+1) or remove (sign=-1) pixel row to the column histograms.
+static inline void columnsUpdate(uint16_t* fine, uint16_t* coarse,
+                                 const uint8* row, int w, int sign) {
+  for (int x = 0; x < w; x++) {
+    fine[(size_t)x*256 + row[x]] += sign;
+    coarse[(size_t)x*16 + (row[x] >> 4)] += sign;
+  }
+}
+
+// Find the level with the given rank (1-based) in a histogram.
+// Searches the coarse bins first, then 16 fine bins.
+static inline uint8 histRank(const uint16_t* fine, const uint16_t* coarse, int rank) {
+  int c = 0;
+  while (rank > coarse[c]) rank -= coarse[c++];
+  int v = c*16;
+  while (rank > fine[v]) rank -= fine[v++];
+  return (uint8)v;
+}
+
+/// Median filter over a (2dx+1)x(2dy+1) window.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  assert ((2L*dx+1)*(2L*dy+1) <= 65535);
+  modified(img, 0, img->height);
+  int w = img->width;
+  int h = img->height;
+  uint16_t* fine = NULL;     // w column histograms of 256 bins
+  uint16_t* coarse = NULL;   // w column histograms of 16 bins (level>>4)
+  uint8* ring = NULL;        // original rows [y-dy-1, y-1], row i in slot i%(dy+1)
+  uint8* buf = NULL;         // copy of an image row (tiled layout)
+  uint16_t kfine[256];       // histogram of the current window
+  uint16_t kcoarse[16];
+
+  int success =
+    check( (fine = memCalloc((size_t)w*256 + 1, sizeof(uint16_t))) != NULL, "Allocating histograms" ) &&
+    check( (coarse = memCalloc((size_t)w*16 + 1, sizeof(uint16_t))) != NULL, "Allocating histograms" ) &&
+    check( (ring = memAlloc((size_t)(dy+1)*w + 1)) != NULL, "Allocating row buffer" ) &&
+    check( (buf = memAlloc((size_t)w + 1)) != NULL, "Allocating row buffer" );
+
+  if (success) {
+    // Column histograms hold rows [y-dy, y+dy]: start with [0, dy-1].
+    for (int i = 0; i < dy && i < h; i++)
+      columnsUpdate(fine, coarse, rowBegin(img, 0, i, w, buf), w, +1);
+    for (int y = 0; y < h; y++) {
+      if (y+dy < h)
+        columnsUpdate(fine, coarse, rowBegin(img, 0, y+dy, w, buf), w, +1);
+      if (y-dy-1 >= 0)  // already overwritten: use the saved copy
+        columnsUpdate(fine, coarse, ring + (size_t)((y-dy-1)%(dy+1))*w, w, -1);
+      uint8* row = rowBegin(img, 0, y, w, buf);
+      memcpy(ring + (size_t)(y%(dy+1))*w, row, w);
+      COUNT(PIXMEM, 2ul*(unsigned long)w);
+
+      int rows = (y+dy < h ? y+dy : h-1) - (y-dy > 0 ? y-dy : 0) + 1;
+      memset(kfine, 0, sizeof kfine);
+      memset(kcoarse, 0, sizeof kcoarse);
+      for (int x = 0; x < dx && x < w; x++)
+        histUpdate(kfine, kcoarse, fine + (size_t)x*256, coarse + (size_t)x*16, +1);
+      for (int x = 0; x < w; x++) {
+        if (x+dx < w)
+          histUpdate(kfine, kcoarse, fine + (size_t)(x+dx)*256, coarse + (size_t)(x+dx)*16, +1);
+        if (x-dx-1 >= 0)
+          histUpdate(kfine, kcoarse, fine + (size_t)(x-dx-1)*256, coarse + (size_t)(x-dx-1)*16, -1);
+        int cols = (x+dx < w ? x+dx : w-1) - (x-dx > 0 ? x-dx : 0) + 1;
+        row[x] = histRank(kfine, kcoarse, (rows*cols + 1)/2);
+      }
+      rowEnd(img, 0, y, w, row, buf);
+    }
+  }
+
+  memFree(buf);
+  memFree(ring);
+  memFree(coarse);
+  memFree(fine);
+  return success;
+}
+
+
+/// Morphology
+
+// Van Herk/Gil-Werman: to get the minimum (or maximum) over every window of
+// k = 2r+1 consecutive elements, split the sequence, padded by r neutral
+// elements on each side, in blocks of k.  Each window is then a suffix of
+// one block followed by a prefix of the next, so its minimum is
+// min(suffix[i], prefix[i+2r]): 3 operations per element for any r.
+// The row pass works on each row; the column pass works on whole rows at a
+// time, and is just elementwise min/max of rows.
+
+// dst[i] = min(a[i], b[i]), or max if dilate, for i < n.
+static void minmaxRow(uint8* dst, const uint8* a, const uint8* b, int n, int dilate) {
+  int i = 0;
+#ifdef __SSE2__
+  if (dilate) {
+    for (; i + 16 <= n; i += 16)
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(
+        _mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))));
+  } else {
+    for (; i + 16 <= n; i += 16)
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_min_epu8(
+        _mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))));
+  }
+#endif
+  if (dilate) {
+    for (; i < n; i++) dst[i] = a[i] > b[i] ? a[i] : b[i];
+  } else {
+    for (; i < n; i++) dst[i] = a[i] < b[i] ? a[i] : b[i];
+  }
+}
+
+// Row pass: row[x] = min (or max) of row[x-r..x+r] inside [0, w).
+// f, g, h are buffers with room for w+2r pixels.
+static void morphRow(uint8* row, int w, int r, int dilate, uint8* f, uint8* g, uint8* h) {
+  int k = 2*r + 1;
+  int n = w + 2*r;
+  memset(f, dilate ? 0 : PixMax, r);
+  memcpy(f + r, row, w);
+  memset(f + r + w, dilate ? 0 : PixMax, r);
+  for (int b = 0; b < n; b += k) {
+    int end = b + k < n ? b + k : n;
+    g[b] = f[b];
+    for (int i = b+1; i < end; i++) g[i] = dilate ? (g[i-1] > f[i] ? g[i-1] : f[i])
+                                                  : (g[i-1] < f[i] ? g[i-1] : f[i]);
+    h[end-1] = f[end-1];
+    for (int i = end-2; i >= b; i--) h[i] = dilate ? (h[i+1] > f[i] ? h[i+1] : f[i])
+                                                   : (h[i+1] < f[i] ? h[i+1] : f[i]);
+  }
+  minmaxRow(row, h, g + 2*r, w, dilate);
+}
+
+// Min (or max, if dilate) filter over a (2dx+1)x(2dy+1) window.
+static int morph(Image img, int dx, int dy, int dilate) {
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  modified(img, 0, img->height);
+  int w = img->width;
+  int h = img->height;
+  int k = 2*dy + 1;
+  size_t n = (size_t)w + 2*(size_t)dx;
+  uint8* rowBuf = NULL;  // f, g, h of the row pass, and an output row
+  uint8* blocks = NULL;  // 3 blocks of k row-filtered rows
+  int success =
+    check( (rowBuf = memAlloc(3*n + w + 1)) != NULL, "Allocating row buffer" ) &&
+    check( (blocks = memAlloc(3*(size_t)k*w + 1)) != NULL, "Allocating row buffer" );
+
+  if (success) {
+    uint8* f = rowBuf;
+    uint8* out = rowBuf + 3*n;
+    // Padded rows are source rows shifted by dy: row i is source row i-dy.
+    // hcur holds the suffixes of the current block; gnext and hnext the
+    // prefixes and suffixes of the next one.
+    uint8* hcur = blocks;
+    uint8* hnext = blocks + (size_t)k*w;
+    uint8* gnext = blocks + 2*(size_t)k*w;
+    for (int b = 0; b*k < h; b++) {
+      // Load block b+1 (and block 0 first).  Its source rows are below all
+      // output rows written so far, so they are still unchanged.
+      for (int first = b == 0; first >= 0; first--) {
+        uint8* hb = first ? hcur : hnext;
+        for (int j = 0; j < k; j++) {
+          int sy = (b + 1 - first)*k + j - dy;
+          uint8* row = hb + (size_t)j*w;
+          if (sy < 0 || sy >= h) {
+            memset(row, dilate ? 0 : PixMax, w);
+          } else {
+            getRow(img, 0, sy, w, row);
+            if (dx > 0) morphRow(row, w, dx, dilate, f, f + n, f + 2*n);
+            COUNT(PIXMEM, (unsigned long)w);
+          }
+        }
+        if (!first) {
+          memcpy(gnext, hb, w);
+          for (int j = 1; j < k; j++)
+            minmaxRow(gnext + (size_t)j*w, gnext + (size_t)(j-1)*w, hb + (size_t)j*w, w, dilate);
+        }
+        for (int j = k-2; j >= 0; j--)
+          minmaxRow(hb + (size_t)j*w, hb + (size_t)j*w, hb + (size_t)(j+1)*w, w, dilate);
+      }
+      // Output row y covers padded rows [y, y+2dy]: a suffix of block b
+      // and a prefix of block b+1 (or exactly block b).
+      for (int j = 0; j < k && b*k + j < h; j++) {
+        int y = b*k + j;
+        uint8* dst = rowOut(img, 0, y, w, out);
+        if (j == 0) memcpy(dst, hcur, w);
+        else minmaxRow(dst, hcur + (size_t)j*w, gnext + (size_t)(j-1)*w, w, dilate);
+        rowEnd(img, 0, y, w, dst, out);
+        COUNT(PIXMEM, (unsigned long)w);
+      }
+      uint8* t = hcur; hcur = hnext; hnext = t;
+    }
+  }
+
+  memFree(blocks);
+  memFree(rowBuf);
+  return success;
+}
+
+/// Erosion over a (2dx+1)x(2dy+1) rectangle.
+int ImageErode(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0);
+}
+
+/// Dilation over a (2dx+1)x(2dy+1) rectangle.
+int ImageDilate(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 1);
+}
+
+/// Opening: erosion followed by dilation.
+int ImageOpen(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0) && morph(img, dx, dy, 1);
+}
+
+/// Closing: dilation followed by erosion.
+int ImageClose(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 1) && morph(img, dx, dy, 0);
+}
+
+
+/// Connected components
+
+// Images smaller than this are labelled in a single strip.
+#define LABELMINPIXELS (1 << 16)
+
+// A run of nonzero pixels [x0, x1) of a row, with its provisional label.
+typedef struct {
+  int x0, x1;
+  uint32_t label;
+} Run;
+
+// Statistics of the runs with a provisional label.
+typedef struct {
+  uint64 area, sumX, sumY;
+  int x0, y0, x1, y1;  // bounding box, inclusive
+} RegionSum;
+
+// Labelling of rows [y0, y1) of an image: runs and provisional labels.
+typedef struct {
+  Image img;
+  int y0, y1;
+  int d;                // 1 for 8-connectivity (diagonal overlap), 0 for 4
+  Run* runs;
+  size_t nruns, runCap;
+  size_t* rowStart;     // runs of row y0+i are [rowStart[i], rowStart[i+1])
+  uint32_t* parent;     // union-find of provisional labels
+  RegionSum* sums;
+  uint32_t nlabels, labelCap;
+  uint8* buf;           // row copy (tiled layout)
+  int ok;               // 0 after an allocation failure
+} Strip;
+
+// Root of label l, compressing the path.
+static uint32_t findRoot(uint32_t* parent, uint32_t l) {
+  uint32_t r = l;
+  while (parent[r] != r) r = parent[r];
+  while (parent[l] != r) {
+    uint32_t next = parent[l];
+    parent[l] = r;
+    l = next;
+  }
+  return r;
+}
+
+// Merge the sets of labels a and b.  The smaller label becomes the root.
+static void unite(uint32_t* parent, uint32_t a, uint32_t b) {
+  a = findRoot(parent, a);
+  b = findRoot(parent, b);
+  if (a < b) parent[b] = a;
+  else if (b < a) parent[a] = b;
+}
+
+// Unite the labels of the runs in [a, aEnd) with those of the overlapping
+// runs in [b, bEnd) (runs of adjacent rows, sorted).  Labels are offset by
+// offA and offB.  This is used to merge strips.
+static void uniteRows(uint32_t* parent, const Run* runs, size_t a, size_t aEnd, uint32_t offA,
+                      const Run* runsB, size_t b, size_t bEnd, uint32_t offB, int d) {
+  while (a < aEnd && b < bEnd) {
+    if (runs[a].x1 + d > runsB[b].x0 && runsB[b].x1 + d > runs[a].x0)
+      unite(parent, runs[a].label + offA, runsB[b].label + offB);
+    // Advance the run that ends first
+    if (runs[a].x1 < runsB[b].x1) a++;
+    else b++;
+  }
+}
+
+// Label the rows of a strip (a thread function).
+static void* labelStrip(void* arg) {
+  Strip* s = arg;
+  int w = s->img->width;
+  for (int y = s->y0; y < s->y1 && s->ok; y++) {
+    const uint8* row = rowBegin(s->img, 0, y, w, s->buf);
+    size_t prev = y > s->y0 ? s->rowStart[y - s->y0 - 1] : s->nruns;
+    size_t prevEnd = s->nruns;
+    s->rowStart[y - s->y0] = s->nruns;
+    int x = 0;
+    while (x < w) {
+      while (x < w && row[x] == 0) x++;
+      if (x == w) break;
+      int x0 = x;
+      while (x < w && row[x] != 0) x++;
+      // Runs of the previous row that touch [x0, x)
+      while (prev < prevEnd && s->runs[prev].x1 + s->d <= x0) prev++;
+      uint32_t label = UINT32_MAX;
+      for (size_t q = prev; q < prevEnd && s->runs[q].x0 < x + s->d; q++) {
+        if (label == UINT32_MAX) label = s->runs[q].label;
+        else unite(s->parent, label, s->runs[q].label);
+      }
+      if (label == UINT32_MAX) {
+        if (s->nlabels == s->labelCap) {
+          uint32_t cap = s->labelCap ? 2*s->labelCap : 256;
+          uint32_t* parent = memRealloc(s->parent, cap*sizeof(uint32_t));
+          if (parent != NULL) s->parent = parent;
+          RegionSum* sums = memRealloc(s->sums, cap*sizeof(RegionSum));
+          if (sums != NULL) s->sums = sums;
+          if (parent == NULL || sums == NULL) { s->ok = 0; break; }
+          s->labelCap = cap;
+        }
+        label = s->nlabels++;
+        s->parent[label] = label;
+        s->sums[label] = (RegionSum){ 0, 0, 0, x0, y, x-1, y };
+      }
+      if (s->nruns == s->runCap) {
+        size_t cap = s->runCap ? 2*s->runCap : 1024;
+        Run* runs = memRealloc(s->runs, cap*sizeof(Run));
+        if (runs == NULL) { s->ok = 0; break; }
+        s->runs = runs;
+        s->runCap = cap;
+      }
+      s->runs[s->nruns++] = (Run){ x0, x, label };
+      RegionSum* r = &s->sums[label];
+      uint64 len = (uint64)(x - x0);
+      r->area += len;
+      r->sumX += len*(uint64)(x0 + x - 1)/2;
+      r->sumY += len*(uint64)y;
+      if (x0 < r->x0) r->x0 = x0;
+      if (x-1 > r->x1) r->x1 = x-1;
+      r->y1 = y;  // rows are processed in order
+    }
+  }
+  s->rowStart[s->y1 - s->y0] = s->nruns;
+  return NULL;
+}
+
+/// Label the connected regions of nonzero pixels.
+int ImageLabel(Image img, int connectivity, int nthreads,
+               uint32_t** labels, ImageRegion** regions) { ///
+  assert (img != NULL);
+  assert (connectivity == 4 || connectivity == 8);
+  assert (nthreads >= 1);
+  int w = img->width;
+  int h = img->height;
+  int nstrips = (size_t)w*h < LABELMINPIXELS ? 1 : nthreads;
+  if (nstrips > h) nstrips = h;
+  if (nstrips < 1) nstrips = 1;
+  Strip* strips = NULL;
+  pthread_t* threads = NULL;
+  int* started = NULL;
+  uint32_t* parent = NULL;    // global union-find: strip i labels offset by off[i]
+  uint32_t* off = NULL;
+  uint32_t* final = NULL;     // final label of each global provisional label
+  uint32_t* map = NULL;
+  ImageRegion* table = NULL;
+  uint32_t total = 0;
+  int count = 0;
+
+  int success =
+    check( (strips = memCalloc(nstrips, sizeof(Strip))) != NULL, "Allocating strips" ) &&
+    check( (threads = memCalloc(nstrips, sizeof(pthread_t))) != NULL, "Allocating strips" ) &&
+    check( (started = memCalloc(nstrips, sizeof(int))) != NULL, "Allocating strips" ) &&
+    check( (off = memCalloc(nstrips + 1, sizeof(uint32_t))) != NULL, "Allocating strips" );
+  for (int i = 0; success && i < nstrips; i++) {
+    Strip* s = &strips[i];
+    s->img = img;
+    s->y0 = (int)((int64_t)h*i/nstrips);
+    s->y1 = (int)((int64_t)h*(i+1)/nstrips);
+    s->d = connectivity == 8;
+    s->ok = 1;
+    success =
+      check( (s->rowStart = memAlloc((size_t)(s->y1 - s->y0 + 1)*sizeof(size_t))) != NULL, "Allocating strips" ) &&
+      check( (s->buf = memAlloc((size_t)w + 1)) != NULL, "Allocating strips" );
+  }
+
+  if (success) {
+    // First pass: label strips 1.. in new threads, strip 0 in this one.
+    // Strips that cannot get a thread are labelled here too.
+    for (int i = 1; i < nstrips; i++)
+      started[i] = pthread_create(&threads[i], NULL, labelStrip, &strips[i]) == 0;
+    for (int i = 0; i < nstrips; i++)
+      if (!started[i]) labelStrip(&strips[i]);
+    for (int i = 1; i < nstrips; i++)
+      if (started[i]) pthread_join(threads[i], NULL);
+    COUNT(PIXMEM, (unsigned long)w*h);
+
+    for (int i = 0; i < nstrips; i++) {
+      off[i+1] = off[i] + strips[i].nlabels;
+      success = success && strips[i].ok;
+    }
+    total = off[nstrips];
+    success =
+      check( success, "Allocating runs" ) &&
+      check( (parent = memAlloc((size_t)total*sizeof(uint32_t) + 1)) != NULL, "Allocating labels" ) &&
+      check( (final = memAlloc((size_t)total*sizeof(uint32_t) + 1)) != NULL, "Allocating labels" );
+  }
+
+  if (success) {
+    // Merge strips: unite runs across each strip boundary.
+    for (int i = 0; i < nstrips; i++)
+      for (uint32_t l = 0; l < strips[i].nlabels; l++)
+        parent[off[i] + l] = off[i] + strips[i].parent[l];
+    for (int i = 1; i < nstrips; i++) {
+      const Strip* a = &strips[i-1];
+      const Strip* b = &strips[i];
+      uniteRows(parent, a->runs, a->rowStart[a->y1 - a->y0 - 1], a->nruns, off[i-1],
+                b->runs, b->rowStart[0], b->rowStart[1], off[i], a->d);
+    }
+    // Number the roots in order; roots are the smallest labels of their sets.
+    for (uint32_t l = 0; l < total; l++) {
+      uint32_t r = findRoot(parent, l);
+      final[l] = r == l ? (uint32_t)++count : final[r];
+    }
+    success =
+      check( regions == NULL || count == 0 ||
+             (table = malloc(count*sizeof(ImageRegion))) != NULL, "Allocating regions" ) &&
+      check( labels == NULL ||
+             (map = calloc((size_t)w*h + 1, sizeof(uint32_t))) != NULL, "Allocating labels" );
+  }
+
+  if (success && table != NULL) {
+    // Region table, from the sums of the provisional labels
+    RegionSum* sums = memCalloc(count, sizeof(RegionSum));
+    success = check( sums != NULL, "Allocating regions" );
+    if (success) {
+      for (int i = 0; i < count; i++)
+        sums[i] = (RegionSum){ 0, 0, 0, w, h, -1, -1 };
+      for (int i = 0; i < nstrips; i++) {
+        for (uint32_t l = 0; l < strips[i].nlabels; l++) {
+          const RegionSum* p = &strips[i].sums[l];
+          RegionSum* r = &sums[final[off[i] + l] - 1];
+          r->area += p->area;
+          r->sumX += p->sumX;
+          r->sumY += p->sumY;
+          if (p->x0 < r->x0) r->x0 = p->x0;
+          if (p->y0 < r->y0) r->y0 = p->y0;
+          if (p->x1 > r->x1) r->x1 = p->x1;
+          if (p->y1 > r->y1) r->y1 = p->y1;
+        }
+      }
+      for (int i = 0; i < count; i++) {
+        const RegionSum* r = &sums[i];
+        table[i] = (ImageRegion){ r->x0, r->y0, r->x1 - r->x0 + 1, r->y1 - r->y0 + 1, r->area,
+                                  (double)r->sumX / r->area, (double)r->sumY / r->area };
+      }
+    }
+    memFree(sums);
+  }
+
+  if (success && map != NULL) {
+    // Second pass: write the final label of each run
+    for (int i = 0; i < nstrips; i++) {
+      const Strip* s = &strips[i];
+      for (int y = s->y0; y < s->y1; y++) {
+        uint32_t* row = map + (size_t)y*w;
+        for (size_t q = s->rowStart[y - s->y0]; q < s->rowStart[y - s->y0 + 1]; q++) {
+          uint32_t l = final[off[i] + s->runs[q].label];
+          for (int x = s->runs[q].x0; x < s->runs[q].x1; x++) row[x] = l;
+        }
+      }
+    }
+  }
+
+  if (!success) {
+    errsave = errno;
+    free(map);
+    free(table);
+    map = NULL;
+    table = NULL;
+  }
+  memFree(final);
+  memFree(parent);
+  for (int i = 0; strips != NULL && i < nstrips; i++) {
+    memFree(strips[i].runs);
+    memFree(strips[i].rowStart);
+    memFree(strips[i].parent);
+    memFree(strips[i].sums);
+    memFree(strips[i].buf);
+  }
+  memFree(off);
+  memFree(started);
+  memFree(threads);
+  memFree(strips);
+  if (!success) {
+    errno = errsave;
+    return -1;
+  }
+  if (labels != NULL) *labels = map;
+  if (regions != NULL) *regions = table;
+  return count;
+}
+
+
+/// Resampling
+
+// ImageResize is separable: each source row is filtered horizontally once,
+// into a small cache of rows, and each output row is a weighted sum of
+// cached rows (using the columnPass of convolution).
+// Weights are in Q14 and add up to exactly 2^14.  Horizontal results are
+// kept in Q7, so both passes fit 16-bit operands.
+
+#define RESIZEBITS 14
+#define RESIZEHBITS 7
+
+// Resampling table for one dimension: output pixel i is the sum of
+// weight[i*stride + k] * src[start[i] + k], for k < count[i].
+typedef struct {
+  int* start;
+  int* count;
+  int16_t* weight;
+  int stride;
+} ResampleTable;
+
+static void resampleTableFree(ResampleTable* t) {
+  memFree(t->start);
+  memFree(t->count);
+  memFree(t->weight);
+}
+
+// Build the resampling table for n source pixels and m output pixels.
+// Returns nonzero on success.
+static int resampleTable(ResampleTable* t, int n, int m, ImageResizeMode mode) {
+  double scale = (double)n / m;
+  t->stride = mode == RESIZE_AREA ? (int)ceil(scale) + 1 : 2;
+  t->start = memAlloc(m*sizeof(int));
+  t->count = memAlloc(m*sizeof(int));
+  t->weight = memAlloc((size_t)m*t->stride*sizeof(int16_t));
+  double* w = memAlloc(t->stride*sizeof(double));
+  if (!check(t->start != NULL && t->count != NULL && t->weight != NULL && w != NULL,
+             "Allocating resize tables")) {
+    memFree(w);
+    resampleTableFree(t);
+    return 0;
+  }
+  for (int i = 0; i < m; i++) {
+    int start, count;
+    if (mode == RESIZE_NEAREST) {
+      start = (int)(((2*(int64_t)i + 1)*n) / (2*(int64_t)m));  // exact floor
+      count = 1;
+      w[0] = 1.0;
+    } else if (mode == RESIZE_BILINEAR) {
+      double pos = (double)((2*(int64_t)i + 1)*n - m) / (2.0*m);
+      if (pos < 0.0) pos = 0.0;
+      if (pos > n-1) pos = n-1;
+      start = (int)pos;
+      double f = pos - start;
+      count = start+1 < n ? 2 : 1;
+      w[0] = 1.0 - f;
+      w[1] = f;
+      if (count == 1) w[0] = 1.0;
+    } else {  // RESIZE_AREA: overlap of [left, right) with each source pixel
+      double left = (double)i*n/m, right = (double)(i+1)*n/m;
+      start = (int)left;
+      int end = (int)ceil(right);
+      if (end > n) end = n;
+      count = end - start;
+      for (int k = 0; k < count; k++) {
+        double a = start+k > left ? start+k : left;
+        double b = start+k+1 < right ? start+k+1 : right;
+        w[k] = (b - a) / scale;
+      }
+    }
+    // Quantize, then put the rounding error in the largest weight
+    int16_t* q = t->weight + (size_t)i*t->stride;
+    int sum = 0, big = 0;
+    for (int k = 0; k < count; k++) {
+      q[k] = (int16_t)lround(w[k] * (1 << RESIZEBITS));
+      sum += q[k];
+      if (q[k] > q[big]) big = k;
+    }
+    q[big] += (1 << RESIZEBITS) - sum;
+    t->start[i] = start;
+    t->count[i] = count;
+  }
+  memFree(w);
+  return 1;
+}
+
+/// Resize an image to newW x newH pixels.
+Image ImageResize(Image img, int newW, int newH, ImageResizeMode mode) { ///
+  assert (img != NULL);
+  assert (img->width > 0 && img->height > 0);
+  assert (newW > 0 && newH > 0);
+  int w = img->width;
+  int h = img->height;
+  ResampleTable tx = { NULL, NULL, NULL, 0 };
+  ResampleTable ty = { NULL, NULL, NULL, 0 };
+  int16_t* cache = NULL;   // ty.stride filtered rows, source row i in slot i%ty.stride
+  int* cached = NULL;      // source row in each cache slot (or -1)
+  int16_t** rows = NULL;
+  uint8* buf = NULL;       // copies of a source and an output row (tiled layout)
+  Image out = NULL;
+
+  int success =
+    resampleTable(&tx, w, newW, mode) &&
+    resampleTable(&ty, h, newH, mode) &&
+    check( (cache = memAlloc((size_t)ty.stride*newW*sizeof(int16_t))) != NULL, "Allocating row cache" ) &&
+    check( (cached = memAlloc(ty.stride*sizeof(int))) != NULL, "Allocating row cache" ) &&
+    check( (rows = memAlloc(ty.stride*sizeof(int16_t*))) != NULL, "Allocating row cache" ) &&
+    check( (buf = memAlloc((size_t)w + newW + 1)) != NULL, "Allocating row buffer" ) &&
+    (out = ImageCreateLayout(newW, newH, img->maxval, img->layout)) != NULL;
+
+  if (success) {
+    for (int k = 0; k < ty.stride; k++) cached[k] = -1;
+    for (int j = 0; j < newH; j++) {
+      // The rows of successive output rows move forward, so each source
+      // row is filtered once while it stays in the cache.
+      for (int k = 0; k < ty.count[j]; k++) {
+        int sy = ty.start[j] + k;
+        int16_t* row = cache + (size_t)(sy % ty.stride)*newW;
+        if (cached[sy % ty.stride] != sy) {
+          const uint8* src = rowBegin(img, 0, sy, w, buf);
+          for (int i = 0; i < newW; i++) {
+            const int16_t* q = tx.weight + (size_t)i*tx.stride;
+            const uint8* s = src + tx.start[i];
+            int32_t sum = 0;
+            for (int t = 0; t < tx.count[i]; t++) sum += q[t]*s[t];
+            row[i] = (int16_t)roundShift(sum, RESIZEBITS - RESIZEHBITS);
+          }
+          cached[sy % ty.stride] = sy;
+          COUNT(PIXMEM, (unsigned long)w);
+        }
+        rows[k] = row;
+      }
+      uint8* dst = rowOut(out, 0, j, newW, buf + w);
+      columnPass(rows, ty.weight + (size_t)j*ty.stride, ty.count[j], newW,
+                 RESIZEBITS + RESIZEHBITS, 1 << RESIZEBITS, 1 << RESIZEBITS,
+                 img->maxval, dst);
+      rowEnd(out, 0, j, newW, dst, buf + w);
+      COUNT(PIXMEM, (unsigned long)newW);
+    }
+  }
+
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&out);
+    errno = errsave;
+  }
+  memFree(buf);
+  memFree(rows);
+  memFree(cached);
+  memFree(cache);
+  resampleTableFree(&ty);
+  resampleTableFree(&tx);
+  return out;
+}
+
+
+/// Affine warp
+
+// Source positions are stepped in Q16 fixed point along each tile row,
+// starting from an exact position at the beginning of the row.
+// Output tiles match the tiles of LAYOUT_TILED, so each tile row is
+// contiguous in memory in both layouts.
+#define WARPBITS 16
+#define WARPTILE TILESIZE
+
+// Level at (x, y) of img, or fill if outside.
+static inline int warpFetch(Image img, int64_t x, int64_t y, int fill) {
+  if (x < 0 || y < 0 || x >= img->width || y >= img->height) return fill;
+  return img->pixel[G(img, (int)x, (int)y)];
+}
+
+/// Affine transformation (warp) of an image.
+Image ImageWarpAffine(Image img, const double matrix[6], int outW, int outH,
+                      uint8 fill, ImageResizeMode mode) { ///
+  assert (img != NULL);
+  assert (matrix != NULL);
+  assert (outW >= 0 && outH >= 0);
+  assert (fill <= img->maxval);
+  assert (mode == RESIZE_NEAREST || mode == RESIZE_BILINEAR);
+  // Invert the matrix: output (x, y) -> source (u, v)
+  const double* m = matrix;
+  double det = m[0]*m[4] - m[1]*m[3];
+  assert (det != 0.0);
+  double ia = m[4]/det, ib = -m[1]/det, id = -m[3]/det, ie = m[0]/det;
+  double ic = -(ia*m[2] + ib*m[5]);
+  double iff = -(id*m[2] + ie*m[5]);
+  const double one = (double)(1 << WARPBITS);
+  int64_t stepU = llround(ia*one);  // source step for x+1
+  int64_t stepV = llround(id*one);
+
+  Image out = ImageCreateLayout(outW, outH, img->maxval, img->layout);
+  if (out == NULL) return NULL;
+  int w = img->width;
+  int h = img->height;
+  int raster = img->layout == LAYOUT_RASTER;
+
+  for (int ty = 0; ty < outH; ty += WARPTILE) {
+    int tyEnd = ty + WARPTILE < outH ? ty + WARPTILE : outH;
+    for (int tx = 0; tx < outW; tx += WARPTILE) {
+      int txEnd = tx + WARPTILE < outW ? tx + WARPTILE : outW;
+      for (int y = ty; y < tyEnd; y++) {
+        int len;
+        uint8* dst = span(out, tx, y, &len);  // pixels [tx, txEnd) of row y
+        int64_t u = llround((ia*tx + ib*y + ic)*one);
+        int64_t v = llround((id*tx + ie*y + iff)*one);
+        if (mode == RESIZE_NEAREST) {
+          const int64_t half = (int64_t)1 << (WARPBITS-1);
+          for (int x = tx; x < txEnd; x++, u += stepU, v += stepV) {
+            int64_t sx = (u + half) >> WARPBITS;
+            int64_t sy = (v + half) >> WARPBITS;
+            dst[x-tx] = (uint8)warpFetch(img, sx, sy, fill);
+          }
+        } else {
+          for (int x = tx; x < txEnd; x++, u += stepU, v += stepV) {
+            int64_t sx = u >> WARPBITS;
+            int64_t sy = v >> WARPBITS;
+            if (sx < -1 || sy < -1 || sx >= w || sy >= h) {
+              dst[x-tx] = fill;
+              continue;
+            }
+            // Q8 fractions
+            int fx = (int)((u >> (WARPBITS-8)) & 0xFF);
+            int fy = (int)((v >> (WARPBITS-8)) & 0xFF);
+            int p00, p01, p10, p11;
+            if (raster && sx >= 0 && sy >= 0 && sx+1 < w && sy+1 < h) {
+              const uint8* s = img->pixel + (size_t)sy*w + sx;
+              p00 = s[0]; p01 = s[1]; p10 = s[w]; p11 = s[w+1];
+            } else {
+              p00 = warpFetch(img, sx, sy, fill);
+              p01 = warpFetch(img, sx+1, sy, fill);
+              p10 = warpFetch(img, sx, sy+1, fill);
+              p11 = warpFetch(img, sx+1, sy+1, fill);
+            }
+            int top = p00*(256-fx) + p01*fx;
+            int bottom = p10*(256-fx) + p11*fx;
+            dst[x-tx] = (uint8)((top*(256-fy) + bottom*fy + (1 << 15)) >> 16);
+          }
+        }
+      }
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)outW*outH*(mode == RESIZE_NEAREST ? 2 : 5));
+  return out;
+}
+
+/// Image comparison
+
+/// Compare two images.
+/// Returns 1 (true) if img1 and img2 have the same size, maxval and pixel
+/// levels, whatever their layouts, and 0 otherwise.
+int ImageEqual(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  if (img1->width != img2->width || img1->height != img2->height ||
+      img1->maxval != img2->maxval) return 0;
+  // Compare runs contiguous in both images (whole rows, in the raster
+  // layout) with memcmp, and stop at the first difference.
+  unsigned long reads = 0;
+  int equal = 1;
+  for (int y = 0; y < img1->height && equal; y++) {
+    for (int x = 0, len; x < img1->width && equal; x += len) {
+      int len2;
+      const uint8* p1 = span(img1, x, y, &len);
+      const uint8* p2 = span(img2, x, y, &len2);
+      if (len > len2) len = len2;
+      equal = memcmp(p1, p2, len) == 0;
+      reads += 2ul*len;
+    }
+  }
+  COUNT(PIXMEM, reads);
+  return equal;
+}
+
+// Mixing constants and round of xxHash64
+#define PRIME1 0x9E3779B185EBCA87u
+#define PRIME2 0xC2B2AE3D27D4EB4Fu
+#define PRIME3 0x165667B19E3779F9u
+
+static inline uint64 rotl64(uint64 v, int r) {
+  return v << r | v >> (64 - r);
+}
+
+static inline uint64 hashRound(uint64 acc, uint64 v) {
+  return rotl64(acc + v*PRIME2, 31)*PRIME1;
+}
+
+static inline uint64 load64(const uint8* p) {
+  uint64 v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+/// 64-bit hash of an image.
+/// The hash covers the size, maxval and pixel levels, but not the layout:
+/// equal images (see ImageEqual) have equal hashes.
+uint64 ImageHash(Image img) { ///
+  assert (img != NULL);
+  // The pixels are read row after row in stripes of 32 bytes, which are
+  // mixed into 4 independent accumulators; the few pixels left at the end
+  // of each row are mixed into the first.  Spans of the tiled layout hold
+  // 64 pixels, except at the end of rows, so both layouts mix the same
+  // values in the same order.
+  uint64 acc[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0, len; x < img->width; x += len) {
+      const uint8* p = span(img, x, y, &len);
+      int i = 0;
+      for (; i + 32 <= len; i += 32) {
+        acc[0] = hashRound(acc[0], load64(p + i));
+        acc[1] = hashRound(acc[1], load64(p + i + 8));
+        acc[2] = hashRound(acc[2], load64(p + i + 16));
+        acc[3] = hashRound(acc[3], load64(p + i + 24));
+      }
+      for (; i + 8 <= len; i += 8) acc[0] = hashRound(acc[0], load64(p + i));
+      for (; i < len; i++) acc[0] = hashRound(acc[0], p[i]);
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)img->width*img->height);
+  uint64 h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+  h = hashRound(h, (uint64)img->width << 32 | (uint64)img->height);
+  h = hashRound(h, (uint64)img->maxval);
+  // Final avalanche, so that every input bit affects every output bit
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+/// Find where two images of the same size differ.
+/// Pixels differ if their levels differ (maxval is not compared).
+/// On success, returns the number n of changed regions (8-connected
+/// regions of pixels that differ), sets *count to the number of pixels
+/// that differ and *maxdiff to the maximum absolute difference of their
+/// levels, and if regions != NULL, sets *regions as ImageLabel does.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageDiff(Image img1, Image img2, uint64* count, int* maxdiff,
+              ImageRegion** regions) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  int w = img1->width;
+  // Mask of the pixels that differ, labelled by ImageLabel
+  Image mask = ImageCreate(w, img1->height, 1);
+  uint8* buf = NULL;
+  if (!(check(mask != NULL, "Allocating diff mask") &&
+        check((buf = memAlloc(2*(size_t)w + 1)) != NULL, "Allocating rows"))) {
+    errsave = errno;
+    ImageDestroy(&mask);
+    errno = errsave;
+    return -1;
+  }
+  uint64 changed = 0;
+  int maxd = 0;
+  for (int y = 0; y < img1->height; y++) {
+    const uint8* r1 = rowBegin(img1, 0, y, w, buf);
+    const uint8* r2 = rowBegin(img2, 0, y, w, buf + w);
+    if (memcmp(r1, r2, w) == 0) continue;
+    uint8* m = mask->pixel + (size_t)y*w;
+    for (int x = 0; x < w; x++) {
+      int d = abs(r1[x] - r2[x]);
+      m[x] = d != 0;
+      changed += d != 0;
+      if (d > maxd) maxd = d;
+    }
+  }
+  memFree(buf);
+  COUNT(PIXMEM, 2ul*(unsigned long)w*img1->height);
+  int n = 0;
+  if (changed > 0) {
+    n = ImageLabel(mask, 8, ImageThreads(), NULL, regions);
+  } else if (regions != NULL) {
+    *regions = NULL;
+  }
+  errsave = errno;
+  ImageDestroy(&mask);
+  errno = errsave;
+  if (n < 0) return -1;
+  *count = changed;
+  *maxdiff = maxd;
+  return n;
+}
+
+
+/// Bilevel images
+
+// A bilevel image packs 64 pixels in each 64-bit word: pixel (x,y) is bit
+// x%64 (least significant first) of word x/64 of row y.  Each row starts
+// on a word, and the padding bits after the last pixel of a row are always
+// 0, so that whole words may be combined, compared and counted.
+// The instrumentation counts word accesses as pixmem.
+struct bitImage {
+  int width;
+  int height;
+  int words;     // words per row
+  uint64* bits;  // the rows, in order
+};
+
+static inline uint64* bitRow(BitImage b, int y) {
+  return b->bits + (size_t)y*b->words;
+}
+
+// Mask of the pixels in the last word of a row of the given width.
+static inline uint64 lastMask(int width) {
+  return (width & 63) != 0 ? ((uint64)1 << (width & 63)) - 1 : ~(uint64)0;
+}
+
+// The 64 pixels of a row (words long) from column x on (0 past its end).
+static inline uint64 getBits(const uint64* row, int words, int x) {
+  int k = x >> 6, s = x & 63;
+  uint64 v = k < words ? row[k] >> s : 0;
+  if (s != 0 && k + 1 < words) v |= row[k+1] << (64 - s);
+  return v;
+}
+
+/// Create a new bilevel image, with all pixels 0.
+BitImage BitImageCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  BitImage b = memAlloc(sizeof(struct bitImage));
+  if (!check(b != NULL, "Allocating bilevel image")) return NULL;
+  b->width = width;
+  b->height = height;
+  b->words = (width + 63) >> 6;
+  b->bits = memCalloc((size_t)b->words*height + 1, sizeof(uint64));
+  if (!check(b->bits != NULL, "Allocating bits")) {
+    errsave = errno;
+    memFree(b);
+    errno = errsave;
+    return NULL;
+  }
+  return b;
+}
+
+/// Destroy the bilevel image pointed to by (*bp).
+void BitImageDestroy(BitImage* bp) { ///
+  assert (bp != NULL);
+  if (*bp != NULL) {
+    memFree((*bp)->bits);
+    memFree(*bp);
+    *bp = NULL;
+  }
+}
+
+/// Get bilevel image width
+int BitImageWidth(BitImage b) { ///
+  assert (b != NULL);
+  return b->width;
+}
+
+/// Get bilevel image height
+int BitImageHeight(BitImage b) { ///
+  assert (b != NULL);
+  return b->height;
+}
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitImageGetPixel(BitImage b, int x, int y) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  COUNT_PIXEL(PIXMEM, 1);
+  return (bitRow(b, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+/// Set the pixel at position (x,y) to v (0 or 1).
+void BitImageSetPixel(BitImage b, int x, int y, int v) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  uint64 bit = (uint64)1 << (x & 63);
+  uint64* w = &bitRow(b, y)[x >> 6];
+  *w = v ? *w | bit : *w & ~bit;
+  COUNT_PIXEL(PIXMEM, 1);
+}
+
+// Pack the n <= 64 levels at p: bit i is 1 if p[i] >= thr.
+static uint64 packBits(const uint8* p, int n, uint8 thr) {
+  uint64 v = 0;
+  int i = 0;
+#ifdef __SSE2__
+  // p[i] >= thr  <=>  max(p[i], thr) == p[i]  (unsigned)
+  __m128i t = _mm_set1_epi8((char)thr);
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+    uint64 m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, t), x));
+    v |= m << i;
+  }
+#endif
+  for (; i < n; i++) v |= (uint64)(p[i] >= thr) << i;
+  return v;
+}
+
+/// Convert an image to a bilevel image.
+/// Pixels with level >= thr become 1, the others 0 (as in ImageThreshold,
+/// where they become white and black).
+BitImage BitImageFromImage(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  int w = img->width;
+  BitImage b = BitImageCreate(w, img->height);
+  uint8* buf = NULL;
+  if (b == NULL) return NULL;
+  if (!check((buf = memAlloc((size_t)w + 1)) != NULL, "Allocating row buffer")) {
+    errsave = errno;
+    BitImageDestroy(&b);
+    errno = errsave;
+    return NULL;
+  }
+  for (int y = 0; y < img->height; y++) {
+    const uint8* p = rowBegin(img, 0, y, w, buf);
+    uint64* row = bitRow(b, y);
+    for (int k = 0; k < b->words; k++) {
+      row[k] = packBits(p + 64*k, w - 64*k < 64 ? w - 64*k : 64, thr);
+    }
+  }
+  memFree(buf);
+  COUNT(PIXMEM, (unsigned long)w*img->height + (unsigned long)b->words*b->height);
+  return b;
+}
+
+/// Convert a bilevel image to a new image with the given maxval.
+/// Pixels 1 become maxval (white), pixels 0 become 0 (black).
+Image BitImageToImage(BitImage b, uint8 maxval) { ///
+  assert (b != NULL);
+  int w = b->width;
+  Image img = ImageCreate(w, b->height, maxval);
+  if (img == NULL) return NULL;
+  // Levels of 8 pixels for each byte of bits
+  uint8 expand[256][8];
+  for (int v = 0; v < 256; v++) {
+    for (int i = 0; i < 8; i++) expand[v][i] = (v >> i) & 1 ? maxval : 0;
+  }
+  for (int y = 0; y < b->height; y++) {
+    const uint64* row = bitRow(b, y);
+    uint8* p = img->pixel + (size_t)y*w;
+    int x = 0;
+    for (; x + 8 <= w; x += 8) memcpy(p + x, expand[(row[x >> 6] >> (x & 63)) & 0xFF], 8);
+    for (; x < w; x++) p[x] = (row[x >> 6] >> (x & 63)) & 1 ? maxval : 0;
+  }
+  COUNT(PIXMEM, (unsigned long)w*b->height + (unsigned long)b->words*b->height);
+  return img;
+}
+
+/// Bitwise operations between bilevel images of the same size.
+/// They modify dst in-place: dst = dst AND src, dst OR src, dst XOR src.
+
+void BitImageAnd(BitImage dst, BitImage src) { ///
+  assert (dst != NULL && src != NULL);
+  assert (dst->width == src->width && dst->height == src->height);
+  size_t n = (size_t)dst->words*dst->height;
+  for (size_t i = 0; i < n; i++) dst->bits[i] &= src->bits[i];
+  COUNT(PIXMEM, 3ul*n);
+}
+
+void BitImageOr(BitImage dst, BitImage src) { ///
+  assert (dst != NULL && src != NULL);
+  assert (dst->width == src->width && dst->height == src->height);
+  size_t n = (size_t)dst->words*dst->height;
+  for (size_t i = 0; i < n; i++) dst->bits[i] |= src->bits[i];
+  COUNT(PIXMEM, 3ul*n);
+}
+
+void BitImageXor(BitImage dst, BitImage src) { ///
+  assert (dst != NULL && src != NULL);
+  assert (dst->width == src->width && dst->height == src->height);
+  size_t n = (size_t)dst->words*dst->height;
+  for (size_t i = 0; i < n; i++) dst->bits[i] ^= src->bits[i];
+  COUNT(PIXMEM, 3ul*n);
+}
+
+/// Invert all pixels of b in-place.
+void BitImageNot(BitImage b) { ///
+  assert (b != NULL);
+  if (b->words == 0) return;
+  uint64 mask = lastMask(b->width);
+  for (int y = 0; y < b->height; y++) {
+    uint64* row = bitRow(b, y);
+    for (int k = 0; k < b->words; k++) row[k] = ~row[k];
+    row[b->words - 1] &= mask;  // keep the padding at 0
+  }
+  COUNT(PIXMEM, 2ul*b->words*b->height);
+}
+
+/// Number of pixels 1 in b.
+uint64 BitImageArea(BitImage b) { ///
+  assert (b != NULL);
+  size_t n = (size_t)b->words*b->height;
+  uint64 area = 0;
+  for (size_t i = 0; i < n; i++) area += __builtin_popcountll(b->bits[i]);
+  COUNT(PIXMEM, n);
+  return area;
+}
+
+/// Projections of b: the number of pixels 1 in each row and column.
+/// Sets rows[y] for each row y, if rows != NULL, and cols[x] for each
+/// column x, if cols != NULL.
+void BitImageProjections(BitImage b, uint32_t* rows, uint32_t* cols) { ///
+  assert (b != NULL);
+  if (rows != NULL) {
+    for (int y = 0; y < b->height; y++) {
+      const uint64* row = bitRow(b, y);
+      uint32_t count = 0;
+      for (int k = 0; k < b->words; k++) count += __builtin_popcountll(row[k]);
+      rows[y] = count;
+    }
+    COUNT(PIXMEM, (unsigned long)b->words*b->height);
+  }
+  if (cols != NULL) {
+    // The 64 columns of a word are counted in parallel, with bit-sliced
+    // counters: bit i of plane[p] is bit p of the count of column i.
+    // Bands of 255 rows fit in 8 planes.
+    memset(cols, 0, (size_t)b->width*sizeof(uint32_t));
+    for (int k = 0; k < b->words; k++) {
+      int n = b->width - 64*k < 64 ? b->width - 64*k : 64;
+      for (int y0 = 0; y0 < b->height; y0 += 255) {
+        int y1 = y0 + 255 < b->height ? y0 + 255 : b->height;
+        uint64 plane[8] = { 0 };
+        for (int y = y0; y < y1; y++) {
+          uint64 carry = bitRow(b, y)[k];
+          for (int p = 0; carry != 0; p++) {
+            uint64 t = plane[p] & carry;
+            plane[p] ^= carry;
+            carry = t;
+          }
+        }
+        for (int i = 0; i < n; i++) {
+          uint32_t count = 0;
+          for (int p = 0; p < 8; p++) count |= (uint32_t)((plane[p] >> i) & 1) << p;
+          cols[64*k + i] += count;
+        }
+      }
+    }
+    COUNT(PIXMEM, (unsigned long)b->words*b->height);
+  }
+}
+
+// Transpose the 64x64 bit matrix a in-place: bit c of a[r] becomes bit r
+// of a[c].  The four 32x32 quadrants are transposed and the off-diagonal
+// ones swapped, recursively, all at once (Hacker's Delight, 7-3).
+static void transpose64(uint64 a[64]) {
+  uint64 m = 0x00000000FFFFFFFFu;
+  for (int j = 32; j != 0; j >>= 1, m ^= m << j) {
+    for (int k = 0; k < 64; k = (k + j + 1) & ~j) {
+      uint64 t = ((a[k] >> j) ^ a[k + j]) & m;
+      a[k] ^= t << j;
+      a[k + j] ^= t;
+    }
+  }
+}
+
+// Reverse the order of the bits of v.
+static inline uint64 reverse64(uint64 v) {
+  v = ((v >> 1) & 0x5555555555555555u) | ((v & 0x5555555555555555u) << 1);
+  v = ((v >> 2) & 0x3333333333333333u) | ((v & 0x3333333333333333u) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Fu) | ((v & 0x0F0F0F0F0F0F0F0Fu) << 4);
+  return __builtin_bswap64(v);
+}
+
+/// Geometric transformations of bilevel images, as those of images.
+/// Success and failure are treated as in BitImageCreate.
+
+/// Rotate b 90 degrees counterclockwise (see ImageRotate).
+/// Works on blocks of 64x64 pixels, transposed as bit matrices.
+BitImage BitImageRotate(BitImage b) { ///
+  assert (b != NULL);
+  BitImage r = BitImageCreate(b->height, b->width);
+  if (r == NULL) return NULL;
+  uint64 block[64];
+  for (int j0 = 0; j0 < b->height; j0 += 64) {
+    for (int k = 0; k < b->words; k++) {
+      for (int j = 0; j < 64; j++) block[j] = j0 + j < b->height ? bitRow(b, j0 + j)[k] : 0;
+      transpose64(block);
+      // Column x = 64k+i of b becomes row width-1-x of r
+      for (int i = 0; i < 64 && 64*k + i < b->width; i++) {
+        bitRow(r, b->width - 1 - (64*k + i))[j0 >> 6] = block[i];
+      }
+    }
+  }
+  COUNT(PIXMEM, 2ul*b->words*b->height);
+  return r;
+}
+
+/// Mirror b left-right (see ImageMirror).
+/// Each row is reversed a word at a time.
+BitImage BitImageMirror(BitImage b) { ///
+  assert (b != NULL);
+  BitImage m = BitImageCreate(b->width, b->height);
+  if (m == NULL) return NULL;
+  int n = b->words;
+  int s = 64*n - b->width;  // padding bits, which move to the start of the reversed row
+  for (int y = 0; y < b->height; y++) {
+    const uint64* in = bitRow(b, y);
+    uint64* out = bitRow(m, y);
+    for (int k = 0; k < n; k++) {
+      uint64 lo = reverse64(in[n-1 - k]);
+      uint64 hi = k + 1 < n ? reverse64(in[n-2 - k]) : 0;
+      out[k] = s != 0 ? lo >> s | hi << (64 - s) : lo;
+    }
+  }
+  COUNT(PIXMEM, 2ul*b->words*b->height);
+  return m;
+}
+
+/// Crop the rectangle at (x,y) with width w and height h from b
+/// (see ImageCrop).
+/// Requires: the rectangle must be inside b.
+BitImage BitImageCrop(BitImage b, int x, int y, int w, int h) { ///
+  assert (b != NULL);
+  assert (0 <= x && 0 <= w && x + w <= b->width);
+  assert (0 <= y && 0 <= h && y + h <= b->height);
+  BitImage c = BitImageCreate(w, h);
+  if (c == NULL) return NULL;
+  for (int j = 0; j < h; j++) {
+    const uint64* in = bitRow(b, y + j);
+    uint64* out = bitRow(c, j);
+    for (int k = 0; k < c->words; k++) out[k] = getBits(in, b->words, x + 64*k);
+    if (c->words > 0) out[c->words - 1] &= lastMask(w);
+  }
+  COUNT(PIXMEM, 3ul*c->words*h);
+  return c;
+}
+
+// Compare b2 to the subimage of b1 at (x,y), 64 pixels at a time.
+// Adds the words compared to *words.
+static int bitMatch(BitImage b1, int x, int y, BitImage b2, unsigned long* words) {
+  uint64 mask = lastMask(b2->width);
+  for (int j = 0; j < b2->height; j++) {
+    const uint64* in = bitRow(b1, y + j);
+    const uint64* sub = bitRow(b2, j);
+    for (int k = 0; k < b2->words; k++) {
+      uint64 v = getBits(in, b1->words, x + 64*k);
+      if (k == b2->words - 1) v &= mask;
+      ++*words;
+      if (v != sub[k]) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Compare a bilevel image to a subimage of a larger one.
+/// Returns 1 (true) if b2 matches the subimage of b1 at pos (x, y).
+/// Returns 0, otherwise.
+int BitImageMatchSubImage(BitImage b1, int x, int y, BitImage b2) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  assert (0 <= x && x + b2->width <= b1->width);
+  assert (0 <= y && y + b2->height <= b1->height);
+  unsigned long words = 0;
+  int match = bitMatch(b1, x, y, b2, &words);
+  COUNT(PIXMEM, 2ul*words);
+  return match;
+}
+
+/// Locate a bilevel subimage inside another (see ImageLocateSubImage).
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocateSubImage(BitImage b1, int* px, int* py, BitImage b2) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  unsigned long positions = 0, words = 0;
+  int found = 0;
+  for (int y = 0; y <= b1->height - b2->height && !found; y++) {
+    for (int x = 0; x <= b1->width - b2->width && !found; x++) {
+      positions++;
+      if (bitMatch(b1, x, y, b2, &words)) {
+        *px = x;
+        *py = y;
+        found = 1;
+      }
+    }
+  }
+  COUNT(LocateCompar, positions);
+  COUNT(PIXMEM, 2ul*words);
+  return found;
+}
+
+
+/// Run-length encoded images
+
+// An RLE image stores each row as a sequence of runs of equal levels.
+// The runs of all rows are kept in one array, in raster order: those of
+// row y are run[start[y]] to run[start[y+1]-1].  Adjacent runs of a row
+// always have different levels, and no run is empty, so that the number
+// of runs depends only on the contents.
+// The instrumentation counts run accesses as pixmem.
+typedef struct {
+  int length;
+  uint8 level;
+} LevelRun;
+
+struct rleImage {
+  int width;
+  int height;
+  int maxval;
+  int* start;    // height+1 indices into run
+  LevelRun* run;
+  int count;     // runs in use
+  int capacity;  // runs allocated
+};
+
+// Create an RLE image with no runs yet, to be filled by appendRun.
+static RLEImage rleNew(int width, int height, int maxval) {
+  RLEImage r = memAlloc(sizeof(struct rleImage));
+  if (!check(r != NULL, "Allocating RLE image")) return NULL;
+  r->width = width;
+  r->height = height;
+  r->maxval = maxval;
+  r->run = NULL;
+  r->count = r->capacity = 0;
+  r->start = memCalloc((size_t)height + 1, sizeof(int));
+  if (!check(r->start != NULL, "Allocating RLE rows")) {
+    errsave = errno;
+    memFree(r);
+    errno = errsave;
+    return NULL;
+  }
+  return r;
+}
+
+// Append a run to row y of r, the row being built (r->start[y] must be set),
+// merging it with the previous run of the row if they have the same level.
+// Returns 1 on success, or 0 if the runs could not be reallocated.
+static int appendRun(RLEImage r, int y, int length, uint8 level) {
+  if (length == 0) return 1;
+  if (r->count > r->start[y] && r->run[r->count - 1].level == level) {
+    r->run[r->count - 1].length += length;
+    return 1;
+  }
+  if (r->count == r->capacity) {
+    int capacity = r->capacity > 0 ? 2*r->capacity : 256;
+    LevelRun* run = memRealloc(r->run, (size_t)capacity*sizeof(LevelRun));
+    if (!check(run != NULL, "Allocating runs")) return 0;
+    r->run = run;
+    r->capacity = capacity;
+  }
+  r->run[r->count++] = (LevelRun){ length, level };
+  return 1;
+}
+
+// Finish building r: close the last row and release the unused runs.
+static RLEImage rleEnd(RLEImage r) {
+  r->start[r->height] = r->count;
+  if (r->count < r->capacity && r->count > 0) {
+    LevelRun* run = memRealloc(r->run, (size_t)r->count*sizeof(LevelRun));
+    if (run != NULL) {  // otherwise, keep the larger array
+      r->run = run;
+      r->capacity = r->count;
+    }
+  }
+  return r;
+}
+
+/// Destroy the RLE image pointed to by (*rp).
+void RLEImageDestroy(RLEImage* rp) { ///
+  assert (rp != NULL);
+  if (*rp != NULL) {
+    memFree((*rp)->run);
+    memFree((*rp)->start);
+    memFree(*rp);
+    *rp = NULL;
+  }
+}
+
+// Destroy r after a failure, preserving errno, and return NULL.
+static RLEImage rleFail(RLEImage r) {
+  errsave = errno;
+  RLEImageDestroy(&r);
+  errno = errsave;
+  return NULL;
+}
+
+/// Get RLE image width
+int RLEImageWidth(RLEImage r) { ///
+  assert (r != NULL);
+  return r->width;
+}
+
+/// Get RLE image height
+int RLEImageHeight(RLEImage r) { ///
+  assert (r != NULL);
+  return r->height;
+}
+
+/// Get RLE image maximum gray level
+int RLEImageMaxval(RLEImage r) { ///
+  assert (r != NULL);
+  return r->maxval;
+}
+
+/// Number of runs in r.
+int RLEImageRuns(RLEImage r) { ///
+  assert (r != NULL);
+  return r->count;
+}
+
+/// Convert an image to run-length encoding.
+RLEImage RLEImageFromImage(Image img) { ///
+  assert (img != NULL);
+  int w = img->width;
+  RLEImage r = rleNew(w, img->height, img->maxval);
+  if (r == NULL) return NULL;
+  uint8* buf = memAlloc((size_t)w + 1);
+  if (!check(buf != NULL, "Allocating row buffer")) return rleFail(r);
+  for (int y = 0; y < img->height; y++) {
+    const uint8* p = rowBegin(img, 0, y, w, buf);
+    r->start[y] = r->count;
+    for (int x = 0; x < w; ) {
+      int x0 = x;
+      while (++x < w && p[x] == p[x0]) ;
+      if (!appendRun(r, y, x - x0, p[x0])) {
+        memFree(buf);
+        return rleFail(r);
+      }
+    }
+  }
+  memFree(buf);
+  COUNT(PIXMEM, (unsigned long)w*img->height + r->count);
+  return rleEnd(r);
+}
+
+/// Convert an RLE image to a new image.
+Image RLEImageToImage(RLEImage r) { ///
+  assert (r != NULL);
+  Image img = ImageCreate(r->width, r->height, r->maxval);
+  if (img == NULL) return NULL;
+  for (int y = 0; y < r->height; y++) {
+    uint8* p = img->pixel + (size_t)y*r->width;
+    for (int i = r->start[y]; i < r->start[y+1]; i++) {
+      memset(p, r->run[i].level, r->run[i].length);
+      p += r->run[i].length;
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)r->width*r->height + r->count);
+  return img;
+}
+
+/// Pixel stats of an RLE image, as ImageStats.
+/// (Both are 0 if r has no pixels.)
+void RLEImageStats(RLEImage r, uint8* min, uint8* max) { ///
+  assert (r != NULL);
+  uint8 lo = r->count > 0 ? r->run[0].level : 0, hi = lo;
+  for (int i = 1; i < r->count; i++) {
+    uint8 v = r->run[i].level;
+    if (v < lo) lo = v;
+    if (v > hi) hi = v;
+  }
+  *min = lo;
+  *max = hi;
+  COUNT(PIXMEM, r->count);
+}
+
+// Replace the level v of each run by lut[v], merging the runs of each row
+// that become equal (in-place, as the number of runs can only decrease).
+static void mapRuns(RLEImage r, const uint8 lut[256]) {
+  int n = 0;
+  for (int y = 0; y < r->height; y++) {
+    int begin = r->start[y], end = r->start[y+1];
+    r->start[y] = n;
+    for (int i = begin; i < end; i++) {
+      uint8 level = lut[r->run[i].level];
+      if (n > r->start[y] && r->run[n-1].level == level) {
+        r->run[n-1].length += r->run[i].length;
+      } else {
+        r->run[n++] = (LevelRun){ r->run[i].length, level };
+      }
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)r->count + n);
+  r->count = n;
+  r->start[r->height] = n;
+}
+
+/// Point operations on RLE images, with the same results as ImageNegative,
+/// ImageThreshold and ImageBrighten.  They modify r in-place.
+
+void RLEImageNegative(RLEImage r) { ///
+  assert (r != NULL);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = (uint8)(r->maxval - v);
+  mapRuns(r, lut);
+}
+
+void RLEImageThreshold(RLEImage r, uint8 thr) { ///
+  assert (r != NULL);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = v < thr ? 0 : r->maxval;
+  mapRuns(r, lut);
+}
+
+void RLEImageBrighten(RLEImage r, double factor) { ///
+  assert (r != NULL);
+  assert (factor >= 0.0);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    int level = v*factor + 0.5;
+    lut[v] = level > r->maxval ? r->maxval : level;
+  }
+  mapRuns(r, lut);
+}
+
+// Append the part of row y of r in columns [x, x+w) to row j of out.
+// Returns 1 on success, or 0 on failure.
+static int appendSpan(RLEImage out, int j, RLEImage r, int y, int x, int w) {
+  int i = r->start[y], end = r->start[y+1];
+  int pos = 0;  // column where run i starts
+  while (i < end && pos + r->run[i].length <= x) pos += r->run[i++].length;
+  for (; i < end && pos < x + w; pos += r->run[i++].length) {
+    int a = pos > x ? pos : x;
+    int b = pos + r->run[i].length < x + w ? pos + r->run[i].length : x + w;
+    if (!appendRun(out, j, b - a, r->run[i].level)) return 0;
+  }
+  return 1;
+}
+
+/// Geometric transformations of RLE images, with the same results as
+/// ImageMirror and ImageCrop.
+/// Success and failure are treated as in ImageCreate.
+
+/// Mirror r left-right, reversing the runs of each row.
+RLEImage RLEImageMirror(RLEImage r) { ///
+  assert (r != NULL);
+  RLEImage m = rleNew(r->width, r->height, r->maxval);
+  if (m == NULL) return NULL;
+  for (int y = 0; y < r->height; y++) {
+    m->start[y] = m->count;
+    for (int i = r->start[y+1] - 1; i >= r->start[y]; i--) {
+      if (!appendRun(m, y, r->run[i].length, r->run[i].level)) return rleFail(m);
+    }
+  }
+  COUNT(PIXMEM, 2ul*r->count);
+  return rleEnd(m);
+}
+
+/// Crop the rectangle at (x,y) with width w and height h from r.
+/// Requires: the rectangle must be inside r.
+RLEImage RLEImageCrop(RLEImage r, int x, int y, int w, int h) { ///
+  assert (r != NULL);
+  assert (0 <= x && 0 <= w && x + w <= r->width);
+  assert (0 <= y && 0 <= h && y + h <= r->height);
+  RLEImage c = rleNew(w, h, r->maxval);
+  if (c == NULL) return NULL;
+  for (int j = 0; j < h; j++) {
+    c->start[j] = c->count;
+    if (!appendSpan(c, j, r, y + j, x, w)) return rleFail(c);
+  }
+  COUNT(PIXMEM, (unsigned long)(r->start[y+h] - r->start[y]) + c->count);
+  return rleEnd(c);
+}
+
+/// Paste r2 into position (x, y) of r1, as ImagePaste.
+/// This modifies r1 in-place, but, unlike ImagePaste, needs to allocate
+/// runs: on success, returns 1; on failure, returns 0, r1 is unchanged and
+/// errno/errCause are set accordingly.
+/// Requires: r2 must fit inside r1 at position (x, y).
+int RLEImagePaste(RLEImage r1, int x, int y, RLEImage r2) { ///
+  assert (r1 != NULL);
+  assert (r2 != NULL);
+  int w = r2->width;
+  assert (0 <= x && x + w <= r1->width);
+  assert (0 <= y && y + r2->height <= r1->height);
+  RLEImage t = rleNew(r1->width, r1->height, r1->maxval);
+  if (t == NULL) return 0;
+  for (int j = 0; j < r1->height; j++) {
+    t->start[j] = t->count;
+    int ok;
+    if (j < y || j >= y + r2->height) {
+      ok = appendSpan(t, j, r1, j, 0, r1->width);
+    } else {
+      ok = appendSpan(t, j, r1, j, 0, x) &&
+           appendSpan(t, j, r2, j - y, 0, w) &&
+           appendSpan(t, j, r1, j, x + w, r1->width - (x + w));
+    }
+    if (!ok) {
+      rleFail(t);
+      return 0;
+    }
+  }
+  COUNT(PIXMEM, (unsigned long)r1->count + r2->count + t->count);
+  rleEnd(t);
+  // Move the new runs into r1
+  memFree(r1->run);
+  memFree(r1->start);
+  *r1 = *t;
+  memFree(t);
+  return 1;
+}
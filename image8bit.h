@@ -13,16 +13,38 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
 
+// Type for pixel counts
+typedef uint64_t uint64;
+
+// Instrumentation level, chosen at build time (make INSTR=n):
+//   0 = off: no counting and no calibration;
+//   1 = per operation: bulk operations add their exact counts once per
+//       row or once per call, single pixel accessors do not count;
+//   2 = per pixel: ImageGetPixel and ImageSetPixel count too (the default).
+#ifndef INSTR_LEVEL
+#define INSTR_LEVEL 2
+#endif
+
 // Maximum value you can store in a pixel (maximum maxval accepted)
 extern const uint8 PixMax;
 
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+/// Pixel storage layouts.
+/// The layout only affects performance: all functions accept images with
+/// either layout, and images derived from another image (by rotation,
+/// cropping, etc.) keep its layout.
+typedef enum {
+  LAYOUT_RASTER,  // a single raster scan (the default)
+  LAYOUT_TILED,   // 64x64 tiles, better for column-oriented access
+} ImageLayout;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,12 +55,105 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+///
+/// The error cause is kept per thread (or per context, see below), like
+/// errno: it describes the last failure in the calling thread.
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply calibrate instrumentation and set names of counters,
+/// and choose the number of threads (see ImageInitThreads).
+/// Must be called before any other thread uses the library.
 void ImageInit(void) ;
 
+/// Init Image library, with up to nthreads threads for the operations on
+/// whole images (see Parallel operations below).
+/// (Call once, instead of ImageInit!)
+/// If nthreads <= 0, it is taken from environment variable
+/// IMAGE8BIT_THREADS, or else it is the number of online processors.
+void ImageInitThreads(int nthreads) ;
+
+/// Number of threads used by operations on whole images (1: serial).
+int ImageThreads(void) ;
+
+/// Memory used by the library, see ImageMemory.
+typedef struct {
+  uint64 live;    // bytes allocated now (in all threads)
+  uint64 peak;    // maximum of live since the last InstrReset
+  uint64 total;   // bytes allocated since the last InstrReset
+  uint64 allocs;  // number of allocations since the last InstrReset
+} ImageMemStats;
+
+/// Memory used by the library.
+/// Sets *stats to the memory of the images and internal scratch buffers:
+/// live and peak bytes in all threads, and total bytes and allocations
+/// counted as the instrumentation counters of the calling thread (see
+/// Thread safety below).  Bytes are those actually reserved by malloc.
+/// These are also shown by InstrPrint, as memlive, mempeak, memtotal and
+/// allocs.  (All are 0 if instrumentation is off, INSTR_LEVEL 0.)
+void ImageMemory(ImageMemStats* stats) ;
+
+/// Thread safety
+///
+/// The library is reentrant: all functions may be called concurrently from
+/// several threads, provided that no image is modified (or destroyed) in one
+/// thread while another thread uses it.  Any number of threads may read the
+/// same image at the same time (e.g. crop, rotate, locate in or save it).
+///
+/// The error cause and errno are per-thread.  The instrumentation counters
+/// (InstrCount) are shared: the thread that called ImageInit adds to them
+/// directly, and other threads add to them atomically (and more slowly), so
+/// the totals are exact unless the ImageInit thread runs operations at the
+/// same time as others.  InstrReset and InstrPrint are not thread-safe.
+/// Threads that bind a context count into it instead.
+
+/// Parallel operations
+///
+/// Stats, Histogram, Negative, Threshold, Brighten, Equalize, Stretch,
+/// Rotate, Mirror, Crop and Blur split the image in bands of rows, which
+/// are processed by a pool of ImageThreads() threads (the caller included),
+/// started on first use.  Images of less than about 64K pixels are
+/// processed serially, in the calling thread.  The results, and the
+/// instrumentation counts, are the same as in serial processing, and are
+/// added to the caller's counters.  (Stats may stop early, though, so the
+/// number of pixels it reads varies.)
+
+/// Library contexts
+///
+/// A context holds the error cause and instrumentation counters for the
+/// calls made while it is bound to a thread.  Contexts are optional: they
+/// let callers keep that state explicitly, for instance one context per
+/// worker thread to count without contention, or one per request to
+/// measure it.  A context may be bound to at most one thread at a time.
+
+/// Type ImageContext is a pointer to context objects
+typedef struct imageContext *ImageContext;
+
+/// Create a new context, with no error cause and all counters at zero.
+/// On success, a new context is returned.
+/// (The caller is responsible for destroying the returned context!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageContext ImageContextCreate(void) ;
+
+/// Destroy the context pointed to by (*ctxp), which must not be bound.
+/// If (*ctxp)==NULL, no operation is performed.
+/// Ensures: (*ctxp)==NULL.
+void ImageContextDestroy(ImageContext* ctxp) ;
+
+/// Bind ctx to the calling thread, or unbind the current one if ctx==NULL.
+/// Until unbound, ImageErrMsg and the counting of the calls made by this
+/// thread use ctx.  Returns the context previously bound (or NULL).
+ImageContext ImageContextBind(ImageContext ctx) ;
+
+/// Error cause of the last failure while ctx was bound (NULL if none).
+char* ImageContextErrMsg(ImageContext ctx) ;
+
+/// Instrumentation counters of ctx: an array of NUMCOUNTERS counters,
+/// indexed as InstrCount (see instrumentation.h).
+/// The counters may be read and reset directly by the caller, but only
+/// while ctx is not bound to another thread.
+unsigned long* ImageContextCounters(ImageContext ctx) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -51,6 +166,10 @@ void ImageInit(void) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new black image with the given pixel layout.
+/// As ImageCreate, which creates images with LAYOUT_RASTER.
+Image ImageCreateLayout(int width, int height, uint8 maxval, ImageLayout layout) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -67,12 +186,68 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file into an image with the given pixel layout.
+/// As ImageLoad, which loads images with LAYOUT_RASTER.
+Image ImageLoadLayout(const char* filename, ImageLayout layout) ;
+
 /// Save image to PGM file.
+/// An image remembers the regular file it was last loaded from or saved
+/// to, and which rows it modified since.  Saving it to that same file, if
+/// the file was not changed meanwhile, only rewrites the modified rows.
+/// Otherwise, the image is written to a temporary file in the same
+/// directory, which then replaces filename (keeping its permissions).
+/// If filename is a symbolic link, the file it points to is replaced.
+/// Files that are not regular (such as /dev/stdout) are written in place.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// a regular file is left unchanged (or with only some rows updated).
 int ImageSave(Image img, const char* filename) ;
 
+/// Stream operations
+/// These read and write the same format as ImageLoad and ImageSave, from
+/// and to an open stream, such as one made by fmemopen or open_memstream.
+/// The stream is left open, positioned after the image data.
+
+/// Read a raw PGM image from stream f, into an image with the given layout.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRead(FILE* f, ImageLayout layout) ;
+
+/// Write image in raw PGM format to stream f.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) ;
+
+/// Incremental and atomic saving
+/// These are the steps of ImageSave, for modules that do their own file
+/// I/O (such as imageAsync).
+
+/// Rewrite the rows of img modified since it was loaded from or saved to
+/// filename, if that is still the same file, unchanged.
+/// Returns nonzero if the file is now up to date, or 0 if it must be
+/// written whole (which is not a failure: errno is preserved).
+int ImageSaveModified(Image img, const char* filename) ;
+
+/// Record that the open file fd holds the pixels of img, in raster order,
+/// starting at byte offset (as just after loading img from it), so that
+/// ImageSaveModified may update it.  Preserves errno.
+void ImageSetFile(Image img, int fd, long offset) ;
+
+/// Open a file to write the new contents of file filename to: a new
+/// temporary file in the same directory as the file filename names (after
+/// following symbolic links), with its permissions; or that file itself,
+/// if it exists and is not a regular file.
+/// The file to replace is stored in target, and the temporary file in tmp
+/// (empty when writing in place); both have size bytes.
+/// Returns the open descriptor, or -1 with errno set.
+int ImageReplaceBegin(const char* filename, char* target, char* tmp, size_t size) ;
+
+/// End writing the file opened by ImageReplaceBegin, after closing it:
+/// if ok, replace target with tmp; otherwise, remove tmp.
+/// Returns nonzero on success, or 0 with errno set (preserved if !ok).
+int ImageReplaceEnd(const char* target, const char* tmp, int ok) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -86,6 +261,14 @@ int ImageHeight(Image img) ;
 /// Get image maximum gray level
 int ImageMaxval(Image img) ;
 
+/// Get image pixel layout
+ImageLayout ImageGetLayout(Image img) ;
+
+/// Get the generation of img: the number of modifications of its pixels.
+/// It changes whenever the pixels may have changed, so a result computed
+/// from an image remains valid while its generation stays the same.
+uint64 ImageGeneration(Image img) ;
+
 /// Pixel stats
 /// Find the minimum and maximum gray levels in image.
 /// On return,
@@ -93,6 +276,40 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Gray level histogram
+/// On return, hist[v] is the number of pixels with level v, for v in [0,255].
+void ImageHistogram(Image img, uint64 hist[256]) ;
+
+/// The results of ImageStats and ImageHistogram are cached in the image, so
+/// calling them again on an unmodified image takes constant time.  Point
+/// operations and ImageSetPixel update the cached statistics, other
+/// modifications discard them, and Rotate, Mirror and CopyLayout pass them
+/// on to their results.
+
+/// Histogram statistics
+
+/// These functions compute statistics from a histogram, without going
+/// through the image again.
+
+/// Number of pixels in histogram hist.
+uint64 ImageHistCount(const uint64 hist[256]) ;
+
+/// Mean and variance of the gray levels in histogram hist.
+/// For an empty histogram, both are set to 0.
+void ImageHistMoments(const uint64 hist[256], double* mean, double* variance) ;
+
+/// Percentile p of the gray levels in histogram hist, for p in [0.0, 1.0]:
+/// the lowest level v such that a fraction of at least p pixels are <= v.
+/// So p=0.0 gives the minimum level, p=0.5 the median and p=1.0 the maximum.
+/// Returns 0 for an empty histogram.
+uint8 ImageHistPercentile(const uint64 hist[256], double p) ;
+
+/// Otsu threshold of histogram hist.
+/// Returns the level thr that best separates the pixels into two classes,
+/// [0, thr-1] and [thr, 255], maximizing the between-class variance.
+/// The result is suitable for ImageThreshold.
+uint8 ImageHistOtsu(const uint64 hist[256]) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -112,6 +329,55 @@ uint8 ImageGetPixel(Image img, int x, int y) ;
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Row & span access operations
+
+/// These give direct access to runs of pixels, for operations that
+/// process whole rows at memory speed.  Pixels accessed through the
+/// returned pointers are not counted by the instrumentation.
+
+/// Get the address of pixel (x,y).
+/// If len != NULL, *len is set to the number of pixels from (x,y) on that
+/// are contiguous in memory, up to the end of row y: the whole rest of the
+/// row in the raster layout, up to the end of the 64x64 tile otherwise.
+/// The address stays valid until the image is destroyed.
+/// The whole image counts as modified (its cached statistics are dropped,
+/// and ImageSave rewrites all rows).  Pixels written through the address
+/// after some other call on img (which may have saved it, or computed its
+/// statistics) must be reported with ImageRowsModified.
+uint8* ImageRowPtr(Image img, int x, int y, int* len) ;
+
+/// Record that rows [y0, y1) of img were written through an address given
+/// by ImageRowPtr.
+/// Requires: 0 <= y0 <= y1 <= height.
+void ImageRowsModified(Image img, int y0, int y1) ;
+
+/// Same as ImageRowPtr, for read-only access.
+const uint8* ImageConstRowPtr(Image img, int x, int y, int* len) ;
+
+/// Get the distance in memory between pixels (x,y) and (x,y+1).
+/// This is the image width in the raster layout, and applies to any pair
+/// of rows.  In the tiled layout, it only applies to rows in the same tile
+/// (y>>6 == (y+1)>>6).
+int ImageStride(Image img) ;
+
+/// Copy the n pixels of row y starting at column x to buf.
+/// Requires: (x,y,n,1) is a valid rectangle in img.
+void ImageGetRow(Image img, int x, int y, int n, uint8* buf) ;
+
+/// Copy n pixels from buf to row y, starting at column x.
+/// Requires: (x,y,n,1) is a valid rectangle in img.
+void ImageSetRow(Image img, int x, int y, int n, const uint8* buf) ;
+
+/// Copy the rectangle (x,y,w,h) of img to buf.
+/// Row j of the rectangle is stored at buf + j*stride.
+/// Requires: (x,y,w,h) is a valid rectangle in img, stride >= w.
+void ImageGetRect(Image img, int x, int y, int w, int h, uint8* buf, int stride) ;
+
+/// Copy buf to the rectangle (x,y,w,h) of img.
+/// Row j of the rectangle is read from buf + j*stride.
+/// Requires: (x,y,w,h) is a valid rectangle in img, stride >= w.
+void ImageSetRect(Image img, int x, int y, int w, int h, const uint8* buf, int stride) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -135,6 +401,17 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Histogram equalization.
+/// Remap gray levels so that their cumulative distribution becomes
+/// approximately linear in [0, maxval].
+void ImageEqualize(Image img) ;
+
+/// Contrast stretch.
+/// Linearly map the gray levels between percentiles low and high (see
+/// ImageHistPercentile) to [0, maxval], saturating levels outside them.
+/// Requires: 0.0 <= low <= high <= 1.0.
+void ImageStretch(Image img, double low, double high) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -147,7 +424,7 @@ void ImageBrighten(Image img, double factor) ;
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
-/// The rotation is 90 degrees clockwise.
+/// The rotation is 90 degrees counterclockwise.
 /// Ensures: The original img is not modified.
 /// 
 /// On success, a new image is returned.
@@ -178,6 +455,76 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Copy an image into a new image with the given pixel layout.
+/// Ensures: The original img is not modified.
+Image ImageCopyLayout(Image img, ImageLayout layout) ;
+
+/// Downsample an image by 2 in both directions.
+/// Each pixel of the result is the rounded mean of a 2x2 block of img.
+/// The result has width (w+1)/2 and height (h+1)/2: for odd dimensions,
+/// the last column/row is averaged with itself.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageDownsample2x(Image img) ;
+
+/// Build an image pyramid.
+/// Sets levels[0] = img (not copied) and each following level to
+/// ImageDownsample2x of the previous one, computing each level only once.
+/// Stops before the width or height of a level would drop below minSize,
+/// or when maxLevels levels are built.
+/// Requires: minSize >= 1, maxLevels >= 1.
+/// On success, returns the number of levels (at least 1).
+/// (The caller is responsible for destroying levels[1..n-1], for instance
+/// with ImagePyramidDestroy!)
+/// On failure, returns 0, destroys the levels already built, and
+/// errno/errCause are set accordingly.
+int ImagePyramid(Image img, int minSize, Image levels[], int maxLevels) ;
+
+/// Destroy levels[1..n-1] of a pyramid built by ImagePyramid.
+/// levels[0] (the original image) is not destroyed.
+void ImagePyramidDestroy(Image levels[], int n) ;
+
+/// Interpolation modes for ImageResize.
+typedef enum {
+  RESIZE_NEAREST,   // nearest neighbor
+  RESIZE_BILINEAR,  // linear interpolation of the 2x2 nearest pixels
+  RESIZE_AREA,      // mean of the pixels covered (best for downscaling)
+} ImageResizeMode;
+
+/// Resize an image to newW x newH pixels.
+/// Pixel centers are aligned: output pixel (i,j) is sampled at source
+/// position ((i+0.5)*w/newW - 0.5, (j+0.5)*h/newH - 0.5).
+/// Uses a separable two-pass filter in fixed point.
+/// Requires: img is not empty, newW > 0, newH > 0.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int newW, int newH, ImageResizeMode mode) ;
+
+/// Affine transformation (warp) of an image.
+/// matrix = {a, b, c, d, e, f} maps each source pixel position (x, y) to
+/// output position (a*x + b*y + c, d*x + e*y + f).
+/// Each output pixel is sampled at the corresponding source position with
+/// the given mode (RESIZE_NEAREST or RESIZE_BILINEAR); output pixels that
+/// map outside img get level fill (bilinear samples at the edges blend
+/// with fill).
+/// Output pixels are computed in tiles, stepping source positions
+/// incrementally in fixed point.
+/// Requires: the matrix is invertible, outW >= 0, outH >= 0,
+/// fill <= maxval, mode is RESIZE_NEAREST or RESIZE_BILINEAR.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, const double matrix[6], int outW, int outH,
+                      uint8 fill, ImageResizeMode mode) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -194,6 +541,38 @@ void ImagePaste(Image img1, int x, int y, Image img2) ;
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// Blend modes for ImageComposite.
+/// For dst level d and layer level s (maxval M), the layer color c is:
+typedef enum {
+  BLEND_NORMAL,    // c = s
+  BLEND_MULTIPLY,  // c = d*s/M
+  BLEND_SCREEN,    // c = M - (M-d)*(M-s)/M
+  BLEND_MAX,       // c = max(d, s)
+} ImageBlendMode;
+
+/// A layer for ImageComposite.
+/// The layer is placed with its top left corner at (x, y) of the
+/// destination.  Its opacity is given by the levels of mask (mask level /
+/// mask maxval), if mask is not NULL, or by the constant alpha otherwise.
+typedef struct {
+  Image img;            // layer pixels
+  int x, y;             // position in the destination
+  double alpha;         // constant opacity, used if mask == NULL
+  Image mask;           // per-pixel opacity, same size as img, or NULL
+  ImageBlendMode mode;
+} ImageLayer;
+
+/// Composite several layers into an image, in order (layers[0] first).
+/// Each destination pixel d becomes d + opacity*(c - d), rounded and
+/// saturated, with c given by the layer blend mode.
+/// A BLEND_NORMAL layer without mask gives the same result as ImageBlend.
+/// The destination is processed in tiles, applying all layers that
+/// overlap a tile while it is in cache.
+/// This modifies dst in-place: no allocation involved.
+/// Requires: every layer must fit inside dst at its position, and its
+/// mask (if any) must have the same size as the layer.
+void ImageComposite(Image dst, const ImageLayer* layers, int count) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -213,4 +592,282 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Border policies for filters.
+/// These define how pixels outside the image are treated.
+typedef enum {
+  BORDER_CLAMP,   // use the nearest pixel on the image edge
+  BORDER_MIRROR,  // reflect about the edge pixel: -1 -> 1, -2 -> 2, ...
+  BORDER_SKIP,    // ignore them and renormalize by the weights used (as ImageBlur)
+} ImageBorder;
+
+/// Convolution with integer kernels.
+/// Kernels have odd dimensions and are centered on the pixel.
+/// Each pixel is substituted by the weighted sum of its neighbors,
+/// divided by 2^shift (with rounding), and saturated to [0, maxval].
+/// Computation uses 16-bit fixed-point arithmetic (SIMD where available).
+/// Requires: kernel weights in [-32767, 32767], and the sum of their
+/// absolute values at most 65535 (per dimension, for separable kernels).
+/// The image is changed in-place.
+/// Scratch memory is needed, so these may fail:
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set, and img is unchanged.
+
+/// Separable convolution: kx (nx weights) along rows, then ky (ny weights)
+/// along columns.  Equivalent to a 2D kernel k[j][i] = ky[j]*kx[i].
+int ImageConvolveSeparable(Image img, const int* kx, int nx, const int* ky, int ny,
+                           int shift, ImageBorder border) ;
+
+/// General 2D convolution with a kw x kh kernel k, in raster order.
+int ImageConvolve(Image img, const int* k, int kw, int kh, int shift,
+                  ImageBorder border) ;
+
+/// Largest sigma accepted by ImageGaussianBlur
+#define GAUSS_MAX_SIGMA 1000.0
+
+/// Gaussian blur with standard deviation sigma (in pixels).
+/// Uses a separable kernel with radius ceil(3*sigma), with 15-bit weights:
+/// the larger sigma, the coarser they get.
+/// Requires: 0 < sigma <= GAUSS_MAX_SIGMA.
+/// Success and failure as in ImageConvolveSeparable.
+int ImageGaussianBlur(Image img, double sigma, ImageBorder border) ;
+
+/// Median filter over a (2dx+1)x(2dy+1) window.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image.
+/// For an even number of pixels (near the borders), the lower median is used.
+/// Uses sliding per-column histograms (Perreault & Hebert, 2007), so the
+/// cost per pixel does not depend on dx, dy.
+/// Requires: dx >= 0, dy >= 0, (2dx+1)*(2dy+1) <= 65535.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (allocating histograms), returns 0, errno/errCause are set,
+/// and img is unchanged.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Morphology
+
+/// Grayscale morphology with a (2dx+1)x(2dy+1) rectangular structuring
+/// element, as in ImageBlur: only the pixels of the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that lie inside the image are considered.
+/// Uses the van Herk/Gil-Werman algorithm, so the cost per pixel does not
+/// depend on dx, dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (allocating buffers), returns 0, errno/errCause are set,
+/// and img is unchanged.
+
+/// Erosion: each pixel is substituted by the minimum of the rectangle.
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Dilation: each pixel is substituted by the maximum of the rectangle.
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Opening: erosion followed by dilation.
+/// Removes bright details smaller than the rectangle.
+/// On failure, img may be left eroded.
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Closing: dilation followed by erosion.
+/// Fills dark details smaller than the rectangle.
+/// On failure, img may be left dilated.
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Connected components
+
+/// A region (connected component) found by ImageLabel.
+typedef struct {
+  int x, y, w, h;   // bounding box
+  uint64 area;      // number of pixels
+  double cx, cy;    // centroid
+} ImageRegion;
+
+/// Label the connected regions of nonzero pixels in img.
+/// Pixels are connected to their 4 horizontal/vertical neighbors, or to
+/// their 8 neighbors (including diagonals), according to connectivity.
+/// Regions are numbered 1, 2, ... in raster order of their first pixel.
+/// Works on runs of nonzero pixels, with a union-find of provisional labels.
+/// If nthreads > 1, large images are split in up to nthreads horizontal
+/// strips, which are labelled concurrently and then merged.
+/// Requires: connectivity is 4 or 8, nthreads >= 1.
+///
+/// On success, returns the number of regions n, and
+///   if labels != NULL, sets *labels to a new array with the label of each
+///   pixel in raster order (labels[y*width + x], 0 for zero pixels);
+///   if regions != NULL, sets *regions to a new array of n regions
+///   (region i has label i+1), or NULL if n == 0.
+/// (The caller is responsible for freeing both arrays with free!)
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLabel(Image img, int connectivity, int nthreads,
+               uint32_t** labels, ImageRegion** regions) ;
+
+/// Image comparison
+
+/// Compare two images.
+/// Returns 1 (true) if img1 and img2 have the same size, maxval and pixel
+/// levels, whatever their layouts, and 0 otherwise.
+/// Stops at the first difference.
+int ImageEqual(Image img1, Image img2) ;
+
+/// 64-bit hash of an image.
+/// The hash covers the size, maxval and pixel levels, but not the layout:
+/// equal images (see ImageEqual) have equal hashes.
+/// It is fast but not cryptographic: it detects accidental differences
+/// (such as duplicate tiles or changed outputs), not deliberate ones.
+uint64 ImageHash(Image img) ;
+
+/// Find where two images of the same size differ.
+/// Pixels differ if their levels differ (maxval is not compared).
+/// Requires: img1 and img2 have the same width and height.
+///
+/// On success, returns the number n of changed regions (the 8-connected
+/// regions of pixels that differ), and
+///   sets *count to the number of pixels that differ, and *maxdiff to the
+///   maximum absolute difference of their levels (0 if none);
+///   if regions != NULL, sets *regions to a new array of n regions, as
+///   ImageLabel (with their bounding boxes), or NULL if n == 0.
+/// (The caller is responsible for freeing the array with free!)
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageDiff(Image img1, Image img2, uint64* count, int* maxdiff,
+              ImageRegion** regions) ;
+
+/// Bilevel images
+
+/// A packed bilevel image: each pixel is a bit (0 or 1), stored 64 to a
+/// word, so that logical operations, counting and comparisons handle 64
+/// pixels at a time.
+typedef struct bitImage* BitImage;
+
+/// Create a new bilevel image, with all pixels 0.
+/// On success, a new bilevel image is returned.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) ;
+
+/// Destroy the bilevel image pointed to by (*bp).
+/// Ensures: (*bp)==NULL.
+void BitImageDestroy(BitImage* bp) ;
+
+int BitImageWidth(BitImage b) ;
+int BitImageHeight(BitImage b) ;
+
+/// Get the pixel (0 or 1) at position (x,y).
+int BitImageGetPixel(BitImage b, int x, int y) ;
+
+/// Set the pixel at position (x,y) to v (0 or 1).
+void BitImageSetPixel(BitImage b, int x, int y, int v) ;
+
+/// Convert an image to a bilevel image.
+/// Pixels with level >= thr become 1, the others 0 (as in ImageThreshold,
+/// where they become white and black).
+/// Success and failure are treated as in BitImageCreate.
+BitImage BitImageFromImage(Image img, uint8 thr) ;
+
+/// Convert a bilevel image to a new image with the given maxval.
+/// Pixels 1 become maxval (white), pixels 0 become 0 (black).
+/// Success and failure are treated as in ImageCreate.
+Image BitImageToImage(BitImage b, uint8 maxval) ;
+
+/// Bitwise operations between bilevel images of the same size.
+/// They modify dst in-place: dst = dst AND src, dst OR src, dst XOR src.
+/// Requires: dst and src have the same width and height.
+void BitImageAnd(BitImage dst, BitImage src) ;
+void BitImageOr(BitImage dst, BitImage src) ;
+void BitImageXor(BitImage dst, BitImage src) ;
+
+/// Invert all pixels of b in-place.
+void BitImageNot(BitImage b) ;
+
+/// Number of pixels 1 in b.
+uint64 BitImageArea(BitImage b) ;
+
+/// Projections of b: the number of pixels 1 in each row and column.
+/// Sets rows[y] for each row y, if rows != NULL, and cols[x] for each
+/// column x, if cols != NULL.
+/// Requires: rows has height elements and cols has width elements.
+void BitImageProjections(BitImage b, uint32_t* rows, uint32_t* cols) ;
+
+/// Geometric transformations of bilevel images, with the same results as
+/// ImageRotate, ImageMirror and ImageCrop on the corresponding images.
+/// Success and failure are treated as in BitImageCreate.
+
+/// Rotate b 90 degrees counterclockwise.
+BitImage BitImageRotate(BitImage b) ;
+
+/// Mirror b left-right.
+BitImage BitImageMirror(BitImage b) ;
+
+/// Crop the rectangle at (x,y) with width w and height h from b.
+/// Requires: the rectangle must be inside b.
+BitImage BitImageCrop(BitImage b, int x, int y, int w, int h) ;
+
+/// Compare a bilevel image to a subimage of a larger one.
+/// Returns 1 (true) if b2 matches the subimage of b1 at pos (x, y).
+/// Returns 0, otherwise.
+int BitImageMatchSubImage(BitImage b1, int x, int y, BitImage b2) ;
+
+/// Locate a bilevel subimage inside another, as ImageLocateSubImage.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocateSubImage(BitImage b1, int* px, int* py, BitImage b2) ;
+
+/// Run-length encoded images
+
+/// An image stored as runs of pixels with equal levels in each row.
+/// Mostly flat images (masks, overlays, scanned pages) take much less
+/// memory than as an Image, and the operations below work on the runs
+/// directly, so that their cost depends on the number of runs, not on
+/// width*height.
+typedef struct rleImage* RLEImage;
+
+/// Convert an image to run-length encoding.
+/// On success, a new RLE image is returned.
+/// (The caller is responsible for destroying the returned RLE image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+RLEImage RLEImageFromImage(Image img) ;
+
+/// Convert an RLE image to a new image.
+/// Success and failure are treated as in ImageCreate.
+Image RLEImageToImage(RLEImage r) ;
+
+/// Destroy the RLE image pointed to by (*rp).
+/// Ensures: (*rp)==NULL.
+void RLEImageDestroy(RLEImage* rp) ;
+
+int RLEImageWidth(RLEImage r) ;
+int RLEImageHeight(RLEImage r) ;
+int RLEImageMaxval(RLEImage r) ;
+
+/// Number of runs in r.
+/// Each run takes 8 bytes, plus 4 bytes per row.
+int RLEImageRuns(RLEImage r) ;
+
+/// Pixel stats of an RLE image, as ImageStats.
+/// (Both are 0 if r has no pixels.)
+void RLEImageStats(RLEImage r, uint8* min, uint8* max) ;
+
+/// Point operations on RLE images, with the same results as ImageNegative,
+/// ImageThreshold and ImageBrighten.  They modify r in-place.
+/// Runs that become equal are merged.
+void RLEImageNegative(RLEImage r) ;
+void RLEImageThreshold(RLEImage r, uint8 thr) ;
+void RLEImageBrighten(RLEImage r, double factor) ;
+
+/// Geometric transformations of RLE images, with the same results as
+/// ImageMirror and ImageCrop.
+/// Success and failure are treated as in RLEImageFromImage.
+
+/// Mirror r left-right.
+RLEImage RLEImageMirror(RLEImage r) ;
+
+/// Crop the rectangle at (x,y) with width w and height h from r.
+/// Requires: the rectangle must be inside r.
+RLEImage RLEImageCrop(RLEImage r, int x, int y, int w, int h) ;
+
+/// Paste r2 into position (x, y) of r1, as ImagePaste.
+/// This modifies r1 in-place, but, unlike ImagePaste, needs to allocate
+/// runs: on success, returns 1; on failure, returns 0, r1 is unchanged and
+/// errno/errCause are set accordingly.
+/// Requires: r2 must fit inside r1 at position (x, y).
+int RLEImagePaste(RLEImage r1, int x, int y, RLEImage r2) ;
+
 #endif
@@ -0,0 +1,332 @@
+/// imageArchive - Indexed archives of many images in a single file.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// See imageArchive.h for the interface and file format description.
+
+#include "imageArchive.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAGIC "IMG8ARCH"
+#define VERSION 1
+#define HEADERSIZE 64
+#define ENTRYSIZE 32
+
+struct imageArchive {
+  const unsigned char* data;  // the mapped file
+  size_t size;
+  int count;
+  const unsigned char* index;
+  const char* names;
+  size_t namesSize;
+};
+
+// Decoding and encoding of little-endian integers.
+
+static uint32_t get32(const unsigned char* p) {
+  return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64 get64(const unsigned char* p) {
+  return get32(p) | (uint64)get32(p + 4) << 32;
+}
+
+static void put32(unsigned char* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = (unsigned char)(v >> 8*i);
+}
+
+static void put64(unsigned char* p, uint64 v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+ImageArchive ArchiveOpen(const char* filename) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return NULL;
+  struct stat st;
+  void* data = MAP_FAILED;
+  ImageArchive a = NULL;
+  if (fstat(fd, &st) == 0) {
+    if (st.st_size < HEADERSIZE) errno = EINVAL;
+    else data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  int errsave = errno;
+  close(fd);
+  errno = errsave;
+  if (data == MAP_FAILED) return NULL;
+
+  const unsigned char* h = data;
+  size_t size = st.st_size;
+  uint64 count = get32(h + 12), index = get64(h + 16);
+  uint64 names = get64(h + 24), namesSize = get64(h + 32);
+  if (memcmp(h, MAGIC, 8) != 0 || get32(h + 8) != VERSION ||
+      index > size || count > (size - index) / ENTRYSIZE ||
+      names > size || namesSize > size - names) {
+    errno = EINVAL;
+  } else if ((a = malloc(sizeof *a)) != NULL) {
+    a->data = data;
+    a->size = size;
+    a->count = (int)count;
+    a->index = h + index;
+    a->names = (const char*)h + names;
+    a->namesSize = namesSize;
+    return a;
+  }
+  errsave = errno;
+  munmap(data, size);
+  errno = errsave;
+  return NULL;
+}
+
+void ArchiveClose(ImageArchive* ap) {
+  assert (ap != NULL);
+  if (*ap == NULL) return;
+  munmap((void*)(*ap)->data, (*ap)->size);
+  free(*ap);
+  *ap = NULL;
+}
+
+int ArchiveCount(ImageArchive a) {
+  assert (a != NULL);
+  return a->count;
+}
+
+// Decode and check entry index of a, and set *pixels to its pixels.
+static int entry(ImageArchive a, int index, ArchiveMember* m, const unsigned char** pixels) {
+  const unsigned char* e = a->index + (size_t)index*ENTRYSIZE;
+  uint64 offset = get64(e);
+  uint64 w = get32(e + 8), h = get32(e + 12), name = get32(e + 16), maxval = get32(e + 20);
+  if (w > 0x7FFFFFFF || h > 0x7FFFFFFF || maxval < 1 || maxval > 255 ||
+      offset > a->size || w*h > a->size - offset ||
+      name >= a->namesSize || memchr(a->names + name, '\0', a->namesSize - name) == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+  m->name = a->names + name;
+  m->width = (int)w;
+  m->height = (int)h;
+  m->maxval = (int)maxval;
+  *pixels = a->data + offset;
+  return 1;
+}
+
+int ArchiveGet(ImageArchive a, int index, ArchiveMember* m) {
+  assert (a != NULL);
+  assert (0 <= index && index < a->count);
+  const unsigned char* pixels;
+  return entry(a, index, m, &pixels);
+}
+
+int ArchiveFind(ImageArchive a, const char* name) {
+  assert (a != NULL);
+  assert (name != NULL);
+  int lo = 0, hi = a->count;  // the member is in [lo, hi), if anywhere
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    ArchiveMember m;
+    const unsigned char* pixels;
+    if (!entry(a, mid, &m, &pixels)) return -1;
+    int c = strcmp(name, m.name);
+    if (c == 0) return mid;
+    if (c < 0) hi = mid;
+    else lo = mid + 1;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+Image ImageLoadFromArchive(ImageArchive a, const char* name) {
+  int index = ArchiveFind(a, name);
+  return index < 0 ? NULL : ImageLoadFromArchiveIndex(a, index);
+}
+
+Image ImageLoadFromArchiveIndex(ImageArchive a, int index) {
+  assert (a != NULL);
+  assert (0 <= index && index < a->count);
+  ArchiveMember m;
+  const unsigned char* pixels;
+  if (!entry(a, index, &m, &pixels)) return NULL;
+  Image img = ImageCreate(m.width, m.height, (uint8)m.maxval);
+  if (img == NULL) return NULL;
+  ImageSetRect(img, 0, 0, m.width, m.height, pixels, m.width);
+  return img;
+}
+
+
+// A member being written
+typedef struct {
+  uint64 offset;
+  int width, height, maxval;
+  size_t name;       // offset in names
+  const char* key;   // the name, while sorting
+} Entry;
+
+struct archiveWriter {
+  char* path;        // the archive file
+  char* tmp;         // the file being written
+  FILE* f;
+  uint64 offset;     // where the next member goes
+  Entry* entry;
+  int count, capacity;
+  char* names;
+  size_t namesSize, namesCapacity;
+  int failed;
+};
+
+ArchiveWriter ArchiveCreate(const char* filename) {
+  static unsigned serial = 0;
+  ArchiveWriter w = calloc(1, sizeof *w);
+  if (w == NULL) return NULL;
+  size_t len = strlen(filename) + 64;
+  unsigned char header[HEADERSIZE] = { 0 };  // written by ArchiveFinish
+  if ((w->path = strdup(filename)) != NULL && (w->tmp = malloc(len)) != NULL) {
+    snprintf(w->tmp, len, "%s.tmp-%ld-%u", filename, (long)getpid(),
+             __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+    w->f = fopen(w->tmp, "wb");
+  }
+  if (w->f == NULL || fwrite(header, HEADERSIZE, 1, w->f) != 1) {
+    ArchiveCancel(w);
+    return NULL;
+  }
+  w->offset = HEADERSIZE;
+  return w;
+}
+
+int ArchiveAdd(ArchiveWriter w, const char* name, Image img) {
+  assert (w != NULL);
+  assert (name != NULL);
+  assert (img != NULL);
+  if (w->failed) {
+    errno = EINVAL;
+    return 0;
+  }
+  w->failed = 1;  // until done
+  size_t len = strlen(name) + 1;
+  if (w->namesSize + len > UINT32_MAX) {  // name offsets have 32 bits
+    errno = EFBIG;
+    return 0;
+  }
+  if (w->count == w->capacity) {
+    int capacity = w->capacity > 0 ? 2*w->capacity : 256;
+    Entry* e = realloc(w->entry, capacity*sizeof(Entry));
+    if (e == NULL) return 0;
+    w->entry = e;
+    w->capacity = capacity;
+  }
+  if (w->namesSize + len > w->namesCapacity) {
+    size_t capacity = w->namesCapacity > 0 ? 2*w->namesCapacity : 4096;
+    while (capacity < w->namesSize + len) capacity *= 2;
+    char* names = realloc(w->names, capacity);
+    if (names == NULL) return 0;
+    w->names = names;
+    w->namesCapacity = capacity;
+  }
+  // Pad to the alignment, then write the rows
+  int width = ImageWidth(img), height = ImageHeight(img);
+  static const unsigned char zero[ARCHIVE_ALIGN];
+  size_t pad = (ARCHIVE_ALIGN - w->offset % ARCHIVE_ALIGN) % ARCHIVE_ALIGN;
+  uint8* row = malloc((size_t)width + 1);
+  if (row == NULL || fwrite(zero, 1, pad, w->f) != pad) {
+    free(row);
+    return 0;
+  }
+  w->offset += pad;
+  for (int y = 0; y < height; y++) {
+    ImageGetRow(img, 0, y, width, row);
+    if (fwrite(row, 1, width, w->f) != (size_t)width) {
+      free(row);
+      return 0;
+    }
+  }
+  free(row);
+  Entry* e = &w->entry[w->count++];
+  e->offset = w->offset;
+  e->width = width;
+  e->height = height;
+  e->maxval = ImageMaxval(img);
+  e->name = w->namesSize;
+  memcpy(w->names + w->namesSize, name, len);
+  w->namesSize += len;
+  w->offset += (uint64)width*height;
+  w->failed = 0;
+  return 1;
+}
+
+static int byName(const void* a, const void* b) {
+  return strcmp(((const Entry*)a)->key, ((const Entry*)b)->key);
+}
+
+int ArchiveFinish(ArchiveWriter w) {
+  assert (w != NULL);
+  if (w->failed) {
+    ArchiveCancel(w);
+    errno = EINVAL;
+    return 0;
+  }
+  for (int i = 0; i < w->count; i++) w->entry[i].key = w->names + w->entry[i].name;
+  qsort(w->entry, w->count, sizeof(Entry), byName);
+  for (int i = 1; i < w->count; i++) {
+    if (strcmp(w->entry[i-1].key, w->entry[i].key) == 0) {
+      ArchiveCancel(w);
+      errno = EEXIST;
+      return 0;
+    }
+  }
+  static const unsigned char zero[8];
+  size_t pad = (8 - w->offset % 8) % 8;
+  uint64 index = w->offset + pad;
+  uint64 names = index + (uint64)w->count*ENTRYSIZE;
+  unsigned char header[HEADERSIZE] = { 0 };
+  memcpy(header, MAGIC, 8);
+  put32(header + 8, VERSION);
+  put32(header + 12, w->count);
+  put64(header + 16, index);
+  put64(header + 24, names);
+  put64(header + 32, w->namesSize);
+  int ok = fwrite(zero, 1, pad, w->f) == pad;
+  for (int i = 0; i < w->count && ok; i++) {
+    unsigned char e[ENTRYSIZE] = { 0 };
+    put64(e, w->entry[i].offset);
+    put32(e + 8, w->entry[i].width);
+    put32(e + 12, w->entry[i].height);
+    put32(e + 16, (uint32_t)w->entry[i].name);
+    put32(e + 20, w->entry[i].maxval);
+    ok = fwrite(e, ENTRYSIZE, 1, w->f) == 1;
+  }
+  ok = ok && fwrite(w->names, 1, w->namesSize, w->f) == w->namesSize &&
+       fseek(w->f, 0, SEEK_SET) == 0 && fwrite(header, HEADERSIZE, 1, w->f) == 1;
+  ok = fclose(w->f) == 0 && ok;
+  w->f = NULL;
+  if (!ok || rename(w->tmp, w->path) != 0) {
+    ArchiveCancel(w);
+    return 0;
+  }
+  free(w->names);
+  free(w->entry);
+  free(w->tmp);
+  free(w->path);
+  free(w);
+  return 1;
+}
+
+void ArchiveCancel(ArchiveWriter w) {
+  assert (w != NULL);
+  int errsave = errno;
+  if (w->f != NULL) fclose(w->f);
+  if (w->tmp != NULL) unlink(w->tmp);
+  free(w->names);
+  free(w->entry);
+  free(w->tmp);
+  free(w->path);
+  free(w);
+  errno = errsave;
+}
@@ -0,0 +1,95 @@
+/// imageArchive - Indexed archives of many images in a single file.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// An archive holds any number of named 8-bit images, and is meant for
+/// large collections of small images (such as tiles), where opening,
+/// parsing and closing a PGM file per image, and the file system metadata,
+/// would cost more than the pixels themselves.
+///
+/// Format (all integers little-endian):
+///   header   64 bytes: magic "IMG8ARCH", version (32 bits), number of
+///            members (32), offset of the index (64), offset and size of
+///            the names (64 each), zero padding;
+///   pixels   of each member, in raster order, starting at a multiple of
+///            ARCHIVE_ALIGN bytes;
+///   index    32 bytes per member, sorted by name: offset of its pixels
+///            (64), width (32), height (32), offset of its name in the
+///            names (32), maxval (32), zero (64);
+///   names    the member names, each terminated by a NUL.
+///
+/// Archives are read through a memory mapping, so loading a member only
+/// costs a lookup and a copy of its pixels.  Open archives are read-only,
+/// and may be used by several threads at once.  Archives are written to a
+/// temporary file, which replaces the archive file when it is complete.
+///
+/// Failing functions set errno (EINVAL for malformed archives, ENOENT for
+/// missing members, EEXIST for repeated names); loading a member may also
+/// fail as ImageCreate.
+
+#ifndef IMAGEARCHIVE_H
+#define IMAGEARCHIVE_H
+
+#include "image8bit.h"
+
+/// Alignment of the pixels of each member, in bytes
+#define ARCHIVE_ALIGN 64
+
+/// An archive open for reading
+typedef struct imageArchive* ImageArchive;
+
+/// An archive being written
+typedef struct archiveWriter* ArchiveWriter;
+
+/// Information on a member of an archive
+typedef struct {
+  const char* name;   // valid while the archive is open
+  int width, height, maxval;
+} ArchiveMember;
+
+/// Open the archive in file filename.
+/// Returns the archive, or NULL with errno set.
+ImageArchive ArchiveOpen(const char* filename) ;
+
+/// Close the archive pointed to by (*ap), if any.
+/// Ensures: (*ap)==NULL.
+void ArchiveClose(ImageArchive* ap) ;
+
+/// Number of members of archive a.
+int ArchiveCount(ImageArchive a) ;
+
+/// Get information on member index (0 <= index < ArchiveCount(a)).
+/// Members are numbered in the order of their names (as by strcmp).
+/// Returns nonzero on success, or 0 with errno set.
+int ArchiveGet(ImageArchive a, int index, ArchiveMember* m) ;
+
+/// Index of the member with the given name.
+/// Returns the index, or -1 with errno set.
+int ArchiveFind(ImageArchive a, const char* name) ;
+
+/// Load the member with the given name into a new image.
+/// (The caller is responsible for destroying the returned image!)
+/// Returns the image, or NULL with errno (and errCause) set.
+Image ImageLoadFromArchive(ImageArchive a, const char* name) ;
+
+/// Load member index into a new image, as ImageLoadFromArchive.
+Image ImageLoadFromArchiveIndex(ImageArchive a, int index) ;
+
+/// Start writing an archive to file filename.
+/// Returns the writer, or NULL with errno set.
+ArchiveWriter ArchiveCreate(const char* filename) ;
+
+/// Add img to the archive being written, as member name.
+/// Returns nonzero on success, or 0 with errno set.  After a failure, the
+/// archive can only be cancelled.
+int ArchiveAdd(ArchiveWriter w, const char* name, Image img) ;
+
+/// Complete the archive and replace its file with it, and free w.
+/// Returns nonzero on success, or 0 with errno set (and the file unchanged).
+int ArchiveFinish(ArchiveWriter w) ;
+
+/// Discard the archive being written (leaving its file unchanged), and free w.
+/// Preserves errno.
+void ArchiveCancel(ArchiveWriter w) ;
+
+#endif
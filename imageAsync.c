@@ -0,0 +1,619 @@
+/// imageAsync - Asynchronous read-ahead and write-behind of image files.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// See imageAsync.h for the interface description.
+
+#include "imageAsync.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Maximum number of buffers, and number of I/O threads in the fallback
+#define MAXBUFS 16
+#define NTHREADS 2
+
+// Largest single transfer (io_uring takes 32-bit lengths)
+#define CHUNK ((size_t)1 << 30)
+
+typedef enum { FREE, BUSY, DONE, FAILED } SlotState;
+
+// A buffer holding a whole file, and its transfer.
+typedef struct slot {
+  SlotState state;
+  int write;           // write-behind (1) or read-ahead (0)
+  int discard;         // read-ahead no longer wanted: free when it ends
+  int seq;             // read-ahead: position in the names list
+  const char* name;    // read-ahead: from the names list; write: a copy
+  char* target;        // write: the file to replace (see ImageReplaceBegin)
+  char* tmp;           // write: the temporary file replacing it
+  int fd;              // kept open by reads until released
+  char* buf;
+  size_t size, done;
+  int err;             // errno of a failed transfer
+  struct slot* next;   // next in the thread queue
+} Slot;
+
+static enum { SYNC, URING, THREADS } method = SYNC;
+
+static Slot slots[MAXBUFS];
+static int nslots;
+
+// Files to read ahead, and the next one to start
+static char** names;
+static int nnames;
+static int nextName;
+
+// errno of the first failed write since AsyncSync
+static int writeErr;
+
+// Slot states are protected by lock, and done is signalled on every
+// transfer end.  With io_uring, transfers only end in ringReap, called
+// from the pipeline thread.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work;   // queue not empty, or stop
+  pthread_cond_t done;   // some transfer ended
+  Slot* head;
+  Slot* tail;
+  int stop;
+  pthread_t thread[NTHREADS];
+  int nthreads;
+} pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+// Complete the transfer of s, which ended with error err (0 for success):
+// a write closes its file, and replaces the target with it if all went
+// well.  Returns err, or the errno of a failure to complete.
+static int commit(Slot* s, int err) {
+  if (!s->write) return err;
+  if (close(s->fd) < 0 && err == 0) err = errno;
+  s->fd = -1;
+  if (!ImageReplaceEnd(s->target, s->tmp, err == 0) && err == 0) err = errno;
+  return err;
+}
+
+// End the transfer of s with error err (0 for success), after commit.
+static void finish(Slot* s, int err) {
+  s->err = err;
+  s->state = err ? FAILED : DONE;
+}
+
+
+/// io_uring
+
+#ifdef HAVE_IO_URING
+
+static struct {
+  int fd;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* sqMap;
+  void* cqMap;
+  size_t sqSize, cqSize, sqesSize;
+} ring = { .fd = -1 };
+
+// Check that the ring supports the read and write operations (Linux 5.6).
+static int ringProbe(int fd) {
+  size_t size = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, size);
+  if (probe == NULL) return 0;
+  int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+           probe->last_op >= IORING_OP_WRITE &&
+           (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+           (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+static void ringTeardown(void) {
+  if (ring.sqes != NULL && ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqesSize);
+  if (ring.cqMap != NULL && ring.cqMap != MAP_FAILED && ring.cqMap != ring.sqMap)
+    munmap(ring.cqMap, ring.cqSize);
+  if (ring.sqMap != NULL && ring.sqMap != MAP_FAILED) munmap(ring.sqMap, ring.sqSize);
+  if (ring.fd >= 0) close(ring.fd);
+  memset(&ring, 0, sizeof ring);
+  ring.fd = -1;
+}
+
+// Create a ring with room for entries transfers.  Returns nonzero on success.
+static int ringSetup(unsigned entries) {
+  struct io_uring_params prm;
+  memset(&prm, 0, sizeof prm);
+  ring.fd = syscall(__NR_io_uring_setup, entries, &prm);
+  if (ring.fd < 0 || !ringProbe(ring.fd)) {
+    ringTeardown();
+    return 0;
+  }
+  ring.sqSize = prm.sq_off.array + prm.sq_entries*sizeof(unsigned);
+  ring.cqSize = prm.cq_off.cqes + prm.cq_entries*sizeof(struct io_uring_cqe);
+  ring.sqesSize = prm.sq_entries*sizeof(struct io_uring_sqe);
+  int single = (prm.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring.cqSize > ring.sqSize) ring.sqSize = ring.cqSize;
+
+  ring.sqMap = mmap(NULL, ring.sqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    ring.fd, IORING_OFF_SQ_RING);
+  ring.cqMap = single ? ring.sqMap :
+               mmap(NULL, ring.cqSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    ring.fd, IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, ring.sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   ring.fd, IORING_OFF_SQES);
+  if (ring.sqMap == MAP_FAILED || ring.cqMap == MAP_FAILED || ring.sqes == MAP_FAILED) {
+    ringTeardown();
+    return 0;
+  }
+  char* sq = ring.sqMap;
+  char* cq = ring.cqMap;
+  ring.sqHead = (unsigned*)(sq + prm.sq_off.head);
+  ring.sqTail = (unsigned*)(sq + prm.sq_off.tail);
+  ring.sqMask = (unsigned*)(sq + prm.sq_off.ring_mask);
+  ring.sqArray = (unsigned*)(sq + prm.sq_off.array);
+  ring.cqHead = (unsigned*)(cq + prm.cq_off.head);
+  ring.cqTail = (unsigned*)(cq + prm.cq_off.tail);
+  ring.cqMask = (unsigned*)(cq + prm.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*)(cq + prm.cq_off.cqes);
+  return 1;
+}
+
+// Submit the rest of the transfer of s.  Returns nonzero on success.
+static int ringSubmit(Slot* s) {
+  unsigned tail = *ring.sqTail;
+  unsigned i = tail & *ring.sqMask;
+  struct io_uring_sqe* e = &ring.sqes[i];
+  size_t n = s->size - s->done;
+  memset(e, 0, sizeof *e);
+  e->opcode = s->write ? IORING_OP_WRITE : IORING_OP_READ;
+  e->fd = s->fd;
+  e->addr = (uintptr_t)(s->buf + s->done);
+  e->len = (unsigned)(n < CHUNK ? n : CHUNK);
+  e->off = s->done;
+  e->user_data = (uintptr_t)s;
+  ring.sqArray[i] = i;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+  for (;;) {
+    if (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) == 1) return 1;
+    if (errno != EINTR && errno != EAGAIN) break;
+  }
+  // Not consumed by the kernel: take the entry back
+  __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Process completed transfers, waiting for at least one if wait is nonzero.
+static void ringReap(int wait) {
+  if (wait) {
+    syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  }
+  unsigned head = *ring.cqHead;
+  unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe* c = &ring.cqes[head & *ring.cqMask];
+    Slot* s = (Slot*)(uintptr_t)c->user_data;
+    int res = c->res;
+    if (res > 0) s->done += (size_t)res;
+    if (res == -EINTR || res == -EAGAIN || (res > 0 && s->done < s->size)) {
+      if (ringSubmit(s)) continue;
+      res = -errno;
+    }
+    finish(s, commit(s, res < 0 ? -res : res == 0 && s->done < s->size ? EIO : 0));
+  }
+  __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+#endif
+
+
+/// I/O threads
+
+// Transfer the whole buffer of s.  Returns 0 or an errno value.
+static int transfer(Slot* s) {
+  while (s->done < s->size) {
+    size_t n = s->size - s->done;
+    ssize_t r = s->write ? pwrite(s->fd, s->buf + s->done, n, (off_t)s->done)
+                         : pread(s->fd, s->buf + s->done, n, (off_t)s->done);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) return errno;
+    if (r == 0) return EIO;  // file shrank while reading
+    s->done += (size_t)r;
+  }
+  return 0;
+}
+
+static void* ioThread(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.head == NULL && !pool.stop)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    if (pool.head == NULL) break;
+    Slot* s = pool.head;
+    pool.head = s->next;
+    if (pool.head == NULL) pool.tail = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    int err = commit(s, transfer(s));  // outside the lock
+    pthread_mutex_lock(&pool.lock);
+    finish(s, err);
+    pthread_cond_broadcast(&pool.done);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+
+/// Slots
+
+// Start the transfer of s (fd, buf and size set).
+static void submit(Slot* s) {
+  s->done = 0;
+  s->discard = 0;
+  s->state = BUSY;
+#ifdef HAVE_IO_URING
+  if (method == URING) {
+    if (!ringSubmit(s)) finish(s, commit(s, errno));
+    return;
+  }
+#endif
+  pthread_mutex_lock(&pool.lock);
+  s->next = NULL;
+  if (pool.tail != NULL) pool.tail->next = s; else pool.head = s;
+  pool.tail = s;
+  pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// State of s, which may be changing in an I/O thread.
+static SlotState stateOf(Slot* s) {
+  pthread_mutex_lock(&pool.lock);
+  SlotState state = s->state;
+  pthread_mutex_unlock(&pool.lock);
+  return state;
+}
+
+// Wait until the transfer of s ends.
+static void waitFor(Slot* s) {
+#ifdef HAVE_IO_URING
+  if (method == URING) {
+    while (s->state == BUSY) ringReap(1);
+    return;
+  }
+#endif
+  pthread_mutex_lock(&pool.lock);
+  while (s->state == BUSY)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Free the buffer of s, which is not busy.
+static void release(Slot* s) {
+  if (s->fd >= 0) close(s->fd);
+  free(s->buf);
+  if (s->write) {
+    free((char*)s->name);
+    free(s->target);
+    free(s->tmp);
+  }
+  s->fd = -1;
+  s->buf = NULL;
+  s->name = NULL;
+  s->target = NULL;
+  s->tmp = NULL;
+  s->state = FREE;
+}
+
+// Release the slots of ended writes and discarded reads, noting write
+// failures.  Returns a free slot, or NULL if there is none.
+static Slot* collect(void) {
+  Slot* avail = NULL;
+#ifdef HAVE_IO_URING
+  if (method == URING) ringReap(0);
+#endif
+  pthread_mutex_lock(&pool.lock);
+  for (int i = 0; i < nslots; i++) {
+    Slot* s = &slots[i];
+    if ((s->state == DONE || s->state == FAILED) && (s->write || s->discard)) {
+      if (s->write && s->state == FAILED && writeErr == 0) writeErr = s->err;
+      release(s);
+    }
+    if (s->state == FREE && avail == NULL) avail = s;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return avail;
+}
+
+// Drop the read-ahead s: free it now, or when its transfer ends.
+static void drop(Slot* s) {
+  pthread_mutex_lock(&pool.lock);
+  if (s->state == BUSY) s->discard = 1; else release(s);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Is s a read-ahead in use (not dropped)?
+static int reading(Slot* s) {
+  return !s->write && !s->discard && stateOf(s) != FREE;
+}
+
+// Is s a write to file name, pending or not yet collected?
+static int writing(Slot* s, const char* name) {
+  return s->write && stateOf(s) != FREE && strcmp(s->name, name) == 0;
+}
+
+// Wait for the pending writes to file name.
+static void waitWrites(const char* name) {
+  for (int i = 0; i < nslots; i++) {
+    if (writing(&slots[i], name)) waitFor(&slots[i]);
+  }
+}
+
+// Start reading file name into slot s.  Returns nonzero on success.
+static int startRead(Slot* s, const char* name) {
+  struct stat st;
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+      (s->buf = malloc((size_t)st.st_size)) == NULL) {
+    close(fd);
+    return 0;
+  }
+  s->write = 0;
+  s->name = name;
+  s->fd = fd;
+  s->size = (size_t)st.st_size;
+  submit(s);
+  return 1;
+}
+
+// Start read-ahead of the next files, leaving at least one buffer for
+// writing, and stopping at a file with pending writes.
+// Preserves errno: failures here are not reported.
+static void fill(void) {
+  int errsave = errno;
+  int reads = 0;
+  for (int i = 0; i < nslots; i++) {
+    if (!slots[i].write && stateOf(&slots[i]) != FREE) reads++;
+  }
+  while (nextName < nnames && reads < nslots - 1) {
+    const char* name = names[nextName];
+    int busy = 0;
+    for (int i = 0; i < nslots; i++) {
+      busy |= writing(&slots[i], name);
+    }
+    Slot* s = busy ? NULL : collect();
+    if (s == NULL) break;
+    nextName++;
+    if (!startRead(s, name)) continue;
+    s->seq = nextName - 1;
+    reads++;
+  }
+  errno = errsave;
+}
+
+
+/// Interface
+
+int AsyncStart(int nbufs, int uring) { ///
+  assert (method == SYNC);
+  assert (nbufs >= 2);
+  nslots = nbufs < MAXBUFS ? nbufs : MAXBUFS;
+  for (int i = 0; i < nslots; i++) slots[i].fd = -1;
+#ifdef HAVE_IO_URING
+  int errsave = errno;
+  if (uring && ringSetup((unsigned)nslots)) {
+    method = URING;
+    return 1;
+  }
+  errno = errsave;  // not an error: threads are used instead
+#else
+  (void)uring;
+#endif
+  pool.stop = 0;
+  for (pool.nthreads = 0; pool.nthreads < NTHREADS; pool.nthreads++) {
+    if (pthread_create(&pool.thread[pool.nthreads], NULL, ioThread, NULL) != 0) break;
+  }
+  if (pool.nthreads == 0) return 0;
+  method = THREADS;
+  return 1;
+}
+
+const char* AsyncMethod(void) { ///
+  return method == URING ? "io_uring" : method == THREADS ? "threads" : "sync";
+}
+
+void AsyncReadAhead(int count, char* list[]) { ///
+  assert (count >= 0);
+  if (method == SYNC) return;
+  char** copy = malloc((count > 0 ? count : 1)*sizeof(char*));
+  if (copy == NULL) return;  // no read-ahead, then
+  memcpy(copy, list, count*sizeof(char*));
+  for (int i = 0; i < nslots; i++) {
+    if (reading(&slots[i])) drop(&slots[i]);
+  }
+  free(names);
+  names = copy;
+  nnames = count;
+  nextName = 0;
+  fill();
+}
+
+Image AsyncLoad(const char* filename) { ///
+  assert (filename != NULL);
+  if (method == SYNC) return ImageLoad(filename);
+  int errsave = errno;  // restored on success
+  waitWrites(filename);
+
+  // The first read-ahead of this file, or else its next position in the list
+  Slot* s = NULL;
+  for (int i = 0; i < nslots; i++) {
+    if (reading(&slots[i]) && strcmp(slots[i].name, filename) == 0 &&
+        (s == NULL || slots[i].seq < s->seq)) s = &slots[i];
+  }
+  int seq = nnames;
+  if (s != NULL) {
+    seq = s->seq;
+  } else {
+    for (int i = nextName; i < nnames; i++) {
+      if (strcmp(names[i], filename) == 0) {
+        seq = i;
+        nextName = i + 1;
+        break;
+      }
+    }
+  }
+  // Files listed before it will not be loaded now
+  if (seq < nnames) {
+    for (int i = 0; i < nslots; i++) {
+      if (reading(&slots[i]) && slots[i].seq < seq) drop(&slots[i]);
+    }
+  }
+
+  Image img = NULL;
+  FILE* f = NULL;
+  if (s != NULL) {
+    waitFor(s);
+    if (s->state == DONE && (f = fmemopen(s->buf, s->size, "rb")) != NULL) {
+      img = ImageRead(f, LAYOUT_RASTER);
+      if (img != NULL) {
+        // Later saves to the file may update only the modified rows
+        ImageSetFile(img, s->fd, ftell(f) - (long)ImageWidth(img)*ImageHeight(img));
+        errno = errsave;
+      }
+      int err = errno;
+      fclose(f);
+      errno = err;
+    }
+    drop(s);
+  }
+  if (f == NULL) {  // not read ahead, or failed
+    errno = errsave;
+    img = ImageLoad(filename);
+  }
+  fill();
+  return img;
+}
+
+int AsyncSave(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  if (method == SYNC) return ImageSave(img, filename);
+  int errsave = errno;  // restored on success
+
+  // Data read ahead from this file is now stale
+  for (int i = 0; i < nslots; i++) {
+    if (reading(&slots[i]) && strcmp(slots[i].name, filename) == 0) drop(&slots[i]);
+  }
+  waitWrites(filename);  // keep writes to the same file in order
+
+  // Rewriting only the modified rows is quick, and is done right away
+  if (ImageSaveModified(img, filename)) return 1;
+
+  // Any failure up to the submission falls back to ImageSave, which
+  // reports it properly.
+  char* buf = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&buf, &size);
+  if (f == NULL) return ImageSave(img, filename);
+  int ok = ImageWrite(img, f);
+  if (fclose(f) != 0 || !ok) {
+    free(buf);
+    return ImageSave(img, filename);
+  }
+  // The data goes to a temporary file, which replaces the file when the
+  // write ends.  Files that are not regular (maybe pipes, where pwrite
+  // fails) are written by ImageSave.
+  char target[4096], tmp[4096];
+  int fd = ImageReplaceBegin(filename, target, tmp, sizeof tmp);
+  char* name = strdup(filename);
+  char* targetCopy = strdup(target);
+  char* tmpCopy = strdup(tmp);
+  if (fd < 0 || tmp[0] == '\0' || name == NULL || targetCopy == NULL || tmpCopy == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      ImageReplaceEnd(target, tmp, 0);
+    }
+    free(name);
+    free(targetCopy);
+    free(tmpCopy);
+    free(buf);
+    errno = errsave;
+    return ImageSave(img, filename);
+  }
+
+  // Wait for a free buffer.  Read-ahead never takes them all, so some
+  // write is still busy while there is none.
+  Slot* s;
+  while ((s = collect()) == NULL) {
+    for (int i = 0; i < nslots; i++) {
+      if (slots[i].write && stateOf(&slots[i]) == BUSY) {
+        waitFor(&slots[i]);
+        break;
+      }
+    }
+  }
+  s->write = 1;
+  s->name = name;
+  s->target = targetCopy;
+  s->tmp = tmpCopy;
+  s->fd = fd;
+  s->buf = buf;
+  s->size = size;
+  submit(s);  // a failure to submit is reported by AsyncSync
+  errno = errsave;
+  return 1;
+}
+
+int AsyncSync(void) { ///
+  for (int i = 0; i < nslots; i++) {
+    if (slots[i].write) waitFor(&slots[i]);
+  }
+  collect();
+  int err = writeErr;
+  writeErr = 0;
+  if (err != 0) errno = err;
+  return err == 0;
+}
+
+void AsyncStop(void) { ///
+  if (method == SYNC) return;
+  int errsave = errno;
+  for (int i = 0; i < nslots; i++) {
+    waitFor(&slots[i]);
+    if (slots[i].state != FREE) release(&slots[i]);
+  }
+#ifdef HAVE_IO_URING
+  if (method == URING) ringTeardown();
+#endif
+  if (method == THREADS) {
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.nthreads; i++) pthread_join(pool.thread[i], NULL);
+    pool.nthreads = 0;
+  }
+  free(names);
+  names = NULL;
+  nnames = nextName = 0;
+  writeErr = 0;
+  method = SYNC;
+  errno = errsave;
+}
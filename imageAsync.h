@@ -0,0 +1,66 @@
+/// imageAsync - Asynchronous read-ahead and write-behind of image files.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// While a pipeline processes one image, the files it will load next are
+/// read into memory in the background, and saved images are written out
+/// in the background too.  Transfers use io_uring when the kernel supports
+/// it, or a small pool of I/O threads otherwise.
+///
+/// At most nbufs file images are held in memory at a time (read-ahead and
+/// write-behind together): read-ahead stops when the buffers run out, and
+/// a save waits for an earlier write to finish.
+///
+/// Until AsyncStart succeeds, AsyncLoad and AsyncSave simply call ImageLoad
+/// and ImageSave, so they may be used unconditionally.  The functions are
+/// not thread-safe: after AsyncStart, they must all be called from the
+/// same thread.
+///
+/// Files are matched by name: a file must be named the same way when it is
+/// saved and loaded for a later load to see the saved data.
+
+#ifndef IMAGEASYNC_H
+#define IMAGEASYNC_H
+
+#include "image8bit.h"
+
+/// Start asynchronous I/O with nbufs in-memory buffers.
+/// If uring is nonzero, io_uring is tried first.
+/// Returns nonzero on success, 0 if neither io_uring nor threads are
+/// available (I/O then stays synchronous).
+int AsyncStart(int nbufs, int uring) ;
+
+/// Name of the transfer method in use: "io_uring", "threads" or "sync".
+const char* AsyncMethod(void) ;
+
+/// Declare the files that may be loaded next, in the order they will be
+/// loaded, and start reading the first ones.
+/// Names that cannot be opened, or are not loaded after all, only cost
+/// a failed open or a wasted read.  The array is copied, the names are not.
+void AsyncReadAhead(int count, char* names[]) ;
+
+/// Load a raw PGM file, as ImageLoad.
+/// Uses the data read ahead, if available, after waiting for pending
+/// writes to the same file.  As with ImageLoad, saving the image back to
+/// the file later may only rewrite its modified rows.
+Image AsyncLoad(const char* filename) ;
+
+/// Save image to PGM file, as ImageSave, without waiting for the data to
+/// be written.  When only some rows must be rewritten, that is done at
+/// once.  Otherwise, the image is written to a temporary file, which
+/// replaces the file when the write ends (the image then forgets the file:
+/// it may be destroyed before that).  Failures to open the file are
+/// reported at once; failures while writing are reported by AsyncSync,
+/// and leave the file unchanged.
+int AsyncSave(Image img, const char* filename) ;
+
+/// Wait for all pending writes.
+/// Returns nonzero if all writes since the last AsyncSync succeeded;
+/// otherwise returns 0 with errno set by the first failure.
+int AsyncSync(void) ;
+
+/// Wait for all pending transfers and release all resources.
+/// I/O becomes synchronous again.
+void AsyncStop(void) ;
+
+#endif
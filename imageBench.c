@@ -0,0 +1,156 @@
+// imageBench - Benchmark image operations on the raster and tiled layouts.
+//
+// This program is part of the image8bit programming project,
+// for the course AED, DETI / UA.PT
+//
+// Usage: imageBench [SIZE [FILE]]
+// Runs each operation on a SIZE x SIZE synthetic image (default 16384)
+// stored in each pixel layout, and prints the CPU time taken in each.
+// If FILE is given, it is used to time ImageSave and ImageLoad too.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* layoutName[] = { "raster", "tiled" };
+
+// Parameters of the benchmark, shared by the operations below
+static int size;
+static const char* file;
+static Image small;     // image to paste and blend
+static Image tall;      // tall template to locate (not present in the image)
+
+// Each operation works on img, in place or returning a new image
+// (which is destroyed right away).  Returns 0 on failure.
+typedef int (*Op)(Image img);
+
+#define NEWIMAGE(expr) { Image r = (expr); if (r == NULL) return 0; ImageDestroy(&r); return 1; }
+
+static int opSave(Image img) { return ImageSave(img, file); }
+static int opLoad(Image img) { NEWIMAGE(ImageLoadLayout(file, ImageGetLayout(img))) }
+static int opStats(Image img) { uint8 lo, hi; ImageStats(img, &lo, &hi); return 1; }
+static int opHistogram(Image img) { uint64 hist[256]; ImageHistogram(img, hist); return 1; }
+static int opLocate(Image img) { int x, y; ImageLocateSubImage(img, &x, &y, tall); return 1; }
+static int opRotate(Image img) { NEWIMAGE(ImageRotate(img)) }
+static int opMirror(Image img) { NEWIMAGE(ImageMirror(img)) }
+static int opCrop(Image img) { NEWIMAGE(ImageCrop(img, size/4, size/4, size/2, size/2)) }
+static int opHalf(Image img) { NEWIMAGE(ImageDownsample2x(img)) }
+static int opResize(Image img) { NEWIMAGE(ImageResize(img, size*3/4, size*3/4, RESIZE_BILINEAR)) }
+static int opRotdeg(Image img) {
+  const double m[6] = { 0.866, 0.5, 0.0, -0.5, 0.866, size/2.0 };
+  NEWIMAGE(ImageWarpAffine(img, m, size, size, 0, RESIZE_BILINEAR))
+}
+static int opNegative(Image img) { ImageNegative(img); return 1; }
+static int opBrighten(Image img) { ImageBrighten(img, 0.9); return 1; }
+static int opEqualize(Image img) { ImageEqualize(img); return 1; }
+static int opPaste(Image img) { ImagePaste(img, 3, 5, small); return 1; }
+static int opBlend(Image img) { ImageBlend(img, 5, 3, small, 0.3); return 1; }
+static int opGauss(Image img) { return ImageGaussianBlur(img, 2.0, BORDER_CLAMP); }
+static int opMedian(Image img) { return ImageMedian(img, 1, 1); }
+static int opBlur(Image img) { ImageBlur(img, 1, 1); return 1; }
+static int opThreshold(Image img) { ImageThreshold(img, 128); return 1; }
+
+// Read-only operations first, then in-place ones.
+static const struct { const char* name; Op op; } ops[] = {
+  { "save", opSave },  // skipped if no FILE
+  { "load", opLoad },
+  { "stats", opStats },
+  { "histogram", opHistogram },
+  { "locate", opLocate },
+  { "rotate", opRotate },
+  { "mirror", opMirror },
+  { "crop", opCrop },
+  { "half", opHalf },
+  { "resize", opResize },
+  { "rotdeg", opRotdeg },
+  { "neg", opNegative },
+  { "bri", opBrighten },
+  { "equalize", opEqualize },
+  { "paste", opPaste },
+  { "blend", opBlend },
+  { "gauss", opGauss },
+  { "median", opMedian },
+  { "blur", opBlur },
+  { "thr", opThreshold },
+};
+#define NOPS (int)(sizeof ops / sizeof ops[0])
+
+// Fill img with a gradient plus noise (deterministic).
+static void fill(Image img) {
+  uint8 row[ImageWidth(img)];
+  uint32_t seed = 12345;
+  for (int y = 0; y < ImageHeight(img); y++) {
+    for (int x = 0; x < ImageWidth(img); x++) {
+      seed = seed*1103515245 + 12345;
+      row[x] = (uint8)(((x + y) >> 6) + (seed >> 26));
+    }
+    ImageSetRow(img, 0, y, ImageWidth(img), row);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 3) {
+    error(1, 0, "Usage: imageBench [SIZE [FILE]]");
+  }
+  size = argc > 1 ? atoi(argv[1]) : 16384;
+  file = argc > 2 ? argv[2] : NULL;
+  if (size < 16) {
+    error(1, 0, "SIZE must be at least 16");
+  }
+
+  ImageInit();
+  Image base = ImageCreate(size, size, 255);
+  if (base == NULL) {
+    error(2, errno, "Creating image: %s", ImageErrMsg());
+  }
+  fill(base);
+  small = ImageCrop(base, size/8, size/8, size/2, size/2);
+  tall = ImageCreate(4, size/8, 255);  // all black: never matches
+  if (small == NULL || tall == NULL) {
+    error(2, errno, "Creating image: %s", ImageErrMsg());
+  }
+
+  double t[NOPS][2];
+  double extra[NOPS] = { 0.0 };  // peak memory above that before the operation
+  for (int l = 0; l < 2; l++) {
+    Image img = ImageCopyLayout(base, (ImageLayout)l);
+    if (img == NULL) {
+      error(2, errno, "Copying image: %s", ImageErrMsg());
+    }
+    for (int i = 0; i < NOPS; i++) {
+      t[i][l] = -1.0;
+      if (file == NULL && (ops[i].op == opSave || ops[i].op == opLoad)) continue;
+      fprintf(stderr, "# %s %s\n", layoutName[l], ops[i].name);
+      ImageMemStats before, after;
+      InstrReset();  // peak = live
+      ImageMemory(&before);
+      double start = cpu_time();
+      if (!ops[i].op(img)) {
+        error(2, errno, "%s: %s", ops[i].name, ImageErrMsg());
+      }
+      t[i][l] = cpu_time() - start;
+      ImageMemory(&after);
+      double mb = (double)(after.peak - before.live) / (1 << 20);
+      if (mb > extra[i]) extra[i] = mb;
+    }
+    ImageDestroy(&img);
+  }
+
+  printf("# %dx%d image, CPU time in seconds, and peak extra memory in MB\n", size, size);
+  printf("%-10s %10s %10s %8s %10s\n", "operation", layoutName[0], layoutName[1], "ratio", "MB");
+  for (int i = 0; i < NOPS; i++) {
+    if (t[i][0] < 0.0) continue;
+    printf("%-10s %10.3f %10.3f %8.2f %10.1f\n", ops[i].name, t[i][0], t[i][1],
+           t[i][0] > 0.0 ? t[i][1] / t[i][0] : 0.0, extra[i]);
+  }
+
+  ImageDestroy(&tall);
+  ImageDestroy(&small);
+  ImageDestroy(&base);
+  return 0;
+}
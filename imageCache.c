@@ -0,0 +1,151 @@
+/// imageCache - Content-addressed on-disk cache of pipeline results.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// See imageCache.h for the interface description.
+
+#include "imageCache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Change this to invalidate all existing entries (e.g. when an operation
+// changes its results).
+#define VERSION "imageCache 1"
+
+// Temporary files older than this (in seconds) were left by dead processes
+#define STALE (24*60*60)
+
+static char* cacheDir;
+static uint64 maxBytes;
+
+// Path of the entry with the given key.
+static void entryPath(uint64 key, char* buf, size_t size) {
+  snprintf(buf, size, "%s/%016" PRIx64 ".pgm", cacheDir, key);
+}
+
+int CacheOpen(const char* dir, uint64 max) {
+  struct stat st;
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) return 0;
+  if (stat(dir, &st) < 0) return 0;
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return 0;
+  }
+  cacheDir = strdup(dir);
+  if (cacheDir == NULL) return 0;
+  maxBytes = max;
+  errno = 0;
+  return 1;
+}
+
+// FNV-1a of size bytes at data, continuing from h.
+static uint64 fnv(uint64 h, const void* data, size_t size) {
+  const unsigned char* p = data;
+  for (size_t i = 0; i < size; i++) h = (h ^ p[i]) * 1099511628211u;
+  return h;
+}
+
+uint64 CacheKey(int count, const uint64 keys[], const char* op) {
+  uint64 h = fnv(14695981039346656037u, VERSION, sizeof VERSION);
+  h = fnv(h, &count, sizeof count);
+  h = fnv(h, keys, count*sizeof(uint64));
+  h = fnv(h, op, strlen(op));
+  // Final avalanche (as in SplitMix64)
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9u;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBu;
+  return h ^ (h >> 31);
+}
+
+FILE* CacheGet(uint64 key) {
+  char path[4096];
+  int errsave = errno;
+  entryPath(key, path, sizeof path);
+  FILE* f = fopen(path, "rb");
+  if (f != NULL) futimens(fileno(f), NULL);  // recently used (if allowed)
+  errno = errsave;
+  return f;
+}
+
+int CacheAdd(uint64 key, Image img) {
+  static unsigned serial = 0;
+  char path[4096], tmp[4096];
+  entryPath(key, path, sizeof path);
+  if (access(path, F_OK) == 0) return 1;
+  snprintf(tmp, sizeof tmp, "%s/.tmp-%ld-%u", cacheDir, (long)getpid(), serial++);
+  if (ImageSave(img, tmp) && rename(tmp, path) == 0) return 1;
+  int errsave = errno;
+  unlink(tmp);
+  errno = errsave;
+  return 0;
+}
+
+typedef struct {
+  char name[32];
+  time_t mtime;
+  off_t size;
+} Entry;
+
+// Older first
+static int byAge(const void* a, const void* b) {
+  time_t ta = ((const Entry*)a)->mtime, tb = ((const Entry*)b)->mtime;
+  return (ta > tb) - (ta < tb);
+}
+
+// Is name that of an entry (16 hex digits and .pgm)?
+static int isEntry(const char* name) {
+  if (strlen(name) != 20 || strcmp(name + 16, ".pgm") != 0) return 0;
+  for (int i = 0; i < 16; i++) {
+    if (strchr("0123456789abcdef", name[i]) == NULL) return 0;
+  }
+  return 1;
+}
+
+void CacheClose(void) {
+  if (cacheDir == NULL) return;
+  int errsave = errno;
+  DIR* dir = opendir(cacheDir);
+  Entry* entry = NULL;
+  int count = 0, capacity = 0;
+  uint64 total = 0;
+  time_t now = time(NULL);
+  struct dirent* d;
+  while (dir != NULL && (d = readdir(dir)) != NULL) {
+    struct stat st;
+    if (fstatat(dirfd(dir), d->d_name, &st, 0) < 0) continue;  // evicted meanwhile
+    if (strncmp(d->d_name, ".tmp-", 5) == 0) {
+      if (now - st.st_mtime > STALE) unlinkat(dirfd(dir), d->d_name, 0);
+      continue;
+    }
+    if (!isEntry(d->d_name)) continue;
+    if (count == capacity) {
+      capacity = capacity > 0 ? 2*capacity : 256;
+      Entry* e = realloc(entry, capacity*sizeof(Entry));
+      if (e == NULL) break;
+      entry = e;
+    }
+    strcpy(entry[count].name, d->d_name);
+    entry[count].mtime = st.st_mtime;
+    entry[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+  if (total > maxBytes) {
+    qsort(entry, count, sizeof(Entry), byAge);
+    for (int i = 0; i < count && total > maxBytes; i++) {
+      unlinkat(dirfd(dir), entry[i].name, 0);  // may have been evicted by another process
+      total -= entry[i].size;
+    }
+  }
+  free(entry);
+  if (dir != NULL) closedir(dir);
+  free(cacheDir);
+  cacheDir = NULL;
+  errno = errsave;
+}
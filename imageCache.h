@@ -0,0 +1,51 @@
+/// imageCache - Content-addressed on-disk cache of pipeline results.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// The cache is a directory of PGM files, each named after the 64-bit key
+/// of the image it holds (16 hex digits and .pgm).  Keys are derived from
+/// the contents of the input images and the operations applied to them
+/// (see CacheKey), so entries never need to be invalidated: different
+/// inputs or operations simply give different keys.
+///
+/// Several processes may share a cache directory.  Entries are written to
+/// a temporary file and renamed into place, so they appear atomically, and
+/// an entry that was opened stays readable even if it is later replaced
+/// or evicted.
+///
+/// The size of the cache is bounded by evicting the least recently used
+/// entries, by modification time (which every hit updates), when the cache
+/// is closed.  The functions are not thread-safe.
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <stdio.h>
+#include "image8bit.h"
+
+/// Use directory dir as the cache, creating it if needed, and keep its
+/// entries within maxBytes.
+/// Returns nonzero on success, or 0 with errno set.
+int CacheOpen(const char* dir, uint64 maxBytes) ;
+
+/// Key of the result of applying operation op to count images with the
+/// given keys.  op should be canonical (see imageTool), so that the same
+/// operation is always described by the same text.
+/// (The key of an input image is its hash, see ImageHash.)
+uint64 CacheKey(int count, const uint64 keys[], const char* op) ;
+
+/// Open the entry with the given key and mark it as recently used.
+/// Returns the open file, positioned at the start of the PGM image (to be
+/// read with ImageRead and closed by the caller), or NULL if there is no
+/// such entry.  Preserves errno.
+FILE* CacheGet(uint64 key) ;
+
+/// Add img to the cache with the given key, unless it is already there.
+/// Returns nonzero on success, or 0 with errno set.
+int CacheAdd(uint64 key, Image img) ;
+
+/// Evict the least recently used entries while the cache is over its
+/// size limit, and stop using it.  Preserves errno.
+void CacheClose(void) ;
+
+#endif
@@ -0,0 +1,377 @@
+/// imageServer - Unix domain socket server and client for imageTool.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// See imageServer.h for the protocol description.
+
+#include "imageServer.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// Low level I/O
+
+// Write exactly n bytes to fd.  Returns nonzero on success.
+static int writeAll(int fd, const void* buf, size_t n) {
+  const char* p = buf;
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    p += r;
+    n -= (size_t)r;
+  }
+  return 1;
+}
+
+// Read exactly n bytes from fd.  Returns nonzero on success.
+static int readAll(int fd, void* buf, size_t n) {
+  char* p = buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    p += r;
+    n -= (size_t)r;
+  }
+  return 1;
+}
+
+static int writeU32(int fd, uint32_t v) {
+  v = htonl(v);
+  return writeAll(fd, &v, sizeof v);
+}
+
+static int readU32(int fd, uint32_t* v) {
+  if (!readAll(fd, v, sizeof *v)) return 0;
+  *v = ntohl(*v);
+  return 1;
+}
+
+static int writeFrame(int fd, char tag, const void* data, size_t n) {
+  return writeAll(fd, &tag, 1) && writeU32(fd, (uint32_t)n) &&
+         writeAll(fd, data, n);
+}
+
+// Fill a sockaddr_un for path.  Returns 0 if path is too long.
+static int socketAddr(struct sockaddr_un* addr, const char* path) {
+  memset(addr, 0, sizeof *addr);
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof addr->sun_path) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+// Remove a stale socket at path, left by an earlier server.
+// Anything else there is not touched: returns 0 with errno EADDRINUSE.
+static int removeSocket(const char* path) {
+  struct stat st;
+  if (lstat(path, &st) < 0) return errno == ENOENT;
+  if (!S_ISSOCK(st.st_mode)) {
+    errno = EADDRINUSE;
+    return 0;
+  }
+  return unlink(path) == 0 || errno == ENOENT;
+}
+
+
+/// Resident image store
+
+// A simple list of named entries, protected by a single mutex.
+// Entries are few (a handful of large images), so linear search is fine.
+typedef struct entry {
+  char* name;       // NULL after the entry is dropped
+  Image img;
+  int refs;         // number of StoreAcquire without matching StoreRelease
+  struct entry* next;
+} Entry;
+
+static Entry* store = NULL;
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Unlink and free entry e if it was dropped and is no longer referenced.
+// Must be called with storeLock held.
+static void reclaim(Entry* e) {
+  if (e->name != NULL || e->refs > 0) return;
+  Entry** pp = &store;
+  while (*pp != e) pp = &(*pp)->next;
+  *pp = e->next;
+  ImageDestroy(&e->img);
+  free(e);
+}
+
+// Find live entry by name.  Must be called with storeLock held.
+static Entry* findName(const char* name) {
+  for (Entry* e = store; e != NULL; e = e->next)
+    if (e->name != NULL && strcmp(e->name, name) == 0) return e;
+  return NULL;
+}
+
+// Drop name.  Must be called with storeLock held.
+static int dropLocked(const char* name) {
+  Entry* e = findName(name);
+  if (e == NULL) return 0;
+  free(e->name);
+  e->name = NULL;
+  reclaim(e);
+  return 1;
+}
+
+int StorePut(const char* name, Image img) { ///
+  assert (name != NULL);
+  assert (img != NULL);
+  Entry* e = malloc(sizeof *e);
+  char* s = strdup(name);
+  if (e == NULL || s == NULL) {
+    free(e);
+    free(s);
+    return 0;
+  }
+  e->name = s;
+  e->img = img;
+  e->refs = 0;
+  pthread_mutex_lock(&storeLock);
+  dropLocked(name);
+  e->next = store;
+  store = e;
+  pthread_mutex_unlock(&storeLock);
+  return 1;
+}
+
+Image StoreAcquire(const char* name) { ///
+  assert (name != NULL);
+  pthread_mutex_lock(&storeLock);
+  Entry* e = findName(name);
+  Image img = NULL;
+  if (e != NULL) {
+    e->refs++;
+    img = e->img;
+  }
+  pthread_mutex_unlock(&storeLock);
+  return img;
+}
+
+void StoreRelease(Image img) { ///
+  assert (img != NULL);
+  pthread_mutex_lock(&storeLock);
+  Entry* e = store;
+  while (e != NULL && e->img != img) e = e->next;
+  assert (e != NULL && e->refs > 0);
+  e->refs--;
+  reclaim(e);
+  pthread_mutex_unlock(&storeLock);
+}
+
+int StoreDrop(const char* name) { ///
+  assert (name != NULL);
+  pthread_mutex_lock(&storeLock);
+  int found = dropLocked(name);
+  pthread_mutex_unlock(&storeLock);
+  return found;
+}
+
+void StoreList(FILE* f) { ///
+  pthread_mutex_lock(&storeLock);
+  for (Entry* e = store; e != NULL; e = e->next)
+    if (e->name != NULL)
+      fprintf(f, "# @%s %dx%d\n", e->name,
+              ImageWidth(e->img), ImageHeight(e->img));
+  pthread_mutex_unlock(&storeLock);
+}
+
+
+/// Server
+
+// Bounded queue of accepted client connections, consumed by the workers.
+#define QUEUESIZE 64
+
+static struct {
+  int fd[QUEUESIZE];
+  int head, count;
+  pthread_mutex_t lock;
+  pthread_cond_t nonEmpty;
+  pthread_cond_t nonFull;
+  ServerHandler handler;
+} queue = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .nonEmpty = PTHREAD_COND_INITIALIZER,
+  .nonFull = PTHREAD_COND_INITIALIZER,
+};
+
+// Read a request: the client cwd and the argument vector.
+// On success, returns argc and sets *pav to a NULL-terminated array of
+// malloc'ed strings (av[0] is the cwd).  Returns -1 on failure.
+static int readRequest(int fd, char*** pav) {
+  uint32_t count;
+  if (!readU32(fd, &count) || count < 1 || count > 1u<<16) return -1;
+  char** av = calloc(count + 1, sizeof(char*));
+  if (av == NULL) return -1;
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    uint32_t len;
+    if (!readU32(fd, &len) || len > 1u<<16) break;
+    if ((av[i] = malloc(len + 1)) == NULL) break;
+    if (!readAll(fd, av[i], len)) break;
+    av[i][len] = '\0';
+  }
+  if (i < count) {
+    for (uint32_t j = 0; j <= i; j++) free(av[j]);
+    free(av);
+    return -1;
+  }
+  *pav = av;
+  return (int)count;
+}
+
+// Serve one client connection and close it.
+static void serveClient(int fd) {
+  char** av;
+  int ac = readRequest(fd, &av);
+  if (ac < 0) {
+    close(fd);
+    return;
+  }
+
+  // Capture the handler output in memory, then send it back in frames.
+  char* outBuf = NULL; size_t outLen = 0;
+  char* logBuf = NULL; size_t logLen = 0;
+  FILE* out = open_memstream(&outBuf, &outLen);
+  FILE* log = open_memstream(&logBuf, &logLen);
+  int32_t status = 5;
+  if (out != NULL && log != NULL)
+    status = queue.handler(ac - 1, av + 1, av[0], out, log);
+  if (out != NULL) fclose(out);
+  if (log != NULL) fclose(log);
+
+  uint32_t st = htonl((uint32_t)status);
+  (void)(writeFrame(fd, 'o', outBuf, outLen) &&
+         writeFrame(fd, 'e', logBuf, logLen) &&
+         writeFrame(fd, 'x', &st, sizeof st));
+  free(outBuf);
+  free(logBuf);
+  for (int i = 0; i < ac; i++) free(av[i]);
+  free(av);
+  close(fd);
+}
+
+static void* worker(void* arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == 0)
+      pthread_cond_wait(&queue.nonEmpty, &queue.lock);
+    int fd = queue.fd[queue.head];
+    queue.head = (queue.head + 1) % QUEUESIZE;
+    queue.count--;
+    pthread_cond_signal(&queue.nonFull);
+    pthread_mutex_unlock(&queue.lock);
+    serveClient(fd);
+  }
+  return NULL;
+}
+
+int ServerRun(const char* path, int nthreads, ServerHandler handler) { ///
+  assert (path != NULL);
+  assert (nthreads > 0);
+  assert (handler != NULL);
+  struct sockaddr_un addr;
+  int fd = -1;
+  queue.handler = handler;
+  signal(SIGPIPE, SIG_IGN);  // a vanishing client must not kill the server
+
+  int success =
+    socketAddr(&addr, path) &&
+    (fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+    removeSocket(path) &&
+    bind(fd, (struct sockaddr*)&addr, sizeof addr) == 0 &&
+    listen(fd, QUEUESIZE) == 0;
+  for (int i = 0; success && i < nthreads; i++) {
+    pthread_t t;
+    success = pthread_create(&t, NULL, worker, NULL) == 0 &&
+              pthread_detach(t) == 0;
+  }
+
+  while (success) {
+    int cfd = accept(fd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      break;
+    }
+    pthread_mutex_lock(&queue.lock);
+    while (queue.count == QUEUESIZE)
+      pthread_cond_wait(&queue.nonFull, &queue.lock);
+    queue.fd[(queue.head + queue.count) % QUEUESIZE] = cfd;
+    queue.count++;
+    pthread_cond_signal(&queue.nonEmpty);
+    pthread_mutex_unlock(&queue.lock);
+  }
+
+  int errsave = errno;
+  if (fd >= 0) close(fd);
+  errno = errsave;
+  return 0;
+}
+
+
+/// Client
+
+int ClientRun(const char* path, int ac, char* av[]) { ///
+  assert (path != NULL);
+  struct sockaddr_un addr;
+  char cwd[4096];
+  int fd = -1;
+
+  int success =
+    socketAddr(&addr, path) &&
+    getcwd(cwd, sizeof cwd) != NULL &&
+    (fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+    connect(fd, (struct sockaddr*)&addr, sizeof addr) == 0 &&
+    writeU32(fd, (uint32_t)ac + 1) &&
+    writeU32(fd, (uint32_t)strlen(cwd)) &&
+    writeAll(fd, cwd, strlen(cwd));
+  for (int i = 0; success && i < ac; i++) {
+    success = writeU32(fd, (uint32_t)strlen(av[i])) &&
+              writeAll(fd, av[i], strlen(av[i]));
+  }
+
+  // Copy frames to stdout/stderr until the status frame arrives.
+  int status = -1;
+  while (success) {
+    char tag;
+    uint32_t len;
+    success = readAll(fd, &tag, 1) && readU32(fd, &len);
+    if (!success) break;
+    char* data = malloc(len > 0 ? len : 1);
+    success = data != NULL && readAll(fd, data, len);
+    if (success) {
+      if (tag == 'o') fwrite(data, 1, len, stdout);
+      else if (tag == 'e') fwrite(data, 1, len, stderr);
+      else if (tag == 'x' && len == sizeof(uint32_t)) {
+        uint32_t st;
+        memcpy(&st, data, sizeof st);
+        status = (int)ntohl(st);
+      }
+    }
+    free(data);
+    if (tag == 'x') break;
+  }
+  if (success && status < 0) errno = EPROTO;
+
+  int errsave = errno;
+  if (fd >= 0) close(fd);
+  errno = errsave;
+  return success ? status : -1;
+}
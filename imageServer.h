@@ -0,0 +1,72 @@
+/// imageServer - Unix domain socket server and client for imageTool.
+///
+/// Part of the image8bit programming project, AED, DETI / UA.PT
+///
+/// The server keeps a store of named, resident images that persist between
+/// requests, and serves clients concurrently with a fixed pool of threads.
+/// Each request is a list of string arguments (an imageTool pipeline),
+/// which is passed to a handler function.  Whatever the handler writes to
+/// its out/log streams is sent back to the client, followed by the exit
+/// status.
+///
+/// Wire protocol (all integers are 32-bit, network byte order):
+///   request:  count, then count x (length, bytes)
+///             The first string is the client working directory,
+///             the remaining strings are the pipeline arguments.
+///   response: a sequence of frames (tag, length, bytes), where
+///             tag 'o' is data for stdout, 'e' is data for stderr,
+///             and tag 'x' carries the 4-byte exit status (last frame).
+
+#ifndef IMAGESERVER_H
+#define IMAGESERVER_H
+
+#include <stdio.h>
+#include "image8bit.h"
+
+/// Request handler.
+/// Runs the pipeline av[0..ac-1] with relative paths resolved against cwd,
+/// writes results to out and messages to log, and returns the exit status.
+/// Must be reentrant: it is called concurrently from pool threads.
+typedef int (*ServerHandler)(int ac, char* av[], const char* cwd,
+                             FILE* out, FILE* log);
+
+/// Run a server listening on the Unix socket at path, using nthreads
+/// worker threads to handle clients.
+/// A socket already at path is replaced; any other file there is an error
+/// (EADDRINUSE).
+/// Only returns on failure, with errno set, returning 0.
+int ServerRun(const char* path, int nthreads, ServerHandler handler) ;
+
+/// Send the pipeline av[0..ac-1] to the server listening at path,
+/// copying the response to stdout/stderr.
+/// On success, returns the exit status reported by the server.
+/// On failure, returns -1 and errno is set.
+int ClientRun(const char* path, int ac, char* av[]) ;
+
+/// Resident image store
+
+/// Images in the store are shared between requests and must be treated as
+/// read-only.  Every image obtained with StoreAcquire must be returned with
+/// StoreRelease.  All store functions are thread-safe.
+
+/// Store img under name, taking ownership of it.
+/// A previous image with the same name is dropped.
+/// Returns nonzero on success, 0 on allocation failure (img is not taken).
+int StorePut(const char* name, Image img) ;
+
+/// Get the image stored under name and add a reference to it.
+/// Returns NULL if there is no such image.
+Image StoreAcquire(const char* name) ;
+
+/// Release a reference obtained with StoreAcquire.
+/// The image is destroyed when it was dropped and has no more references.
+void StoreRelease(Image img) ;
+
+/// Remove name from the store.
+/// Returns nonzero if the name existed.
+int StoreDrop(const char* name) ;
+
+/// Write one line per resident image (name and size) to f.
+void StoreList(FILE* f) ;
+
+#endif
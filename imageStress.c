@@ -0,0 +1,629 @@
+// imageStress - Stress test of the image8bit library from many threads.
+//
+// This program is part of the image8bit programming project,
+// for the course AED, DETI / UA.PT
+//
+// Usage: imageStress [THREADS [ROUNDS]]
+// Every thread runs all library operations ROUNDS times, on its own
+// images and on an image shared by all threads, and checks each result
+// against the one computed by the main thread beforehand.  Odd threads
+// bind a library context, and use the tiled layout.
+// It is meant to be run under ThreadSanitizer (make stress), which
+// reports any data race, but it also catches wrong results on its own.
+// Before that, the main thread checks some operations against brute-force
+// references, on random images.
+
+#include <assert.h>
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// Size of the test images (odd, and not a multiple of the tile size)
+#define W 97
+#define H 81
+
+static Image shared;  // read by all threads at once
+
+// Hash of the pixels and size of img (FNV-1a), 0 for NULL.
+static uint64 hash(Image img) {
+  if (img == NULL) return 0;
+  uint64 h = 14695981039346656037u;
+  uint8 row[ImageWidth(img) + 1];
+  for (int y = 0; y < ImageHeight(img); y++) {
+    ImageGetRow(img, 0, y, ImageWidth(img), row);
+    for (int x = 0; x < ImageWidth(img); x++) h = (h ^ row[x]) * 1099511628211u;
+  }
+  return h ^ ((uint64)ImageWidth(img) << 32 | (uint64)ImageHeight(img));
+}
+
+// Hash img and destroy it.
+static uint64 done(Image img) {
+  uint64 h = hash(img);
+  ImageDestroy(&img);
+  return h;
+}
+
+// A private copy of the shared image, in the given layout.
+static Image copy(ImageLayout layout) {
+  Image img = ImageCopyLayout(shared, layout);
+  if (img == NULL) error(2, errno, "Copying image: %s", ImageErrMsg());
+  return img;
+}
+
+// Each test runs one or more operations, in the given layout, and returns
+// a hash of the results.  Tests that only read use the shared image.
+typedef uint64 (*Test)(ImageLayout layout);
+
+static uint64 tStats(ImageLayout l) {
+  (void)l;
+  uint8 min, max;
+  uint64 hist[256];
+  double mean, var;
+  ImageStats(shared, &min, &max);
+  ImageHistogram(shared, hist);
+  ImageHistMoments(hist, &mean, &var);
+  return min + 256*max + ImageHistCount(hist) + (uint64)(mean*1000) + (uint64)var +
+         ImageHistPercentile(hist, 0.3) + ImageHistOtsu(hist);
+}
+static uint64 tPoint(ImageLayout l) {
+  Image img = copy(l);
+  ImageNegative(img);
+  ImageThreshold(img, 100);
+  uint64 h = hash(img);
+  ImageDestroy(&img);
+  img = copy(l);
+  ImageBrighten(img, 1.3);
+  h ^= hash(img);
+  ImageEqualize(img);
+  h += hash(img);
+  ImageStretch(img, 0.05, 0.95);
+  return h ^ done(img);
+}
+static uint64 tGeometry(ImageLayout l) {
+  (void)l;
+  const double m[6] = { 0.8, 0.3, 5.0, -0.3, 0.8, 20.0 };
+  return done(ImageRotate(shared)) ^ done(ImageMirror(shared)) * 3 ^
+         done(ImageCrop(shared, 5, 7, 50, 40)) * 5 ^ done(ImageDownsample2x(shared)) * 7 ^
+         done(ImageResize(shared, 60, 123, RESIZE_NEAREST)) * 11 ^
+         done(ImageResize(shared, 60, 123, RESIZE_BILINEAR)) * 13 ^
+         done(ImageResize(shared, 33, 20, RESIZE_AREA)) * 17 ^
+         done(ImageWarpAffine(shared, m, 90, 70, 9, RESIZE_BILINEAR)) * 19 ^
+         done(ImageWarpAffine(shared, m, 90, 70, 9, RESIZE_NEAREST)) * 23 ^
+         done(ImageCopyLayout(shared, LAYOUT_TILED)) * 29;
+}
+static uint64 tPyramid(ImageLayout l) {
+  (void)l;
+  Image levels[8];
+  int n = ImagePyramid(shared, 4, levels, 8);
+  uint64 h = n;
+  for (int i = 0; i < n; i++) h = h*31 + hash(levels[i]);
+  ImagePyramidDestroy(levels, n);
+  return h;
+}
+static uint64 tTwoImages(ImageLayout l) {
+  Image img = copy(l);
+  Image small = ImageCrop(shared, 30, 20, 40, 30);
+  ImagePaste(img, 3, 4, small);
+  ImageBlend(img, 50, 40, small, 0.4);
+  ImageLayer layers[2] = {
+    { small, 10, 10, 0.5, NULL, BLEND_SCREEN },
+    { small, 20, 5, 0.0, small, BLEND_MULTIPLY },
+  };
+  ImageComposite(img, layers, 2);
+  int x = -1, y = -1;
+  int found = ImageLocateSubImage(shared, &x, &y, small);
+  uint64 h = hash(img) ^ (found + 2*x + 1000*y) ^ ImageMatchSubImage(shared, 30, 20, small);
+  ImageDestroy(&small);
+  return h ^ done(img);
+}
+static uint64 tFilters(ImageLayout l) {
+  static const int k[9] = { 1, 2, 1, 2, 4, 2, 1, 2, 1 };
+  static const int k1[3] = { 1, 2, 1 };
+  Image img = copy(l);
+  ImageBlur(img, 2, 1);
+  uint64 h = hash(img);
+  ImageDestroy(&img);
+  img = copy(l);
+  ImageGaussianBlur(img, 1.5, BORDER_MIRROR);
+  h ^= hash(img) * 3;
+  ImageMedian(img, 1, 2);
+  h ^= hash(img) * 5;
+  ImageConvolve(img, k, 3, 3, 4, BORDER_CLAMP);
+  h ^= hash(img) * 7;
+  ImageConvolveSeparable(img, k1, 3, k1, 3, 4, BORDER_SKIP);
+  return h ^ done(img) * 11;
+}
+static uint64 tMorphology(ImageLayout l) {
+  Image img = copy(l);
+  ImageErode(img, 2, 1);
+  ImageDilate(img, 1, 3);
+  uint64 h = hash(img);
+  ImageOpen(img, 1, 1);
+  ImageClose(img, 2, 2);
+  return h ^ done(img);
+}
+static uint64 tLabel(ImageLayout l) {
+  Image img = copy(l);
+  ImageThreshold(img, 140);
+  ImageRegion* regions;
+  uint32_t* labels;
+  int n = ImageLabel(img, 8, 2, &labels, &regions);
+  uint64 h = n;
+  for (int i = 0; i < n; i++) h = h*31 + regions[i].area + regions[i].x + regions[i].w;
+  for (int i = 0; i < W*H; i++) h = h*31 + labels[i];
+  free(labels);
+  free(regions);
+  return h ^ done(img);
+}
+static uint64 tRows(ImageLayout l) {
+  Image img = copy(l);
+  uint8 buf[20*30];
+  ImageGetRect(shared, 10, 10, 20, 30, buf, 20);
+  ImageSetRect(img, 60, 40, 20, 30, buf, 20);
+  ImageGetRow(shared, 0, 5, 50, buf);
+  ImageSetRow(img, 40, 70, 50, buf);
+  int len;
+  uint8* p = ImageRowPtr(img, 3, 3, &len);
+  for (int i = 0; i < len; i++) p[i] ^= 0x55;
+  const uint8* q = ImageConstRowPtr(img, 3, 4, &len);
+  uint64 h = q[0] + (p[0] << 8) + (len == W-3 || len == 64-3);
+  ImageSetPixel(img, 1, 2, ImageGetPixel(img, 2, 1));
+  return h ^ done(img);
+}
+static uint64 tFiles(ImageLayout l) {
+  char name[64];
+  snprintf(name, sizeof name, "/tmp/imageStress-%d-%lx.pgm", (int)getpid(),
+           (unsigned long)pthread_self());
+  if (!ImageSave(shared, name)) error(2, errno, "Saving %s: %s", name, ImageErrMsg());
+  Image img = ImageLoadLayout(name, l);
+  if (img == NULL) error(2, errno, "Loading %s: %s", name, ImageErrMsg());
+  unlink(name);
+  uint64 h = hash(img);
+
+  char* buf = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&buf, &size);
+  if (f == NULL || !ImageWrite(img, f) || fclose(f) != 0) error(2, errno, "Writing to memory");
+  ImageDestroy(&img);
+  f = fmemopen(buf, size, "rb");
+  if (f == NULL || (img = ImageRead(f, l)) == NULL) error(2, errno, "Reading from memory");
+  fclose(f);
+  free(buf);
+  return h ^ done(img) * 3;
+}
+
+static const struct { const char* name; Test test; } tests[] = {
+  { "stats", tStats },
+  { "point", tPoint },
+  { "geometry", tGeometry },
+  { "pyramid", tPyramid },
+  { "twoimages", tTwoImages },
+  { "filters", tFilters },
+  { "morphology", tMorphology },
+  { "label", tLabel },
+  { "rows", tRows },
+  { "files", tFiles },
+};
+#define NTESTS (int)(sizeof tests / sizeof tests[0])
+
+// Reference checks, on random images
+
+static uint32_t rnd = 12345;
+
+// A pseudo-random number in [0, n).
+static int randInt(int n) {
+  rnd = rnd*1103515245 + 12345;
+  return (int)((rnd >> 8) % (unsigned)n);
+}
+
+// Lower median of the pixels in [x-dx, x+dx]x[y-dy, y+dy] of the w x h
+// raster p, by counting.
+static uint8 bruteMedian(const uint8* p, int w, int h, int x, int y, int dx, int dy) {
+  int count[256] = { 0 };
+  int n = 0;
+  for (int j = y - dy; j <= y + dy; j++) {
+    for (int i = x - dx; i <= x + dx; i++) {
+      if (0 <= i && i < w && 0 <= j && j < h) {
+        count[p[(size_t)j*w + i]]++;
+        n++;
+      }
+    }
+  }
+  int v = 0;
+  for (int seen = count[0]; seen < (n + 1) / 2; seen += count[++v]) { }
+  return (uint8)v;
+}
+
+// Compare ImageMedian with bruteMedian on count random cases.
+// Returns the number of mismatches.
+static int checkMedian(int count) {
+  int wrong = 0;
+  for (int c = 0; c < count; c++) {
+    int w = 1 + randInt(90), h = 1 + randInt(90);
+    int dx = randInt(c % 4 == 0 ? 25 : 6), dy = randInt(c % 4 == 1 ? 25 : 6);
+    int levels = 1 + randInt(256);  // few levels make many ties
+    uint8 in[w*h], out[w*h];
+    for (int i = 0; i < w*h; i++) in[i] = (uint8)randInt(levels);
+    Image img = ImageCreateLayout(w, h, 255, (ImageLayout)(c & 1));
+    if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+    ImageSetRect(img, 0, 0, w, h, in, w);
+    if (!ImageMedian(img, dx, dy)) error(2, errno, "Median: %s", ImageErrMsg());
+    ImageGetRect(img, 0, 0, w, h, out, w);
+    int bad = 0;
+    for (int y = 0; y < h && !bad; y++) {
+      for (int x = 0; x < w && !bad; x++) {
+        bad = out[y*w + x] != bruteMedian(in, w, h, x, y, dx, dy);
+      }
+    }
+    if (bad) {
+      fprintf(stderr, "median: wrong result for %dx%d, dx=%d, dy=%d\n", w, h, dx, dy);
+      wrong++;
+    }
+    ImageDestroy(&img);
+  }
+  return wrong;
+}
+
+// Abort on allocation failure of the image (or other object) p.
+static void* needed(void* p, const char* what) {
+  if (p == NULL) error(2, errno, "%s: %s", what, ImageErrMsg());
+  return p;
+}
+
+// A random bilevel image: the w x h raster ref gets its pixels, and img,
+// if not NULL, gets the random image they are thresholded from.
+static BitImage randBits(int w, int h, uint8* ref, Image* img) {
+  int levels = 1 + randInt(256);
+  uint8 in[w*h];
+  for (int i = 0; i < w*h; i++) in[i] = (uint8)randInt(levels);
+  uint8 thr = (uint8)randInt(levels + 1);
+  for (int i = 0; i < w*h; i++) ref[i] = in[i] >= thr;
+  Image tmp = needed(ImageCreate(w, h, 255), "Creating image");
+  ImageSetRect(tmp, 0, 0, w, h, in, w);
+  BitImage b = needed(BitImageFromImage(tmp, thr), "Creating bilevel image");
+  if (img != NULL) {
+    ImageThreshold(tmp, thr);
+    *img = tmp;
+  } else {
+    ImageDestroy(&tmp);
+  }
+  return b;
+}
+
+// Does b have the pixels of the w x h raster ref?
+static int sameBits(BitImage b, const uint8* ref, int w, int h) {
+  if (BitImageWidth(b) != w || BitImageHeight(b) != h) return 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      if (BitImageGetPixel(b, x, y) != ref[y*w + x]) return 0;
+    }
+  }
+  return 1;
+}
+
+// Does b have the pixels of the thresholded image img (1 for white)?
+static int sameAsImage(BitImage b, Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  if (BitImageWidth(b) != w || BitImageHeight(b) != h) return 0;
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      if (BitImageGetPixel(b, x, y) != (ImageGetPixel(img, x, y) != 0)) return 0;
+    }
+  }
+  return 1;
+}
+
+// Does BitImageLocateSubImage find sub in b where ImageLocateSubImage
+// finds isub in img (and find it, if found)?
+static int sameLocation(BitImage b, Image img, BitImage sub, Image isub, int found) {
+  int px = -1, py = -1, qx = -1, qy = -1;
+  int r = BitImageLocateSubImage(b, &px, &py, sub);
+  return r == ImageLocateSubImage(img, &qx, &qy, isub) && px == qx && py == qy &&
+         (r || !found);
+}
+
+// Compare the BitImage operations with the Image operations, or with
+// per-pixel references, on count random cases.
+// Widths cross the 64 pixel words at random places.
+// Returns the number of mismatches.
+static int checkBitImage(int count) {
+  int wrong = 0;
+  for (int c = 0; c < count; c++) {
+    int w = c % 3 == 0 ? 64*(1 + randInt(3)) - 1 + randInt(3) : 1 + randInt(200);
+    int h = 1 + randInt(70);
+    uint8 ref[w*h], ref2[w*h], op[w*h];
+    Image img;
+    BitImage b = randBits(w, h, ref, &img);
+    BitImage b2 = randBits(w, h, ref2, NULL);
+    const char* bad = NULL;
+
+    // Conversion
+    Image back = needed(BitImageToImage(b, 255), "Converting bilevel image");
+    if (!sameBits(b, ref, w, h) || !sameAsImage(b, img) ||
+        ImageMaxval(back) != 255 || !sameAsImage(b, back)) {
+      bad = "conversion";
+    }
+    ImageDestroy(&back);
+
+    // Geometry
+    BitImage t = needed(BitImageRotate(b), "Rotating bilevel image");
+    Image u = needed(ImageRotate(img), "Rotating image");
+    if (!sameAsImage(t, u)) bad = "rotate";
+    BitImageDestroy(&t);
+    ImageDestroy(&u);
+    t = needed(BitImageMirror(b), "Mirroring bilevel image");
+    u = needed(ImageMirror(img), "Mirroring image");
+    if (!sameAsImage(t, u)) bad = "mirror";
+    BitImageDestroy(&t);
+    ImageDestroy(&u);
+    int cw = 1 + randInt(w), ch = 1 + randInt(h);
+    int cx = randInt(w - cw + 1), cy = randInt(h - ch + 1);
+    BitImage sub = needed(BitImageCrop(b, cx, cy, cw, ch), "Cropping bilevel image");
+    Image isub = needed(ImageCrop(img, cx, cy, cw, ch), "Cropping image");
+    if (!sameAsImage(sub, isub)) bad = "crop";
+
+    // Counting
+    uint32_t rows[h], cols[w];
+    BitImageProjections(b, rows, cols);
+    uint64 area = 0;
+    for (int y = 0; y < h; y++) {
+      uint32_t n = 0;
+      for (int x = 0; x < w; x++) n += ref[y*w + x];
+      if (rows[y] != n) bad = "projections";
+      area += n;
+    }
+    for (int x = 0; x < w; x++) {
+      uint32_t n = 0;
+      for (int y = 0; y < h; y++) n += ref[y*w + x];
+      if (cols[x] != n) bad = "projections";
+    }
+    if (BitImageArea(b) != area) bad = "area";
+
+    // Logical operations, on copies of b
+    for (int k = 0; k < 4; k++) {
+      t = needed(BitImageCrop(b, 0, 0, w, h), "Copying bilevel image");
+      switch (k) {
+      case 0: BitImageAnd(t, b2); break;
+      case 1: BitImageOr(t, b2); break;
+      case 2: BitImageXor(t, b2); break;
+      case 3: BitImageNot(t); break;
+      }
+      for (int i = 0; i < w*h; i++) {
+        op[i] = k == 0 ? ref[i] & ref2[i] : k == 1 ? ref[i] | ref2[i] :
+                k == 2 ? ref[i] ^ ref2[i] : !ref[i];
+      }
+      if (!sameBits(t, op, w, h)) bad = "logical operations";
+      if (k == 3 && BitImageArea(t) != (uint64)w*h - area) bad = "area after not";
+      BitImageDestroy(&t);
+    }
+
+    // Match and locate: a subimage of b, and one of b2 (usually absent)
+    int mx = randInt(w - cw + 1), my = randInt(h - ch + 1);
+    if (!BitImageMatchSubImage(b, cx, cy, sub) ||
+        BitImageMatchSubImage(b, mx, my, sub) != ImageMatchSubImage(img, mx, my, isub)) {
+      bad = "match";
+    }
+    BitImage sub2 = needed(BitImageCrop(b2, cx, cy, cw, ch), "Cropping bilevel image");
+    Image isub2 = needed(BitImageToImage(sub2, 255), "Converting bilevel image");
+    if (!sameLocation(b, img, sub, isub, 1) || !sameLocation(b, img, sub2, isub2, 0)) {
+      bad = "locate";
+    }
+    BitImageDestroy(&sub);
+    BitImageDestroy(&sub2);
+    ImageDestroy(&isub);
+    ImageDestroy(&isub2);
+
+    if (bad != NULL) {
+      fprintf(stderr, "bitimage: wrong %s for %dx%d\n", bad, w, h);
+      wrong++;
+    }
+    BitImageDestroy(&b);
+    BitImageDestroy(&b2);
+    ImageDestroy(&img);
+  }
+  return wrong;
+}
+
+// A random w x h image with the given maxval, made of runs of few levels.
+static Image randRuns(int w, int h, int maxval) {
+  int levels = 1 + randInt(maxval < 6 ? maxval + 1 : 6);
+  uint8 level[levels];
+  for (int k = 0; k < levels; k++) level[k] = (uint8)randInt(maxval + 1);
+  uint8 in[w*h];
+  for (int i = 0; i < w*h; ) {
+    uint8 v = level[randInt(levels)];
+    for (int n = 1 + randInt(12); n > 0 && i < w*h; n--) in[i++] = v;
+  }
+  Image img = needed(ImageCreate(w, h, (uint8)maxval), "Creating image");
+  ImageSetRect(img, 0, 0, w, h, in, w);
+  return img;
+}
+
+// Does r have the pixels of img, in as few runs as RLEImageFromImage makes?
+static int sameRuns(RLEImage r, Image img) {
+  Image back = needed(RLEImageToImage(r), "Converting RLE image");
+  RLEImage canon = needed(RLEImageFromImage(back), "Converting image");
+  int same = ImageEqual(back, img) && RLEImageRuns(r) == RLEImageRuns(canon);
+  RLEImageDestroy(&canon);
+  ImageDestroy(&back);
+  return same;
+}
+
+// Compare the RLEImage operations with the Image operations on count
+// random cases, and check that they leave no runs that should be merged.
+// Returns the number of mismatches.
+static int checkRLE(int count) {
+  int wrong = 0;
+  for (int c = 0; c < count; c++) {
+    int w = 1 + randInt(120), h = 1 + randInt(60);
+    int maxval = 1 + randInt(255);
+    Image img = randRuns(w, h, maxval);
+    RLEImage r = needed(RLEImageFromImage(img), "Converting image");
+    const char* bad = NULL;
+    if (!sameRuns(r, img)) bad = "conversion";
+
+    // Point operations, in random order
+    for (int k = 0; k < 4; k++) {
+      switch (randInt(3)) {
+      case 0:
+        RLEImageNegative(r);
+        ImageNegative(img);
+        if (!sameRuns(r, img)) bad = "negative";
+        break;
+      case 1: {
+        uint8 thr = (uint8)randInt(maxval + 2);
+        RLEImageThreshold(r, thr);
+        ImageThreshold(img, thr);
+        if (!sameRuns(r, img)) bad = "threshold";
+        break;
+      }
+      case 2: {
+        double factor = randInt(300) / 100.0;
+        RLEImageBrighten(r, factor);
+        ImageBrighten(img, factor);
+        if (!sameRuns(r, img)) bad = "brighten";
+        break;
+      }
+      }
+    }
+
+    // Geometry
+    RLEImage t = needed(RLEImageMirror(r), "Mirroring RLE image");
+    Image u = needed(ImageMirror(img), "Mirroring image");
+    if (!sameRuns(t, u)) bad = "mirror";
+    RLEImageDestroy(&t);
+    ImageDestroy(&u);
+    int cw = randInt(w + 1), ch = randInt(h + 1);
+    int cx = randInt(w - cw + 1), cy = randInt(h - ch + 1);
+    t = needed(RLEImageCrop(r, cx, cy, cw, ch), "Cropping RLE image");
+    u = needed(ImageCrop(img, cx, cy, cw, ch), "Cropping image");
+    if (!sameRuns(t, u)) bad = "crop";
+    RLEImageDestroy(&t);
+    ImageDestroy(&u);
+
+    // Paste a random image, or a part of this one
+    int pw = 1 + randInt(w), ph = 1 + randInt(h);
+    int px = randInt(w - pw + 1), py = randInt(h - ph + 1);
+    u = c & 1 ? randRuns(pw, ph, maxval) : needed(ImageCrop(img, 0, 0, pw, ph), "Cropping image");
+    t = needed(RLEImageFromImage(u), "Converting image");
+    if (!RLEImagePaste(r, px, py, t)) error(2, errno, "Pasting RLE image: %s", ImageErrMsg());
+    ImagePaste(img, px, py, u);
+    if (!sameRuns(r, img)) bad = "paste";
+    RLEImageDestroy(&t);
+    ImageDestroy(&u);
+
+    if (bad != NULL) {
+      fprintf(stderr, "rle: wrong %s for %dx%d\n", bad, w, h);
+      wrong++;
+    }
+    RLEImageDestroy(&r);
+    ImageDestroy(&img);
+  }
+  return wrong;
+}
+
+// Expected results, per layout
+static uint64 expected[2][NTESTS];
+
+static int rounds;
+static int failures;  // atomic
+static pthread_barrier_t start;
+
+static void* worker(void* arg) {
+  int id = (int)(intptr_t)arg;
+  ImageLayout layout = (ImageLayout)(id & 1);
+  ImageContext ctx = NULL;
+  if (id & 1) {
+    ctx = ImageContextCreate();
+    if (ctx == NULL) error(2, errno, "Creating context");
+    ImageContextBind(ctx);
+  }
+  pthread_barrier_wait(&start);
+
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < NTESTS; i++) {
+      int t = (i + id + r) % NTESTS;  // threads run different tests at once
+      if (tests[t].test(layout) != expected[layout][t]) {
+        fprintf(stderr, "thread %d: %s: wrong result\n", id, tests[t].name);
+        __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+      }
+    }
+    // Failures set the error cause of this thread only
+    errno = 0;
+    if (ImageLoad("/nonexistent/imageStress.pgm") != NULL || errno != ENOENT ||
+        strcmp(ImageErrMsg(), "Open failed") != 0) {
+      fprintf(stderr, "thread %d: wrong error state\n", id);
+      __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (ctx != NULL) {
+    if (ImageContextCounters(ctx)[0] == 0 || ImageContextErrMsg(ctx) != ImageErrMsg()) {
+      fprintf(stderr, "thread %d: wrong context state\n", id);
+      __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+    }
+    ImageContextBind(NULL);
+    ImageContextDestroy(&ctx);
+  }
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 3) {
+    error(1, 0, "Usage: imageStress [THREADS [ROUNDS]]");
+  }
+  int nthreads = argc > 1 ? atoi(argv[1]) : 8;
+  rounds = argc > 2 ? atoi(argv[2]) : 3;
+  if (nthreads < 1 || rounds < 1) {
+    error(1, 0, "THREADS and ROUNDS must be positive");
+  }
+
+  ImageInit();
+  int wrong = checkMedian(400);
+  printf("median: 400 random cases, %d wrong\n", wrong);
+  failures += wrong;
+  wrong = checkBitImage(200);
+  printf("bitimage: 200 random cases, %d wrong\n", wrong);
+  failures += wrong;
+  wrong = checkRLE(300);
+  printf("rle: 300 random cases, %d wrong\n", wrong);
+  failures += wrong;
+
+  shared = ImageCreate(W, H, 255);
+  if (shared == NULL) {
+    error(2, errno, "Creating image: %s", ImageErrMsg());
+  }
+  uint32_t seed = 777;
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) {
+      seed = seed*1103515245 + 12345;
+      ImageSetPixel(shared, x, y, (uint8)((x*y >> 4) + (seed >> 27)));
+    }
+  }
+  for (int l = 0; l < 2; l++) {
+    for (int t = 0; t < NTESTS; t++) expected[l][t] = tests[t].test((ImageLayout)l);
+  }
+
+  // From here on, the main thread only waits
+  pthread_t threads[nthreads];
+  pthread_barrier_init(&start, NULL, (unsigned)nthreads);
+  InstrReset();
+  for (int i = 0; i < nthreads; i++) {
+    int e = pthread_create(&threads[i], NULL, worker, (void*)(intptr_t)i);
+    if (e != 0) error(2, e, "Creating thread %d", i);
+  }
+  for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&start);
+
+  printf("%d threads x %d rounds x %d tests: %d failures\n",
+         nthreads, rounds, NTESTS, failures);
+  InstrPrint();  // counts of the threads without context
+  ImageDestroy(&shared);
+  return failures != 0;
+}
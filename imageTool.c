@@ -9,18 +9,26 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include "error.h"
 #include <assert.h>
 
 #include "image8bit.h"
+#include "imageArchive.h"
+#include "imageAsync.h"
+#include "imageCache.h"
+#include "imageServer.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool --serve SOCKET [THREADS]\n"
+    "       imageTool --client SOCKET [FILE...] [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -37,31 +45,110 @@ static const char* USAGE =
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  info            Show information on CURR (size, range and histogram stats)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  mem             Print memory used by images and buffers: bytes live now,\n"
+    "                  and peak, bytes and allocations since tic\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  equalize        Equalize histogram of CURR\n"
+    "  stretch LO,HI   Stretch levels between percentiles LO and HI of CURR\n"
+    "                  to the full range (e.g. stretch 0.01,0.99)\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
+    "  layout L        Copy CURR to a new image with pixel layout L:\n"
+    "                  raster (default for loaded images) or tiled\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,M]  Resize CURR to WxH pixels, creating new image, with mode\n"
+    "                  M: nearest, bilinear (default) or area\n"
+    "  rotdeg ANGLE[,F] Rotate CURR ANGLE degrees counter-clockwise about its\n"
+    "                  center, creating new image of the same size; uncovered\n"
+    "                  pixels get level F (default 0)\n"
+    "  half            Downsample CURR by 2 (2x2 mean), creating new image\n"
+    "  pyramid N FILE  Downsample CURR N times and save each level i\n"
+    "                  to FILE with -i inserted before the extension\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  composite X,Y,alpha[,MODE]\n"
+    "                  Composite all images I0, I1, ..., PRED into CURR at\n"
+    "                  position (X,Y), in that order, with given alpha and\n"
+    "                  blend MODE: normal (default), multiply, screen or max\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  blobs C[,T]     Label the connected regions of nonzero pixels of CURR,\n"
+    "                  with C=4 or 8 connectivity, using T threads (default 1),\n"
+    "                  and print their bounding box, area and centroid\n"
+    "  cmp             Compare PRED and CURR, and fail if they differ\n"
+    "  hash            Print a 64-bit hash of CURR (size, maxval and pixels)\n"
+    "  diff            Print the number of pixels that differ in PRED and CURR,\n"
+    "                  their maximum difference, and the bounding box and area\n"
+    "                  of each region where they differ\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  median DX,DY    median filter CURR over (2DX+1)x(2DY+1) window\n"
+    "  erode DX,DY     erode CURR (minimum) over (2DX+1)x(2DY+1) rectangle\n"
+    "  dilate DX,DY    dilate CURR (maximum) over (2DX+1)x(2DY+1) rectangle\n"
+    "  open DX,DY      open CURR (erode, then dilate) with (2DX+1)x(2DY+1) rectangle\n"
+    "  close DX,DY     close CURR (dilate, then erode) with (2DX+1)x(2DY+1) rectangle\n"
+    "  gauss SIGMA[,B] Gaussian blur CURR with standard deviation SIGMA (at most 1000)\n"
+    "  conv KX:KY:S[:B]\n"
+    "                  Convolve CURR with separable kernel KX (rows), KY (columns)\n"
+    "                  and divide by 2^S, e.g. conv 1,2,1:1,2,1:4\n"
+    "  conv WxH:K:S[:B]\n"
+    "                  Convolve CURR with WxH kernel K (raster order), divide by 2^S\n"
+    "\n"
+    "ARCHIVES:\n"
+    "  An archive holds many images (e.g. tiles) in a single file, indexed by\n"
+    "  name, for fast loading.\n"
+    "  member ARCH NAME Load member NAME (or #N, the N-th in name order) of\n"
+    "                  archive ARCH, creating new image\n"
+    "  members ARCH    List the members of archive ARCH\n"
+    "  unpack ARCH DIR Save all members of archive ARCH to DIR/NAME\n"
+    "  pack ARCH FILE... Pack all FILEs (the rest of the arguments) into new\n"
+    "                  archive ARCH, as members named by their file names\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  --serve listens on a Unix socket and runs the pipelines sent by\n"
+    "  --client, using a pool of THREADS workers (default 4).\n"
+    "  Relative file names are resolved in the client directory.\n"
+    "  Resident images are kept in the server between requests:\n"
+    "  @NAME           Use resident image NAME, appended to the buffer\n"
+    "  store NAME      Keep CURR resident as NAME\n"
+    "  drop NAME       Forget resident image NAME\n"
+    "  list            List resident images\n"
+    "  Resident images are never modified: operations on them work on a copy.\n"
     "\n"              
+    "ASYNCHRONOUS I/O:\n"
+    "  Outside server mode, input files are read ahead and saved files are\n"
+    "  written behind, with io_uring or I/O threads.  Set IMAGETOOL_IO=threads\n"
+    "  to not use io_uring, or IMAGETOOL_IO=sync to do all I/O in line.\n"
+    "\n"
+    "RESULT CACHE:\n"
+    "  Outside server mode, set IMAGETOOL_CACHE=DIR to keep the results of\n"
+    "  operations in directory DIR, keyed by the contents of the input images\n"
+    "  and the operations applied to them.  Operations whose results are\n"
+    "  cached are skipped, and only the results actually needed are loaded.\n"
+    "  The least recently used results are evicted to keep DIR within\n"
+    "  IMAGETOOL_CACHE_SIZE megabytes (default 1024).  DIR may be shared by\n"
+    "  concurrent runs.\n"
+    "\n"
+    "THREADS:\n"
+    "  Operations on whole images run on as many threads as processors, or\n"
+    "  IMAGE8BIT_THREADS if set (1 to run serially).\n"
+    "\n"
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  KX, KY, K       Comma-separated integer kernel weights (odd count)\n"
+    "  B               Border policy: clamp (default), mirror or skip\n"
     "\n"
     ;
 
@@ -74,6 +161,12 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Operation requires server mode",
+  "No such resident image",
+  "Writing saved files failed",
+  "Images differ",
+  "Archive failure",
+  "Invalid file name",
 };
 
 
@@ -85,78 +178,425 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Maximum number of images in the buffer
+#define NIMG 10
+
+// The state of a running pipeline.
+typedef struct {
+  Image img[NIMG];    // the image buffer
+  int shared[NIMG];   // shared[i] is true if img[i] is a resident image
+  int n;              // number of images created
+  FILE* out;          // where results are printed (stdout)
+  FILE* log;          // where progress messages are printed (stderr)
+  const char* cwd;    // directory for relative paths (NULL: current dir)
+  int server;         // true if running inside the server
+  int cache;          // true if results are cached (see cacheBefore)
+  uint64 key[NIMG];   // cache key of the contents of img[i]
+  FILE* entry[NIMG];  // cache entry holding img[i], until it is needed
+  ImageLayout layout[NIMG];  // layout in which to load it
+  ImageArchive archive;      // the archive last used, if any
+  char archivePath[4096];    // and its path
+} Pipeline;
+
+// Maximum number of kernel weights accepted by conv
+#define MAXKERNEL 1024
+
+// Parse a comma-separated list of up to max integers from str into v.
+// Returns the number of integers read, or -1 if str is not such a list.
+static int parseInts(const char* str, int* v, int max) {
+  int count = 0;
+  for (;;) {
+    char* end;
+    long x = strtol(str, &end, 10);
+    if (end == str || count >= max) return -1;
+    v[count++] = (int)x;
+    if (*end != ',') return *end == '\0' ? count : -1;
+    str = end + 1;
   }
+}
 
-  ImageInit();
+// Check kernel weights against the ImageConvolve preconditions.
+static int validKernel(const int* v, int count) {
+  long sumAbs = 0;
+  for (int i = 0; i < count; i++) {
+    if (v[i] < -32767 || v[i] > 32767) return 0;
+    sumAbs += labs(v[i]);
+  }
+  return sumAbs <= 65535;
+}
+
+// Parse a border policy name.  Returns -1 if invalid.
+static int parseBorder(const char* str) {
+  if (strcmp(str, "clamp") == 0) return BORDER_CLAMP;
+  if (strcmp(str, "mirror") == 0) return BORDER_MIRROR;
+  if (strcmp(str, "skip") == 0) return BORDER_SKIP;
+  return -1;
+}
+
+// Parse a conv operand: KX:KY:S[:B] or WxH:K:S[:B].
+// Fills kx/ky (separable) or kx (2D, with *kw, *kh set).
+// Returns nonzero if valid.
+static int parseConv(char* arg, int* kx, int* nx, int* ky, int* ny,
+                     int* kw, int* kh, int* shift, int* border) {
+  char* field[4];
+  char* save;
+  int nf = 0;
+  for (char* f = strtok_r(arg, ":", &save); f != NULL && nf < 4; f = strtok_r(NULL, ":", &save))
+    field[nf++] = f;
+  if (nf < 3) return 0;
+  *border = nf == 4 ? parseBorder(field[3]) : BORDER_CLAMP;
+  if (*border < 0 || sscanf(field[2], "%d", shift) != 1) return 0;
+  *kw = *kh = 0;
+  if (sscanf(field[0], "%dx%d", kw, kh) == 2 && strchr(field[0], 'x') != NULL) {
+    *nx = parseInts(field[1], kx, MAXKERNEL);
+    return *kw > 0 && *kw%2 == 1 && *kh > 0 && *kh%2 == 1 && *nx == *kw * *kh &&
+           validKernel(kx, *nx);
+  }
+  *kw = *kh = 0;
+  *nx = parseInts(field[0], kx, MAXKERNEL);
+  *ny = parseInts(field[1], ky, MAXKERNEL);
+  return *nx > 0 && *nx%2 == 1 && *ny > 0 && *ny%2 == 1 &&
+         validKernel(kx, *nx) && validKernel(ky, *ny);
+}
+
+// Resolve a file name relative to the pipeline working directory.
+// Returns name itself, or buf filled with the resolved path, or NULL with
+// errno set if the path does not fit in buf.
+static const char* resolve(Pipeline* p, const char* name, char* buf, size_t size) {
+  if (p->cwd == NULL || name[0] == '/') return name;
+  if (snprintf(buf, size, "%s/%s", p->cwd, name) >= (int)size) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  return buf;
+}
+
+// Make img[i] safe to modify in place.
+// Resident images are shared, so they are replaced by a private copy.
+// Returns nonzero on success.
+static int writable(Pipeline* p, int i) {
+  if (!p->shared[i]) return 1;
+  Image copy = ImageCrop(p->img[i], 0, 0, ImageWidth(p->img[i]), ImageHeight(p->img[i]));
+  if (copy == NULL) return 0;
+  StoreRelease(p->img[i]);
+  p->img[i] = copy;
+  p->shared[i] = 0;
+  return 1;
+}
+
+// Destroy (or release) img[i].
+static void release(Pipeline* p, int i) {
+  if (p->entry[i] != NULL) {
+    fclose(p->entry[i]);
+    p->entry[i] = NULL;
+  } else if (p->shared[i]) {
+    StoreRelease(p->img[i]);
+  } else {
+    ImageDestroy(&p->img[i]);
+  }
+}
+
+// Destroy (or release) all images in the buffer, and close the archive.
+static void cleanup(Pipeline* p) {
+  while (p->n > 0) {
+    p->n--;
+    release(p, p->n);
+  }
+  ArchiveClose(&p->archive);
+}
+
+// Open archive path, unless it is already open.
+// Returns nonzero on success.
+static int useArchive(Pipeline* p, const char* path) {
+  if (p->archive != NULL && strcmp(path, p->archivePath) == 0) return 1;
+  ArchiveClose(&p->archive);
+  if (strlen(path) >= sizeof p->archivePath) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  p->archive = ArchiveOpen(path);
+  strcpy(p->archivePath, path);
+  return p->archive != NULL;
+}
+
+// Is name safe to use as a file name in a directory?
+static int plainName(const char* name) {
+  return name[0] != '\0' && strchr(name, '/') == NULL &&
+         strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// Result cache
+//
+// With a cache, every image in the buffer has a key: the hash of its
+// pixels, for images loaded or created, or the key of the operation that
+// produced it (see CacheKey), which depends on the keys of its inputs and
+// on its canonical text.  Before an operation with a cacheable result is
+// run, its key is looked up in the cache.  If found, the operation is
+// skipped and the cache entry is opened but only loaded when some later
+// operation reads it, so a run of cached operations costs only a lookup
+// each.  Otherwise, the operation runs and its result is added to the
+// cache.
 
+// How operations use the buffer.
+typedef struct {
+  const char* name;
+  int operands;     // number of operands
+  int inputs;       // images read: CURR (1), PRED and CURR (2), or all (-1)
+  enum { RESULT_NONE, RESULT_INPLACE, RESULT_NEW } result;  // cacheable result
+  const char* reals;  // fields of the first operand read as doubles ('f'), if any
+} OpInfo;
+
+static const OpInfo ops[] = {
+  { "info", 0, 1, RESULT_NONE },
+  { "neg", 0, 1, RESULT_INPLACE },
+  { "thr", 1, 1, RESULT_INPLACE },
+  { "bri", 1, 1, RESULT_INPLACE, "f" },
+  { "equalize", 0, 1, RESULT_INPLACE },
+  { "stretch", 1, 1, RESULT_INPLACE, "ff" },
+  { "layout", 1, 1, RESULT_NONE },
+  { "rotate", 0, 1, RESULT_NEW },
+  { "mirror", 0, 1, RESULT_NEW },
+  { "crop", 1, 1, RESULT_NEW },
+  { "resize", 1, 1, RESULT_NEW },
+  { "rotdeg", 1, 1, RESULT_NEW, "f" },
+  { "half", 0, 1, RESULT_NEW },
+  { "pyramid", 2, 1, RESULT_NONE },
+  { "paste", 1, 2, RESULT_INPLACE },
+  { "blend", 1, 2, RESULT_INPLACE, "--f" },
+  { "composite", 1, -1, RESULT_INPLACE, "--f" },
+  { "locate", 0, 2, RESULT_NONE },
+  { "blobs", 1, 1, RESULT_NONE },
+  { "cmp", 0, 2, RESULT_NONE },
+  { "hash", 0, 1, RESULT_NONE },
+  { "diff", 0, 2, RESULT_NONE },
+  { "blur", 1, 1, RESULT_INPLACE },
+  { "median", 1, 1, RESULT_INPLACE },
+  { "erode", 1, 1, RESULT_INPLACE },
+  { "dilate", 1, 1, RESULT_INPLACE },
+  { "open", 1, 1, RESULT_INPLACE },
+  { "close", 1, 1, RESULT_INPLACE },
+  { "gauss", 1, 1, RESULT_INPLACE, "f" },
+  { "conv", 1, 1, RESULT_INPLACE },
+  { "save", 1, 1, RESULT_NONE },
+  { "store", 1, 1, RESULT_NONE },
+};
+
+// Canonical text of operation av[0] (described by op) with operands
+// av[1..count], in buf.  The fields the operation reads as doubles are
+// written in a standard form, so that, e.g., "bri 1.5" and "bri 1.50" are
+// the same operation.  Other fields are kept as written: sscanf reads
+// "1e2" or "0x10" as 1 or 0 with %d, unlike strtod.
+// Returns 0 if the text does not fit in buf.
+static int canonical(const OpInfo* op, char* av[], int count, char* buf, size_t size) {
+  size_t len = snprintf(buf, size, "%s", av[0]);
+  for (int i = 1; i <= count && len < size; i++) {
+    const char* s = av[i];
+    len += snprintf(buf + len, size - len, " ");
+    for (int f = 0; *s != '\0' && len < size; f++) {
+      char* end;
+      double v = strtod(s, &end);
+      size_t field = strcspn(s, ",:");
+      int real = i == 1 && op->reals != NULL && f < (int)strlen(op->reals) && op->reals[f] == 'f';
+      if (real && end != s && end == s + field) {
+        len += snprintf(buf + len, size - len, "%.17g", v);
+      } else {
+        len += snprintf(buf + len, size - len, "%.*s", (int)field, s);
+      }
+      s += field;
+      if (*s != '\0' && len < size) buf[len++] = *s++;
+    }
+  }
+  if (len >= size) return 0;
+  buf[len] = '\0';
+  return 1;
+}
+
+// Load the images from first to n-1 that are still cache entries.
+// Returns nonzero on success.
+static int loadEntries(Pipeline* p, int first, int n) {
+  for (int i = first < 0 ? 0 : first; i < n; i++) {
+    if (p->entry[i] == NULL) continue;
+    p->img[i] = ImageRead(p->entry[i], p->layout[i]);
+    int errsave = errno;
+    fclose(p->entry[i]);
+    errno = errsave;
+    p->entry[i] = NULL;
+    if (p->img[i] == NULL) return 0;
+  }
+  return 1;
+}
+
+// Prepare operation av[0] (followed by ac-1 arguments) on a buffer with
+// *n images.  If its result is in the cache, take it instead of running the
+// operation, and return the number of arguments the operation takes.
+// Otherwise, load the images it reads, set *result to the key under which
+// to cache its result (0 if none) and return 0; or return -1 if loading
+// fails.  If the operation modifies CURR but its text is too long for a
+// key, *rehash is set instead.
+static int cacheBefore(Pipeline* p, int* n, int ac, char* av[], uint64* result, int* rehash) {
+  const OpInfo* op = NULL;
+  for (size_t i = 0; i < sizeof ops / sizeof ops[0] && op == NULL; i++) {
+    if (strcmp(av[0], ops[i].name) == 0) op = &ops[i];
+  }
+  *result = 0;
+  *rehash = 0;
+  if (op == NULL) return 0;  // reads no images
+  int first = op->inputs < 0 ? 0 : *n - op->inputs;
+  char text[4096];
+  int cacheable = op->result != RESULT_NONE && ac > op->operands &&
+                  *n >= (op->inputs < 0 ? 2 : op->inputs) &&
+                  !(op->result == RESULT_NEW && *n >= NIMG);
+  if (cacheable && !canonical(op, av, op->operands, text, sizeof text)) {
+    *rehash = op->result == RESULT_INPLACE;  // CURR changes, with no key
+  } else if (cacheable) {
+    *result = CacheKey(*n - first, p->key + first, text);
+    FILE* f = CacheGet(*result);
+    if (f != NULL) {
+      int i = *n - 1;
+      ImageLayout layout = p->entry[i] != NULL ? p->layout[i] : ImageGetLayout(p->img[i]);
+      if (op->result == RESULT_INPLACE) {
+        release(p, i);
+      } else {
+        i = (*n)++;
+      }
+      p->img[i] = NULL;
+      p->shared[i] = 0;
+      p->entry[i] = f;
+      p->layout[i] = layout;
+      p->key[i] = *result;
+      fprintf(p->log, "Cached %s -> I%d\n", text, i);
+      return 1 + op->operands;
+    }
+  }
+  return loadEntries(p, first, *n) ? 0 : -1;
+}
+
+// After an operation that left n images in the buffer, n0 before: set the
+// keys of the images it created (or modified with no key, if rehash), and
+// cache its result.
+static void cacheAfter(Pipeline* p, int n0, int n, uint64 result, int rehash) {
+  for (int i = n0; i < n - (result != 0); i++) p->key[i] = ImageHash(p->img[i]);
+  if (rehash && n > 0 && p->img[n-1] != NULL) p->key[n-1] = ImageHash(p->img[n-1]);
+  if (result == 0) return;
+  p->key[n-1] = result;
+  int errsave = errno;
+  if (!CacheAdd(result, p->img[n-1])) {
+    fprintf(p->log, "Caching I%d failed: %s\n", n-1, strerror(errno));
+  }
+  errno = errsave;
+}
+
+// Run the operations in av[0..ac-1] on pipeline p.
+// Returns 0 on success, or an index into errors[].
+static int run(Pipeline* p, int ac, char* av[]) {
   int err = 0;
   int x, y, w, h;
+  char path[4096];
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+  Image* img = p->img;   // the image buffer
+  const int N = NIMG;    // buffer capacity
+  int n = p->n;          // number of images created
 
-  int k = 1;
+  int k = 0;
   while (k < ac) {
+    int n0 = n;
+    uint64 result = 0;
+    int rehash = 0;
+    if (p->cache) {
+      int skip = cacheBefore(p, &n, ac-k, av+k, &result, &rehash);
+      if (skip < 0) { err = 4; break; }
+      if (skip > 0) { k += skip; continue; }
+    }
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
+      fprintf(p->log, "Info on I%d\n", n-1);
       uint8 min, max;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
       ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      fprintf(p->out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(p->out, "# Gray level range: [%hhu, %hhu]\n", min, max);
+      uint64 hist[256];
+      double mean, variance;
+      ImageHistogram(img[n-1], hist);
+      ImageHistMoments(hist, &mean, &variance);
+      fprintf(p->out, "# Mean: %.3f\n# Std deviation: %.3f\n", mean, sqrt(variance));
+      fprintf(p->out, "# Percentiles (1,5,25,50,75,95,99): %hhu %hhu %hhu %hhu %hhu %hhu %hhu\n",
+              ImageHistPercentile(hist, 0.01), ImageHistPercentile(hist, 0.05),
+              ImageHistPercentile(hist, 0.25), ImageHistPercentile(hist, 0.50),
+              ImageHistPercentile(hist, 0.75), ImageHistPercentile(hist, 0.95),
+              ImageHistPercentile(hist, 0.99));
+      fprintf(p->out, "# Otsu threshold: %hhu\n", ImageHistOtsu(hist));
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
+    } else if (strcmp(av[k], "mem") == 0) {
+      ImageMemStats mem;
+      ImageMemory(&mem);
+      fprintf(p->out, "# Memory: %" PRIu64 " bytes live, %" PRIu64 " peak\n", mem.live, mem.peak);
+      fprintf(p->out, "# Allocated: %" PRIu64 " bytes in %" PRIu64 " allocations\n", mem.total, mem.allocs);
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Negating I%d\n", n-1);
       ImageNegative(img[n-1]);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Thresholding I%d at %d\n", n-1, thr);
       ImageThreshold(img[n-1], (uint8)thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Brightening I%d by %lf\n", n-1, factor);
       ImageBrighten(img[n-1], factor);
+    } else if (strcmp(av[k], "equalize") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Equalizing I%d\n", n-1);
+      ImageEqualize(img[n-1]);
+    } else if (strcmp(av[k], "stretch") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double lo, hi;
+      if (sscanf(av[k], "%lf,%lf", &lo, &hi) != 2) { err = 5; break; }
+      if (!(0.0 <= lo && lo <= hi && hi <= 1.0)) { err = 5; break; }   // precondition check!
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Stretching I%d between percentiles %.3f and %.3f\n", n-1, lo, hi);
+      ImageStretch(img[n-1], lo, hi);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
+      fprintf(p->log, "Creating black image (%d,%d) -> I%d\n", w, h, n);
       img[n] = ImageCreate(w, h, PixMax);
       if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
+      fprintf(p->log, "Rotating I%d -> I%d\n", n-1, n);
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
       n++;
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
+      fprintf(p->log, "Mirroring I%d -> I%d\n", n-1, n);
       img[n] = ImageMirror(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
       n++;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
@@ -164,10 +604,96 @@ int main(int ac, char* av[]) {
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      fprintf(p->log, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
+      n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      char name[16] = "bilinear";
+      if (sscanf(av[k], "%d,%d,%15s", &w, &h, name) < 2) { err = 5; break; }
+      ImageResizeMode mode;
+      if (strcmp(name, "nearest") == 0) mode = RESIZE_NEAREST;
+      else if (strcmp(name, "bilinear") == 0) mode = RESIZE_BILINEAR;
+      else if (strcmp(name, "area") == 0) mode = RESIZE_AREA;
+      else { err = 5; break; }
+      if (w <= 0 || h <= 0) { err = 5; break; }   // precondition check!
+      if (ImageWidth(img[n-1]) == 0 || ImageHeight(img[n-1]) == 0) { err = 5; break; }
+      fprintf(p->log, "Resizing I%d to %dx%d (%s) -> I%d\n", n-1, w, h, name, n);
+      img[n] = ImageResize(img[n-1], w, h, mode);
+      if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
+      n++;
+    } else if (strcmp(av[k], "rotdeg") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      double angle;
+      int fill = 0;
+      if (sscanf(av[k], "%lf,%d", &angle, &fill) < 1) { err = 5; break; }
+      if (fill < 0 || fill > ImageMaxval(img[n-1])) { err = 5; break; }   // precondition check!
+      // Rotation about the center; y grows downwards, so counter-clockwise
+      // on screen means a negative angle in the usual formulas.
+      double t = angle * M_PI / 180.0;
+      double cx = (ImageWidth(img[n-1]) - 1) / 2.0;
+      double cy = (ImageHeight(img[n-1]) - 1) / 2.0;
+      double matrix[6] = {
+        cos(t), sin(t), cx - cos(t)*cx - sin(t)*cy,
+        -sin(t), cos(t), cy + sin(t)*cx - cos(t)*cy,
+      };
+      fprintf(p->log, "Rotating I%d by %.3f degrees -> I%d\n", n-1, angle, n);
+      img[n] = ImageWarpAffine(img[n-1], matrix, ImageWidth(img[n-1]), ImageHeight(img[n-1]),
+                               (uint8)fill, RESIZE_BILINEAR);
+      if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
+      n++;
+    } else if (strcmp(av[k], "layout") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      ImageLayout layout;
+      if (strcmp(av[k], "raster") == 0) layout = LAYOUT_RASTER;
+      else if (strcmp(av[k], "tiled") == 0) layout = LAYOUT_TILED;
+      else { err = 5; break; }
+      fprintf(p->log, "Copying I%d with %s layout -> I%d\n", n-1, av[k], n);
+      img[n] = ImageCopyLayout(img[n-1], layout);
+      if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
+      n++;
+    } else if (strcmp(av[k], "half") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(p->log, "Downsampling I%d -> I%d\n", n-1, n);
+      img[n] = ImageDownsample2x(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
       n++;
+    } else if (strcmp(av[k], "pyramid") == 0) {
+      if (k+2 >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int levels;
+      if (sscanf(av[++k], "%d", &levels) != 1 || levels < 1 || levels > 30) { err = 5; break; }
+      const char* file = av[++k];
+      Image pyr[31];
+      fprintf(p->log, "Building %d-level pyramid of I%d\n", levels, n-1);
+      int built = ImagePyramid(img[n-1], 1, pyr, levels+1);
+      if (built == 0) { err = 4; break; }
+      for (int i = 1; i < built && err == 0; i++) {
+        // Insert -i before the extension
+        char name[4096];
+        const char* dot = strrchr(file, '.');
+        if (dot == NULL || strchr(dot, '/') != NULL) dot = file + strlen(file);
+        snprintf(name, sizeof name, "%.*s-%d%s", (int)(dot - file), file, i, dot);
+        fprintf(p->log, "Saving %s <- level %d (%dx%d)\n", name, i, ImageWidth(pyr[i]), ImageHeight(pyr[i]));
+        const char* resolved = resolve(p, name, path, sizeof path);
+        if (resolved == NULL) err = 13;
+        else if (AsyncSave(pyr[i], resolved) == 0) err = 4;
+      }
+      ImagePyramidDestroy(pyr, built);
+      if (err != 0) break;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -175,7 +701,8 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
       ImagePaste(img[n-1], x, y, img[n-2]);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
@@ -185,44 +712,366 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
+    } else if (strcmp(av[k], "composite") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      double alpha;
+      char name[16] = "normal";
+      if (sscanf(av[k], "%d,%d,%lf,%15s", &x, &y, &alpha, name) < 3) { err = 5; break; }
+      ImageLayer layers[NIMG];
+      for (int i = 0; i < n-1; i++) {
+        layers[i] = (ImageLayer){ .img = img[i], .x = x, .y = y, .alpha = alpha, .mask = NULL };
+        if (!ImageValidRect(img[n-1], x, y, ImageWidth(img[i]), ImageHeight(img[i]))) { err = 6; break; }
+        if (strcmp(name, "normal") == 0) layers[i].mode = BLEND_NORMAL;
+        else if (strcmp(name, "multiply") == 0) layers[i].mode = BLEND_MULTIPLY;
+        else if (strcmp(name, "screen") == 0) layers[i].mode = BLEND_SCREEN;
+        else if (strcmp(name, "max") == 0) layers[i].mode = BLEND_MAX;
+        else { err = 5; break; }
+      }
+      if (err != 0) break;
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Compositing I0..I%d into I%d@(%d,%d) with alpha=%.3f (%s)\n", n-2, n-1, x, y, alpha, name);
+      ImageComposite(img[n-1], layers, n-1);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
+      fprintf(p->log, "Locating I%d in I%d\n", n-2, n-1);
       if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
+        fprintf(p->out, "# FOUND (%d,%d)\n", x, y);
       } else {
-        printf("# NOTFOUND\n");
+        fprintf(p->out, "# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "blobs") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int conn, threads = 1;
+      if (sscanf(av[k], "%d,%d", &conn, &threads) < 1) { err = 5; break; }
+      if ((conn != 4 && conn != 8) || threads < 1) { err = 5; break; }   // precondition check!
+      fprintf(p->log, "Labelling regions of I%d (%d-connected)\n", n-1, conn);
+      ImageRegion* regions;
+      int count = ImageLabel(img[n-1], conn, threads, NULL, &regions);
+      if (count < 0) { err = 4; break; }
+      fprintf(p->out, "# Regions: %d\n", count);
+      fprintf(p->out, "# label x y w h area cx cy\n");
+      for (int i = 0; i < count; i++) {
+        const ImageRegion* r = &regions[i];
+        fprintf(p->out, "%d %d %d %d %d %" PRIu64 " %.2f %.2f\n",
+                i+1, r->x, r->y, r->w, r->h, r->area, r->cx, r->cy);
       }
+      free(regions);
+    } else if (strcmp(av[k], "cmp") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(p->log, "Comparing I%d with I%d\n", n-2, n-1);
+      if (!ImageEqual(img[n-2], img[n-1])) { err = 11; break; }
+      fprintf(p->out, "# EQUAL\n");
+    } else if (strcmp(av[k], "hash") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(p->log, "Hashing I%d\n", n-1);
+      fprintf(p->out, "# HASH %016" PRIx64 "\n", ImageHash(img[n-1]));
+    } else if (strcmp(av[k], "diff") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (ImageWidth(img[n-2]) != ImageWidth(img[n-1]) ||
+          ImageHeight(img[n-2]) != ImageHeight(img[n-1])) { err = 11; break; }   // precondition check!
+      fprintf(p->log, "Diff of I%d and I%d\n", n-2, n-1);
+      uint64 changed;
+      int maxdiff;
+      ImageRegion* regions;
+      int count = ImageDiff(img[n-2], img[n-1], &changed, &maxdiff, &regions);
+      if (count < 0) { err = 4; break; }
+      fprintf(p->out, "# Changed pixels: %" PRIu64 " (max difference %d)\n", changed, maxdiff);
+      fprintf(p->out, "# Regions: %d\n", count);
+      fprintf(p->out, "# region x y w h area\n");
+      for (int i = 0; i < count; i++) {
+        const ImageRegion* r = &regions[i];
+        fprintf(p->out, "%d %d %d %d %d %" PRIu64 "\n", i+1, r->x, r->y, r->w, r->h, r->area);
+      }
+      free(regions);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
       ImageBlur(img[n-1], dx, dy);
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0 || (2L*dx+1)*(2L*dy+1) > 65535) { err = 5; break; }   // precondition check!
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Median filter I%d with %dx%d window\n", n-1, 2*dx+1, 2*dy+1);
+      if (!ImageMedian(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Morphology %s I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+      int ok = strcmp(op, "erode") == 0 ? ImageErode(img[n-1], dx, dy) :
+               strcmp(op, "dilate") == 0 ? ImageDilate(img[n-1], dx, dy) :
+               strcmp(op, "open") == 0 ? ImageOpen(img[n-1], dx, dy) :
+               ImageClose(img[n-1], dx, dy);
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      char name[16] = "clamp";
+      if (sscanf(av[k], "%lf,%15s", &sigma, name) < 1) { err = 5; break; }
+      int border = parseBorder(name);
+      if (!(sigma > 0.0 && sigma <= GAUSS_MAX_SIGMA) || border < 0) { err = 5; break; }   // precondition check!
+      if (!writable(p, n-1)) { err = 4; break; }
+      fprintf(p->log, "Gaussian blur I%d with sigma=%.3f\n", n-1, sigma);
+      if (!ImageGaussianBlur(img[n-1], sigma, border)) { err = 4; break; }
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int kx[MAXKERNEL], ky[MAXKERNEL];
+      int nx = 0, ny = 0, kw, kh, shift, border;
+      char operand[4096];
+      snprintf(operand, sizeof operand, "%s", av[k]);
+      if (!parseConv(operand, kx, &nx, ky, &ny, &kw, &kh, &shift, &border)) { err = 5; break; }
+      if (!writable(p, n-1)) { err = 4; break; }
+      int ok;
+      if (kw > 0) {
+        fprintf(p->log, "Convolving I%d with %dx%d kernel\n", n-1, kw, kh);
+        ok = ImageConvolve(img[n-1], kx, kw, kh, shift, border);
+      } else {
+        fprintf(p->log, "Convolving I%d with %dx%d separable kernel\n", n-1, nx, ny);
+        ok = ImageConvolveSeparable(img[n-1], kx, nx, ky, ny, shift, border);
+      }
+      if (!ok) { err = 4; break; }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      fprintf(p->log, "Saving %s <- I%d\n", av[k], n-1);
+      const char* file = resolve(p, av[k], path, sizeof path);
+      if (file == NULL) { err = 13; break; }
+      if (AsyncSave(img[n-1], file) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "store") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (!p->server) { err = 8; break; }
+      fprintf(p->log, "Storing I%d as @%s\n", n-1, av[k]);
+      // The store takes the image; the buffer keeps a shared reference.
+      Image res = p->shared[n-1] ? ImageCrop(img[n-1], 0, 0, ImageWidth(img[n-1]), ImageHeight(img[n-1])) : img[n-1];
+      if (res == NULL) { err = 4; break; }
+      if (!StorePut(av[k], res)) {
+        if (p->shared[n-1]) ImageDestroy(&res);
+        err = 4; break;
+      }
+      if (p->shared[n-1]) StoreRelease(img[n-1]);
+      img[n-1] = StoreAcquire(av[k]);
+      p->shared[n-1] = 1;
+    } else if (strcmp(av[k], "drop") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!p->server) { err = 8; break; }
+      fprintf(p->log, "Dropping @%s\n", av[k]);
+      if (!StoreDrop(av[k])) { err = 9; break; }
+    } else if (strcmp(av[k], "list") == 0) {
+      if (!p->server) { err = 8; break; }
+      StoreList(p->out);
+    } else if (strcmp(av[k], "member") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      const char* arch = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(p->log, "Loading %s %s -> I%d\n", arch, av[k], n);
+      if ((arch = resolve(p, arch, path, sizeof path)) == NULL) { err = 13; break; }
+      if (!useArchive(p, arch)) { err = 12; break; }
+      int index = -1;
+      if (av[k][0] == '#') {
+        char* end;
+        long i = strtol(av[k]+1, &end, 10);
+        if (end == av[k]+1 || *end != '\0' || i < 0 || i >= ArchiveCount(p->archive)) { err = 5; break; }
+        index = (int)i;
+      } else if ((index = ArchiveFind(p->archive, av[k])) < 0) {
+        err = 12; break;
+      }
+      img[n] = ImageLoadFromArchiveIndex(p->archive, index);
+      if (img[n] == NULL) { err = errno == EINVAL ? 12 : 4; break; }
+      p->shared[n] = 0;
+      n++;
+    } else if (strcmp(av[k], "members") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(p->log, "Members of %s\n", av[k]);
+      const char* arch = resolve(p, av[k], path, sizeof path);
+      if (arch == NULL) { err = 13; break; }
+      if (!useArchive(p, arch)) { err = 12; break; }
+      ArchiveMember m;
+      for (int i = 0; i < ArchiveCount(p->archive) && err == 0; i++) {
+        if (!ArchiveGet(p->archive, i, &m)) { err = 12; break; }
+        fprintf(p->out, "# %d %s %dx%d %d\n", i, m.name, m.width, m.height, m.maxval);
+      }
+      if (err) break;
+    } else if (strcmp(av[k], "unpack") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      const char* arch = av[k];
+      if (++k >= ac) { err = 1; break; }
+      fprintf(p->log, "Unpacking %s -> %s\n", arch, av[k]);
+      if ((arch = resolve(p, arch, path, sizeof path)) == NULL) { err = 13; break; }
+      if (!useArchive(p, arch)) { err = 12; break; }
+      const char* dir = resolve(p, av[k], path, sizeof path);
+      char file[4096];
+      if (dir == NULL) { err = 13; break; }
+      if (mkdir(dir, 0777) < 0 && errno != EEXIST) { err = 12; break; }
+      ArchiveMember m;
+      for (int i = 0; i < ArchiveCount(p->archive) && err == 0; i++) {
+        if (!ArchiveGet(p->archive, i, &m)) { err = 12; break; }
+        if (!plainName(m.name)) { errno = EINVAL; err = 12; break; }
+        Image t = ImageLoadFromArchiveIndex(p->archive, i);
+        if (t == NULL) { err = 4; break; }
+        if (snprintf(file, sizeof file, "%s/%s", dir, m.name) >= (int)sizeof file) {
+          errno = ENAMETOOLONG;
+          err = 12;
+        } else if (AsyncSave(t, file) == 0) {
+          err = 4;
+        }
+        ImageDestroy(&t);
+      }
+      if (err) break;
+    } else if (strcmp(av[k], "pack") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(p->log, "Packing %d files -> %s\n", ac-k-1, av[k]);
+      const char* arch = resolve(p, av[k], path, sizeof path);
+      if (arch == NULL) { err = 13; break; }
+      ArchiveWriter wr = ArchiveCreate(arch);
+      if (wr == NULL) { err = 12; break; }
+      while (k+1 < ac && err == 0) {
+        const char* name = strrchr(av[++k], '/');
+        name = name != NULL ? name+1 : av[k];
+        const char* file = resolve(p, av[k], path, sizeof path);
+        if (file == NULL) { err = 13; break; }
+        Image t = AsyncLoad(file);
+        if (t == NULL) { err = 4; break; }
+        if (!ArchiveAdd(wr, name, t)) err = 12;
+        ImageDestroy(&t);
+      }
+      if (err) {
+        ArchiveCancel(wr);
+        break;
+      }
+      if (!ArchiveFinish(wr)) { err = 12; break; }
+    } else if (av[k][0] == '@') {  // resident image
+      if (n >= N) { err = 3; break; }
+      if (!p->server) { err = 8; break; }
+      fprintf(p->log, "Using %s -> I%d\n", av[k], n);
+      img[n] = StoreAcquire(av[k]+1);
+      if (img[n] == NULL) { err = 9; break; }
+      p->shared[n] = 1;
+      n++;
     } else {  // image file
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      fprintf(p->log, "Loading %s -> I%d\n", av[k], n);
+      const char* file = resolve(p, av[k], path, sizeof path);
+      if (file == NULL) { err = 13; break; }
+      img[n] = AsyncLoad(file);
       if (img[n] == NULL) { err = 4; break; }
+      p->shared[n] = 0;
       n++;
     }
+    if (p->cache) cacheAfter(p, n0, n, result, rehash);
     k++;
   }
+  p->n = n;
+  return err;
+}
+
+// Number of file buffers for asynchronous I/O
+#define IOBUFS 4
+
+// Declare the files the pipeline av[0..ac-1] may load for read-ahead:
+// all arguments, except the file operands of save and pyramid, and the
+// archive and directory operands of the archive operations.
+static void readAhead(int ac, char* av[]) {
+  char** list = malloc((ac > 0 ? ac : 1)*sizeof(char*));
+  if (list == NULL) return;
+  int count = 0;
+  for (int k = 0; k < ac; k++) {
+    if (k >= 1 && strcmp(av[k-1], "save") == 0) continue;
+    if (k >= 2 && strcmp(av[k-2], "pyramid") == 0) continue;
+    if (k >= 1 && (strcmp(av[k-1], "member") == 0 || strcmp(av[k-1], "members") == 0 ||
+                   strcmp(av[k-1], "unpack") == 0 || strcmp(av[k-1], "pack") == 0)) continue;
+    if (k >= 2 && (strcmp(av[k-2], "member") == 0 || strcmp(av[k-2], "unpack") == 0)) continue;
+    if (av[k][0] == '@') continue;
+    list[count++] = av[k];
+  }
+  AsyncReadAhead(count, list);
+  free(list);
+}
+
+// Server request handler: run one pipeline on a fresh image buffer.
+static int serve(int ac, char* av[], const char* cwd, FILE* out, FILE* log) {
+  Pipeline p = { .n = 0, .out = out, .log = log, .cwd = cwd, .server = 1 };
+  errno = 0;
+  int err = run(&p, ac, av);
+  int errsave = errno;
+  cleanup(&p);
+
+  // Same format as error()
+  fprintf(log, "%s: ", program_name);
+  fprintf(log, errors[err], ImageErrMsg());
+  if (errsave) fprintf(log, ": %s", strerror(errsave));
+  fputc('\n', log);
+  return err;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  if (strcmp(av[1], "--client") == 0) {
+    if (ac < 3) error(5, 0, "\n%s", USAGE);
+    int status = ClientRun(av[2], ac-3, av+3);
+    if (status < 0) error(4, errno, "Connecting to %s", av[2]);
+    return status;
+  }
+
+  ImageInit();
+
+  if (strcmp(av[1], "--serve") == 0) {
+    int nthreads = 4;
+    if (ac < 3) error(5, 0, "\n%s", USAGE);
+    if (ac > 3 && (sscanf(av[3], "%d", &nthreads) != 1 || nthreads < 1)) {
+      error(5, 0, errors[5]);
+    }
+    ServerRun(av[2], nthreads, serve);
+    error(4, errno, "Serving on %s", av[2]);
+  }
+
+  Pipeline p = { .n = 0, .out = stdout, .log = stderr, .cwd = NULL, .server = 0 };
+  const char* io = getenv("IMAGETOOL_IO");
+  if ((io == NULL || strcmp(io, "sync") != 0) &&
+      AsyncStart(IOBUFS, io == NULL || strcmp(io, "threads") != 0)) {
+    fprintf(p.log, "Asynchronous I/O with %s\n", AsyncMethod());
+    readAhead(ac-1, av+1);
+  }
+  const char* cache = getenv("IMAGETOOL_CACHE");
+  if (cache != NULL && cache[0] != '\0') {
+    const char* size = getenv("IMAGETOOL_CACHE_SIZE");
+    uint64 megabytes = size != NULL ? strtoull(size, NULL, 10) : 1024;
+    if (!CacheOpen(cache, megabytes << 20)) error(4, errno, "Opening cache %s", cache);
+    fprintf(p.log, "Caching results in %s\n", cache);
+    p.cache = 1;
+  }
+  int err = run(&p, ac-1, av+1);
+  if (!AsyncSync() && err == 0) err = 10;
+  AsyncStop();
   
   // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
-  }
+  cleanup(&p);
+  CacheClose();
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
 }
-
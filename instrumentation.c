@@ -82,6 +82,9 @@ double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
+/// Function to update counters that are not simple sums (or NULL)
+void (*InstrUpdate)(int reset) = NULL;  ///extern
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
@@ -105,6 +108,7 @@ void InstrCalibrate(void) { ///
 void InstrReset(void) { ///
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  if (InstrUpdate != NULL) InstrUpdate(1);
   InstrTime = cpu_time();
 }
 
@@ -114,6 +118,7 @@ void InstrPrint(void) { ///
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
+  if (InstrUpdate != NULL) InstrUpdate(0);
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
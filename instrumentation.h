@@ -40,6 +40,12 @@ extern double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
 
+/// Function to update counters that are not simple sums, such as current
+/// and peak values, or NULL (the default).  It is called by InstrReset,
+/// with reset = 1, after the counters are set to zero, and by InstrPrint,
+/// with reset = 0, before they are printed.
+extern void (*InstrUpdate)(int reset);  ///extern
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.